@@ -0,0 +1,466 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iterator>
+#include <random>
+#include <unordered_set>
+#include <boost/program_options.hpp>
+#include <pagedfile/PagedFile.h>
+
+using namespace pagedfile;
+namespace po = boost::program_options;
+namespace fs = std::filesystem;
+
+// Benchmarks the archive hot paths on a synthetic data set and writes a JSON
+// report. Runs are warm-cache, each measurement is the best of --repeat runs.
+class PagedFileBench {
+public:
+
+  struct Config {
+    uint32_t files {2000};
+    std::string size_dist {"loguniform"};  // fixed, uniform or loguniform
+    uint64_t min_size {1024};
+    uint64_t max_size {256 * 1024};
+    double compressibility {0.5};  // share of content drawn from a small dictionary
+    uint32_t repeat {3};
+    uint64_t seed {1};
+    fs::path work_dir;
+    std::string pfar;
+    unsigned jobs {1};
+  };
+
+  explicit PagedFileBench(Config config) : config_(std::move(config)) {
+  }
+
+  int Run(std::ostream &report) {
+    std::error_code ec;
+    fs::create_directories(config_.work_dir / "input", ec);
+    if (ec) {
+      std::cerr << "Error: failed to create " << config_.work_dir.string() << std::endl;
+      return 1;
+    }
+
+    Generate();
+
+    static const std::pair<const char *, uint16_t> kFormats[] = {
+      {"plain", PagedFile::kPlain},
+      {"lz4block", PagedFile::kLZ4Block},
+      {"lz4frame", PagedFile::kLZ4Frame},
+      {"lz4chunked", PagedFile::kLZ4Chunked},
+    };
+
+    for (const auto &format : kFormats) {
+      auto fn = ArchivePath(format.first);
+      BenchAppend(format.first, format.second, fn);
+      BenchOpen(format.first);
+      BenchReadPage(format.first, fn);
+      BenchReadPages(format.first, fn);
+      BenchPageIStream(format.first, fn);
+    }
+    BenchRemovePages(ArchivePath("lz4block"));
+
+    if (!config_.pfar.empty()) {
+      BenchPfar(false);
+      BenchPfar(true);
+    }
+
+    WriteReport(report);
+    fs::remove_all(config_.work_dir, ec);
+    return 0;
+  }
+
+private:
+
+  struct Result {
+    std::string name;
+    std::string variant;
+    double seconds {0};
+    uint64_t bytes {0};  // uncompressed payload processed per run
+    uint64_t pages {0};
+    uint64_t archive_bytes {0};
+  };
+
+  fs::path ArchivePath(const std::string &name) const {
+    return config_.work_dir / (name + ".pf");
+  }
+
+  uint64_t NextSize(std::mt19937_64 &rng) const {
+    if (config_.size_dist == "fixed" || config_.max_size <= config_.min_size) {
+      return config_.min_size;
+    } else if (config_.size_dist == "uniform") {
+      return std::uniform_int_distribution<uint64_t>(config_.min_size, config_.max_size)(rng);
+    }
+    double lo = std::log((double)std::max<uint64_t>(config_.min_size, 1));
+    double hi = std::log((double)config_.max_size);
+    return (uint64_t)std::exp(std::uniform_real_distribution<double>(lo, hi)(rng));
+  }
+
+  // content mixes random bytes with runs from a small dictionary, the share of
+  // dictionary runs controls how well pages compress
+  void Generate() {
+    std::mt19937_64 rng(config_.seed);
+    std::string dictionary(4096, 0);
+    for (auto &c : dictionary) {
+      c = (char)('a' + rng() % 26);
+    }
+
+    std::bernoulli_distribution from_dictionary(config_.compressibility);
+    static const size_t kRun = 64;
+    contents_.resize(config_.files);
+    total_bytes_ = 0;
+    for (uint32_t i = 0; i < config_.files; ++i) {
+      auto &content = contents_[i];
+      content.resize(NextSize(rng));
+      for (size_t pos = 0; pos < content.size(); pos += kRun) {
+        size_t run = std::min(kRun, content.size() - pos);
+        if (from_dictionary(rng)) {
+          memcpy(&content[pos], &dictionary[rng() % (dictionary.size() - kRun)], run);
+        } else {
+          for (size_t k = 0; k < run; ++k) {
+            content[pos + k] = (char)rng();
+          }
+        }
+      }
+      total_bytes_ += content.size();
+
+      std::ofstream out(InputPath(i).string(), std::ios::binary);
+      out.write(content.data(), content.size());
+    }
+  }
+
+  fs::path InputPath(uint32_t i) const {
+    return config_.work_dir / "input" / ("f" + std::to_string(i) + ".bin");
+  }
+
+  // best of config_.repeat runs, prepare runs untimed before each one
+  double Measure(const std::function<void()> &run,
+    const std::function<void()> &prepare = nullptr) {
+
+    double best = 0;
+    for (uint32_t r = 0; r < std::max(1u, config_.repeat); ++r) {
+      if (prepare) {
+        prepare();
+      }
+      auto start = std::chrono::steady_clock::now();
+      run();
+      double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+      best = r == 0 ? seconds : std::min(best, seconds);
+    }
+    return best;
+  }
+
+  uint64_t FileSize(const fs::path &fn) const {
+    std::error_code ec;
+    auto size = fs::file_size(fn, ec);
+    return ec ? 0 : (uint64_t)size;
+  }
+
+  void BenchAppend(const std::string &variant, uint16_t format, const fs::path &fn) {
+    Result result {"append_page", variant};
+    result.seconds = Measure([&]() {
+      PagedFile pf;
+      pf.Open(fn.string().c_str(), PagedFile::kCreate);
+      for (uint32_t i = 0; i < contents_.size(); ++i) {
+        pf.AppendPage(i, "f" + std::to_string(i), format | PagedFile::kFile,
+          contents_[i].data(), contents_[i].size());
+      }
+      pf.Close(true);
+    });
+    result.bytes = total_bytes_;
+    result.pages = contents_.size();
+    result.archive_bytes = FileSize(fn);
+    results_.push_back(result);
+
+    // a copy with a version 2 table, for the open benchmark
+    auto v2 = ArchivePath(variant + "_v2");
+    fs::copy_file(fn, v2, fs::copy_options::overwrite_existing);
+    PagedFile pf;
+    pf.Open(v2.string().c_str(), PagedFile::kReadWrite);
+    pf.Header().SetVersion(PagedFileHeader::kVersion2);
+    pf.Close(true);
+  }
+
+  void BenchOpen(const std::string &variant) {
+    static const std::pair<const char *, int32_t> kModes[] = {
+      {"", PagedFile::kReadOnly}, {"_mapped", PagedFile::kReadOnlyMapped}};
+
+    for (const char *table : {"", "_v2"}) {
+      auto archive = ArchivePath(variant + table);
+      for (const auto &mode : kModes) {
+        Result result {"open", variant + table + mode.first};
+        result.seconds = Measure([&]() {
+          PagedFile pf;
+          pf.Open(archive.string().c_str(), mode.second);
+        });
+        result.pages = contents_.size();
+        result.archive_bytes = FileSize(archive);
+        results_.push_back(result);
+      }
+    }
+  }
+
+  std::vector<uint32_t> ShuffledPages() const {
+    std::vector<uint32_t> pages(contents_.size());
+    for (uint32_t i = 0; i < pages.size(); ++i) {
+      pages[i] = i;
+    }
+    std::shuffle(pages.begin(), pages.end(), std::mt19937_64(config_.seed));
+    return pages;
+  }
+
+  void BenchReadPage(const std::string &variant, const fs::path &fn) {
+    auto pages = ShuffledPages();
+    static const std::pair<const char *, int32_t> kModes[] = {
+      {"", PagedFile::kReadOnly}, {"_mapped", PagedFile::kReadOnlyMapped}};
+
+    for (const auto &mode : kModes) {
+      PagedFile pf;
+      if (!pf.Open(fn.string().c_str(), mode.second))
+        continue;
+      std::vector<char> buffer(config_.max_size + 1024);
+
+      Result result {"read_page", variant + mode.first};
+      result.seconds = Measure([&]() {
+        for (uint32_t idx : pages) {
+          uint64_t length = 0, uncompressed_length = 0;
+          pf.Header().PageLength(idx, length, uncompressed_length);
+          if (buffer.size() < std::max(length, uncompressed_length)) {
+            buffer.resize(std::max(length, uncompressed_length));
+          }
+          pf.ReadPage(idx, buffer.data(), buffer.size());
+        }
+      });
+      result.bytes = total_bytes_;
+      result.pages = pages.size();
+      results_.push_back(result);
+    }
+  }
+
+  void BenchReadPages(const std::string &variant, const fs::path &fn) {
+    // random batches of 512 pages, like a data loader fetching mini-batches
+    auto pages = ShuffledPages();
+    PagedFile pf;
+    if (!pf.Open(fn.string().c_str(), PagedFile::kReadOnly))
+      return;
+
+    Result result {"read_pages", variant};
+    result.seconds = Measure([&]() {
+      for (size_t first = 0; first < pages.size(); first += 512) {
+        std::vector<uint32_t> batch(pages.begin() + first,
+          pages.begin() + std::min(pages.size(), first + 512));
+        pf.ReadPages(batch, [](size_t, PagedFile::PageHandle) {});
+      }
+    });
+    result.bytes = total_bytes_;
+    result.pages = pages.size();
+    results_.push_back(result);
+  }
+
+  void BenchPageIStream(const std::string &variant, const fs::path &fn) {
+    auto pages = ShuffledPages();
+    PagedFile pf;
+    if (!pf.Open(fn.string().c_str(), PagedFile::kReadOnlyMapped))
+      return;
+
+    Result result {"create_page_istream", variant + "_mapped"};
+    std::vector<char> sink(64 * 1024);
+    result.seconds = Measure([&]() {
+      for (uint32_t idx : pages) {
+        auto stream = pf.CreatePageIStream(idx);
+        while (stream.read(sink.data(), sink.size()) || stream.gcount() > 0) {
+        }
+      }
+    });
+    result.bytes = total_bytes_;
+    result.pages = pages.size();
+    results_.push_back(result);
+  }
+
+  void BenchRemovePages(const fs::path &fn) {
+    // every 10th page, so most of the archive has to move
+    std::unordered_set<uint32_t> victims;
+    uint64_t moved = 0;
+    for (uint32_t i = 0; i < contents_.size(); ++i) {
+      if (i % 10 == 0) {
+        victims.insert(i);
+      } else if (i > 0) {
+        moved += contents_[i].size();
+      }
+    }
+
+    auto work = ArchivePath("remove");
+    Result result {"remove_pages", "lz4block"};
+    result.seconds = Measure([&]() {
+      PagedFile pf;
+      pf.Open(work.string().c_str(), PagedFile::kReadWrite);
+      pf.RemovePages(victims);
+      pf.Close(true);
+    }, [&]() {
+      fs::copy_file(fn, work, fs::copy_options::overwrite_existing);
+    });
+    result.bytes = moved;
+    result.pages = victims.size();
+    result.archive_bytes = FileSize(work);
+    results_.push_back(result);
+  }
+
+  static std::string Quote(const std::string &s) {
+    return "\"" + s + "\"";
+  }
+
+  void BenchPfar(bool compress) {
+    auto archive = ArchivePath("pfar");
+    auto output = config_.work_dir / "output";
+    std::string jobs = " -j " + std::to_string(config_.jobs);
+    std::string pack = Quote(config_.pfar) + " -a " + Quote(archive.string()) + " -r "
+      + (compress ? "-z " : "") + Quote((config_.work_dir / "input").string()) + jobs
+      + " > " + Quote((config_.work_dir / "pfar.log").string());
+    std::string extract = Quote(config_.pfar) + " -x " + Quote(archive.string()) + " -o "
+      + Quote(output.string()) + jobs + " > " + Quote((config_.work_dir / "pfar.log").string());
+
+    std::string variant = compress ? "lz4" : "plain";
+    Result packed {"pfar_pack", variant};
+    packed.seconds = Measure([&]() {
+      if (std::system(pack.c_str()) != 0) {
+        std::cerr << "Error: " << pack << " failed" << std::endl;
+      }
+    }, [&]() {
+      fs::remove(archive);
+    });
+    packed.bytes = total_bytes_;
+    packed.pages = contents_.size();
+    packed.archive_bytes = FileSize(archive);
+    results_.push_back(packed);
+
+    Result extracted {"pfar_extract", variant};
+    extracted.seconds = Measure([&]() {
+      if (std::system(extract.c_str()) != 0) {
+        std::cerr << "Error: " << extract << " failed" << std::endl;
+      }
+    }, [&]() {
+      fs::remove_all(output);
+      fs::create_directories(output);
+    });
+    extracted.bytes = total_bytes_;
+    extracted.pages = contents_.size();
+    results_.push_back(extracted);
+    fs::remove_all(output);
+  }
+
+  void WriteReport(std::ostream &out) const {
+    out << std::setprecision(6);
+    out << "{\n  \"config\": {"
+      << "\"files\": " << config_.files
+      << ", \"size_dist\": " << Quote(config_.size_dist)
+      << ", \"min_size\": " << config_.min_size
+      << ", \"max_size\": " << config_.max_size
+      << ", \"compressibility\": " << config_.compressibility
+      << ", \"repeat\": " << config_.repeat
+      << ", \"seed\": " << config_.seed
+      << ", \"jobs\": " << config_.jobs
+      << ", \"total_bytes\": " << total_bytes_ << "},\n";
+
+    out << "  \"results\": [";
+    for (size_t i = 0; i < results_.size(); ++i) {
+      const auto &r = results_[i];
+      double seconds = std::max(r.seconds, 1e-9);
+      out << (i ? ",\n" : "\n") << "    {\"name\": " << Quote(r.name)
+        << ", \"variant\": " << Quote(r.variant)
+        << ", \"seconds\": " << r.seconds
+        << ", \"pages\": " << r.pages
+        << ", \"bytes\": " << r.bytes
+        << ", \"archive_bytes\": " << r.archive_bytes
+        << ", \"pages_per_s\": " << r.pages / seconds
+        << ", \"mb_per_s\": " << r.bytes / seconds / 1e6 << "}";
+    }
+    out << "\n  ]\n}\n";
+  }
+
+  Config config_;
+  std::vector<std::string> contents_;
+  uint64_t total_bytes_ {0};
+  std::vector<Result> results_;
+};
+
+int main(int argc, char *argv[]) {
+  PagedFileBench::Config config;
+  std::string output, work_dir;
+
+  po::options_description options("pagedfile_bench options");
+  options.add_options()
+    ("help,h", "print help message")
+    ("files", po::value(&config.files)->default_value(config.files), "number of files")
+    ("size-dist", po::value(&config.size_dist)->default_value(config.size_dist),
+      "file size distribution: fixed, uniform or loguniform")
+    ("min-size", po::value(&config.min_size)->default_value(config.min_size),
+      "smallest file size in bytes")
+    ("max-size", po::value(&config.max_size)->default_value(config.max_size),
+      "largest file size in bytes")
+    ("compressibility", po::value(&config.compressibility)->default_value(0.5),
+      "share of content drawn from a small dictionary, 0 to 1")
+    ("repeat", po::value(&config.repeat)->default_value(config.repeat),
+      "runs per measurement, the best one is reported")
+    ("seed", po::value(&config.seed)->default_value(config.seed), "random seed")
+    ("jobs,j", po::value(&config.jobs)->default_value(config.jobs),
+      "worker threads passed to pfar")
+    ("pfar", po::value(&config.pfar), "pfar executable, defaults to the one next to this binary")
+    ("no-pfar", "skip the pfar pack/extract benchmarks")
+    ("work-dir", po::value(&work_dir), "scratch directory, removed afterwards")
+    ("output,o", po::value(&output), "write the JSON report to this file instead of stdout");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
+  } catch (std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  if (vm.count("help")) {
+    std::cout << options << std::endl;
+    return 0;
+  }
+
+  if (config.size_dist != "fixed" && config.size_dist != "uniform"
+    && config.size_dist != "loguniform") {
+    std::cerr << "Error: unknown size distribution " << config.size_dist << std::endl;
+    return 1;
+  }
+  config.compressibility = std::clamp(config.compressibility, 0.0, 1.0);
+
+  config.work_dir = work_dir.empty() ?
+    fs::temp_directory_path() / ("pagedfile_bench_" + std::to_string(config.seed)) :
+    fs::path(work_dir);
+
+  if (vm.count("no-pfar")) {
+    config.pfar.clear();
+  } else if (config.pfar.empty()) {
+    std::error_code ec;
+    auto sibling = fs::absolute(argv[0], ec).parent_path() / "pfar";
+    if (!ec && fs::exists(sibling)) {
+      config.pfar = sibling.string();
+    }
+  }
+
+  PagedFileBench bench(std::move(config));
+  if (output.empty()) {
+    return bench.Run(std::cout);
+  }
+
+  std::ofstream report(output);
+  if (!report.good()) {
+    std::cerr << "Error: failed to write to " << output << std::endl;
+    return 1;
+  }
+  return bench.Run(report);
+}
@@ -0,0 +1,16 @@
+#ifndef PFAR_CHECKSUM_H
+#define PFAR_CHECKSUM_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace pagedfile {
+
+// CRC32C (Castagnoli) of a buffer, continuing from a previous result so a page
+// can be checksummed piece by piece. Uses the SSE4.2 or ARMv8 crc32c instructions
+// when the CPU has them and falls back to a slice-by-8 table otherwise.
+uint32_t Crc32c(uint32_t crc, const void *data, size_t length);
+
+}  // namespace
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef PFAR_CONTENTCHUNKER_H
+#define PFAR_CONTENTCHUNKER_H
+
+#include <cstdint>
+#include <cstddef>
+
+namespace pagedfile {
+
+/**
+ * @brief ContentChunker
+ * @details Cuts a byte stream into chunks where a rolling gear hash of the last
+ * 64 bytes hits a mask, so an edit only moves the boundaries next to it and the
+ * unchanged content around it keeps producing the same chunks. Chunks are at
+ * least kMinSize long, boundaries are harder to hit before kAverageSize and
+ * easier after it, and a chunk is cut at kMaxSize regardless.
+ */
+class ContentChunker {
+public:
+  // chunks of up to 64 KiB get the best ratio out of LZ4
+  enum { kMinSize = 8 * 1024, kAverageSize = 32 * 1024, kMaxSize = 64 * 1024 };
+
+  ContentChunker();
+
+  // forget the chunk in progress
+  void Reset();
+
+  // scan up to length bytes continuing the current chunk, returns how many of them
+  // belong to it. boundary is set if the chunk ends there, the next call starts a new one
+  size_t Next(const char *data, size_t length, bool &boundary);
+
+private:
+  uint64_t hash_;
+  size_t chunk_length_;  // bytes of the current chunk scanned so far
+};
+
+}  // namespace
+
+#endif
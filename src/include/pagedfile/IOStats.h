@@ -0,0 +1,122 @@
+#ifndef PFAR_IOSTATS_H
+#define PFAR_IOSTATS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+
+namespace pagedfile {
+
+/**
+ * @brief IOStats
+ * @details Runtime counters of an archive, shared by a PagedFile and all of its
+ * readers. Counting is off until enabled, then every counter is a relaxed atomic
+ * on its own cache line so concurrent readers do not contend. Durations are
+ * summed over all threads.
+ */
+class IOStats {
+public:
+  enum Counter {
+    kPagesRead,
+    kPagesWritten,
+    kBytesRead,  // stored bytes fetched from the archive
+    kBytesReadUncompressed,  // page content handed out
+    kBytesWritten,  // stored bytes written to the archive
+    kBytesWrittenUncompressed,  // page content before compression
+    kSeeks,  // reads and writes that do not continue where the previous one ended
+    kCompressNanos,
+    kDecompressNanos,
+    kBufferGrows,  // compression work buffer reallocations
+    kHeaderParses,
+    kHeaderParseNanos,
+    kNumCounters
+  };
+
+  struct Counters {
+    uint64_t pages_read {0};
+    uint64_t pages_written {0};
+    uint64_t bytes_read {0};
+    uint64_t bytes_read_uncompressed {0};
+    uint64_t bytes_written {0};
+    uint64_t bytes_written_uncompressed {0};
+    uint64_t seeks {0};
+    uint64_t compress_ns {0};
+    uint64_t decompress_ns {0};
+    uint64_t buffer_grows {0};
+    uint64_t header_parses {0};
+    uint64_t header_parse_ns {0};
+  };
+
+  IOStats();
+
+  IOStats(const IOStats &) = delete;
+  IOStats &operator=(const IOStats &) = delete;
+
+  void SetEnabled(bool enabled);
+  bool Enabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  void Add(Counter counter, uint64_t value = 1) {
+    if (Enabled()) {
+      counters_[counter].value.fetch_add(value, std::memory_order_relaxed);
+    }
+  }
+
+  // count length stored bytes accessed at offset, and a seek if the access
+  // does not continue the previous one
+  void CountRead(uint64_t offset, uint64_t length);
+  void CountWrite(uint64_t offset, uint64_t length);
+  // a page, or part of one, handed out with length bytes of content
+  void CountPageRead(uint64_t length);
+
+  Counters Get() const;
+  void Reset();
+
+  /**
+   * @brief IOStats::Timer
+   * @details Adds the lifetime of the timer to a duration counter. Does not
+   * touch the clock while counting is disabled.
+   */
+  class Timer {
+  public:
+    Timer(IOStats *stats, Counter counter) :
+      stats_(stats != nullptr && stats->Enabled() ? stats : nullptr),
+      counter_(counter) {
+      if (stats_ != nullptr) {
+        start_ = std::chrono::steady_clock::now();
+      }
+    }
+
+    ~Timer() {
+      if (stats_ != nullptr) {
+        stats_->Add(counter_, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start_).count());
+      }
+    }
+
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+
+  private:
+    IOStats *stats_;
+    Counter counter_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+private:
+  void CountAccess(uint64_t offset, uint64_t length);
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> value {0};
+  };
+
+  std::atomic<bool> enabled_;
+  alignas(64) std::atomic<uint64_t> next_offset_;  // end of the last access
+  Slot counters_[kNumCounters];
+};
+
+}  // namespace
+
+#endif
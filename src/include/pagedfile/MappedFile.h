@@ -0,0 +1,44 @@
+#ifndef PFAR_MAPPEDFILE_H
+#define PFAR_MAPPEDFILE_H
+
+#include <cstdint>
+
+namespace pagedfile {
+
+/**
+ * @brief MappedFile
+ * @details Read-only memory mapping of an entire file. The mapping stays valid
+ * until Close() is called or the object is destroyed.
+ */
+class MappedFile {
+public:
+  MappedFile();
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool Open(const char *fn);
+  void Close();
+
+  bool IsOpen() const;
+  const char *Data() const;
+  uint64_t Size() const;
+
+  // drop the pages of a range from this process once they have been consumed, they
+  // are read from the file again if touched later. Keeps resident memory bounded
+  // while a large mapping is scanned front to back
+  void Release(uint64_t offset, uint64_t length) const;
+
+private:
+  const char *data_;
+  uint64_t size_;
+#ifdef _WIN32
+  void *file_handle_;
+  void *mapping_handle_;
+#endif
+};
+
+}  // namespace
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef PFAR_PAGECACHE_H
+#define PFAR_PAGECACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+
+namespace pagedfile {
+
+/**
+ * @brief PageCache
+ * @details Byte-budgeted LRU cache of decompressed page content, keyed by page
+ * index. Entries are shared: data handed out by Find stays valid after it is
+ * evicted, only the cache's own reference counts against the budget. All
+ * methods are safe to call from multiple threads. A capacity of 0 disables
+ * the cache.
+ */
+class PageCache {
+public:
+  struct Stats {
+    uint64_t hits {0};
+    uint64_t misses {0};
+    uint64_t evictions {0};
+    size_t entries {0};
+    size_t size {0};  // bytes held by the cache
+    size_t capacity {0};
+  };
+
+  explicit PageCache(size_t capacity = 0);
+
+  PageCache(const PageCache &) = delete;
+  PageCache &operator=(const PageCache &) = delete;
+
+  // shrinking evicts least recently used entries until the cache fits
+  void SetCapacity(size_t capacity);
+  size_t Capacity() const;
+  bool Enabled() const;
+
+  // look up a page and mark it as most recently used, counts a hit or miss
+  std::shared_ptr<uint8_t> Find(uint32_t idx, size_t &size);
+  // entries larger than the whole capacity are not kept
+  void Insert(uint32_t idx, std::shared_ptr<uint8_t> data, size_t size);
+  void Erase(uint32_t idx);
+  void Clear();
+
+  Stats GetStats() const;
+  void ResetStats();
+
+private:
+  struct Entry {
+    uint32_t idx;
+    std::shared_ptr<uint8_t> data;
+    size_t size;
+  };
+
+  // caller holds mutex_
+  void EvictTo(size_t capacity);
+
+  mutable std::mutex mutex_;
+  std::list<Entry> lru_;  // most recently used first
+  std::unordered_map<uint32_t, std::list<Entry>::iterator> entries_;
+  size_t size_;
+  std::atomic<size_t> capacity_;
+
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> evictions_;
+};
+
+}  // namespace
+
+#endif
@@ -6,11 +6,24 @@
 #include <vector>
 #include <fstream>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <string_view>
+#include <functional>
 #include "BufferStreamBuf.h"
+#include "ContentChunker.h"
+#include "MappedFile.h"
+#include "RandomAccessFile.h"
+#include "PageCache.h"
+#include "IOStats.h"
+#include "ThreadPool.h"
+
+struct LZ4F_cctx_s;
+struct LZ4F_dctx_s;
 
 namespace pagedfile {
 
-// Header Layout
+// Header Layout (version 1)
 // (uint32_t) num_pages
 // -------page desc 0-------
 // (uint32_t) index
@@ -22,6 +35,95 @@ namespace pagedfile {
 // (char[]) name
 // -------page desc 1-------
 // ...
+// -------
+// (int64_t) header_length
+
+// Header Layout (version 2, opt-in)
+// Fixed-size records sorted by index, used in place without decoding.
+// -------table header-------
+// (uint32_t) num_pages
+// (uint32_t) record_size
+// (uint32_t) flags
+// (uint32_t) hash_buckets
+// (uint64_t) names_offset (relative to table start)
+// (uint64_t) names_length
+// (uint64_t) hash_offset (relative to table start)
+// -------record 0 (lowest index)-------
+// (uint32_t) index
+// (uint16_t) format flags
+// (uint16_t) record flags (kRecordChecksum)
+// (uint64_t) start
+// (uint64_t) length
+// (uint64_t) uncompressed length
+// (uint64_t) name offset in name blob
+// (uint32_t) name length
+// (uint32_t) position in archive order
+// (uint32_t) CRC32C of the stored page bytes (records of at least 56 bytes)
+// (uint32_t) reserved
+// -------record 1-------
+// ...
+// -------name blob-------
+// -------hash section (kHashSection)-------
+// (uint32_t[hash_buckets]) record number by FNV-1a hash of name, open addressing,
+// pages without a name are not in the hash
+// -------footer-------
+// (uint64_t) table start
+// (uint64_t) table length
+// (uint32_t) version
+// [uint32_t] page alignment, only in footers of aligned archives (36 bytes and longer)
+// (uint32_t) footer_length
+// (int64_t) kFooterTag (negative, where version 1 stores header_length)
+
+// Journal Layout (opt-in, see PagedFile::SetJournalAppends)
+// A session that only added or tombstoned pages appends a delta after its pages
+// instead of rewriting the table. Deltas chain back to a full version 1 or 2 table.
+// -------delta header-------
+// (uint64_t) archive length before this session, where the previous footer ends
+// (uint32_t) depth (deltas since the last full table, including this one)
+// (uint32_t) num_removed
+// (uint32_t) num_added
+// (uint32_t[num_removed]) removed indices
+// -------added page 0 (archive order)-------
+// (uint32_t) index
+// (uint16_t) format flags
+// (uint16_t) record flags (kRecordChecksum)
+// (uint64_t) start
+// (uint64_t) length
+// (uint64_t) uncompressed length
+// (uint32_t) CRC32C of the stored page bytes
+// (uint16_t) name_length
+// (char[]) name
+// -------added page 1-------
+// ...
+// -------footer-------
+// same as version 2, with version kJournalVersion
+// Every PagedFile::Commit ends with a delta, possibly empty after a full table, and
+// only writes past the previous footer. If the archive does not end in a valid
+// table, readers fall back to the last footer that ends a delta, other footers are
+// only used with PagedFile::SetRecover.
+
+// kLZ4Chunked Page Layout
+// Content is split into kCompressedChunkSize chunks compressed independently,
+// the table comes last so pages can be written incrementally.
+// -------chunk 0-------
+// (char[]) LZ4 block, or the raw chunk if it did not shrink (stored size == chunk size)
+// -------chunk 1-------
+// ...
+// (uint64_t[num_chunks + 1]) chunk offsets relative to page start, last one ends chunk data
+// (uint64_t) uncompressed length
+// (uint32_t) chunk size
+// (uint32_t) num_chunks
+
+// kChunkList Page Layout
+// Content is cut into chunks at content-defined boundaries (see ContentChunker).
+// Each distinct chunk is stored once as a nameless kChunk page, LZ4 compressed
+// if that pays off, and any number of pages across sessions may list it.
+// The list is written after the new chunks of its page.
+// -------chunk ref 0-------
+// (uint32_t) index of the kChunk page
+// (uint32_t) CRC32C of the chunk content
+// -------chunk ref 1-------
+// ...
 
 class PagedFileHeader {
 public:
@@ -31,12 +133,36 @@ public:
     uint64_t length {0};
     uint64_t uncompressed_length {0};
     std::string name;
+    // CRC32C of the bytes stored in the archive, only kept by version 2 tables
+    uint32_t checksum {0};
+    bool has_checksum {false};
   };
 
-  // build table from serialized source
-  bool ParseFromStream(std::istream &s, std::istream::pos_type &tail_pos);
+  enum { kVersion1 = 1, kVersion2 = 2 };
+
+  // build table from serialized source. An archive that does not end in a valid
+  // table falls back to its newest footer if that ends a journal delta, or with
+  // recover whatever it ends
+  bool ParseFromStream(std::istream &s, std::istream::pos_type &tail_pos,
+    bool recover = false);
+  // build table from a mapped archive, version 2 tables are used in place
+  bool ParseFromMapping(std::shared_ptr<const MappedFile> map, uint64_t &tail_pos,
+    bool recover = false);
   void Clear();
   bool WriteToFile(std::fstream::pos_type tail_pos, std::fstream &fs);
+  // append the pages added and removed since the table was parsed as a journal delta,
+  // before_footer runs once the delta is written and can veto the footer
+  bool WriteDelta(std::fstream::pos_type tail_pos, std::fstream &fs,
+    const std::function<bool()> &before_footer = nullptr);
+
+  // on-disk table layout, new archives are written as version 1 by default.
+  // Aligned archives need a footer to record their alignment and stay at version 2,
+  // journaled ones move to version 2 with their next full table to keep checksums
+  uint32_t Version() const;
+  void SetVersion(uint32_t version);
+
+  // multiple of bytes page data starts at, 1 if pages are packed. See PagedFile::SetAlignment
+  uint32_t Alignment() const;
 
   PageDesc *Desc(uint32_t idx);
   const PageDesc *Desc(uint32_t idx) const;
@@ -50,15 +176,27 @@ public:
   bool PageOffset(uint32_t page_idx, uint64_t &offset) const;
   const std::string &PageName(uint32_t page_idx) const;
   uint16_t PageFormat(uint32_t page_idx) const;
+  // false if the page was written without a checksum
+  bool PageChecksum(uint32_t page_idx, uint32_t &checksum) const;
 
   // page list
   // return a vector of all page indices
   const std::vector<uint32_t> &ListPages() const;
-  // generate a vector of all pages starting with a given prefix
+  // generate a vector of all pages starting with a given prefix, in archive order
   std::vector<uint32_t> ListPages(const std::string &prefix) const;
 
+  // look up a page by name, the first one in archive order wins on duplicates.
+  // Nameless pages such as kChunk pages are never found
+  bool FindPage(const std::string &name, uint32_t &idx) const;
+
   bool Exists(uint32_t idx) const;
 
+  // bytes of the data section not referenced by any page, left behind by
+  // tombstoned pages. Padding before aligned pages is not counted.
+  // Ratio is relative to the whole data section
+  uint64_t DeadBytes() const;
+  double DeadRatio() const;
+
   // add meta page
   bool NewMetaPage(uint32_t idx, uint16_t format, const std::string &name);
 
@@ -69,22 +207,135 @@ public:
   friend class PagedFile;
 
 private:
+  enum { kHashSection = 0x1 };
+  enum : uint16_t { kRecordChecksum = 0x1 };
+  // records written before checksums were added are kMinRecordSize long
+  enum { kTableHeaderSize = 40, kMinRecordSize = 48, kRecordSize = 56, kFooterSize = 32,
+    kAlignedFooterSize = 36 };
+  // deltas are folded into a full table once the chain gets this long
+  enum { kJournalVersion = 3, kDeltaHeaderSize = 20, kDeltaRecordSize = 38,
+    kMaxJournalDepth = 64 };
+  enum : uint32_t { kEmptyBucket = 0xffffffff };
+  enum { kStagingSize = 1024 * 1024 };
+  // how far from its end a torn archive is searched for its last commit, unless
+  // recovering
+  enum : uint64_t { kMaxTornTail = 256ull * 1024 * 1024 };
+  static const int64_t kFooterTag;
+
+  struct Footer {
+    uint64_t table_start {0};
+    uint64_t table_length {0};
+    uint32_t version {0};
+    uint32_t alignment {1};
+  };
+
+  // version 2 table used in place, from the archive mapping or a loaded copy
+  struct PackedTable {
+    std::shared_ptr<const void> owner;
+    const char *records {nullptr};
+    const char *names {nullptr};
+    const char *hash {nullptr};
+    uint64_t names_length {0};
+    uint32_t num_pages {0};
+    uint32_t record_size {0};
+    uint32_t hash_buckets {0};
+  };
+
+  // state derived from the table on demand, reset whenever the table changes
+  struct LazyState {
+    LazyState() {}
+    LazyState(const LazyState &) {}
+    LazyState &operator=(const LazyState &) { Invalidate(); return *this; }
+
+    void Invalidate();
+
+    struct NameEntry {
+      std::string_view name;
+      uint32_t idx;
+      uint32_t order;  // position in archive order
+    };
+
+    std::mutex mutex;
+    // sorted name index
+    std::atomic<bool> names_valid {false};
+    std::vector<NameEntry> names;
+    // archive order and decoded descs of a packed table
+    std::atomic<bool> order_valid {false};
+    std::vector<uint32_t> order;
+    std::unordered_map<uint32_t, PageDesc> descs;
+  };
+
+  // parse the table of an archive that ends at end
+  bool ParseAt(std::istream &s, uint64_t end, std::istream::pos_type &tail_pos);
+  bool ParseV1(std::istream &s, int64_t header_length, uint64_t end,
+    std::istream::pos_type &tail_pos);
+  bool ApplyDelta(const char *delta, uint64_t length);
+  void WriteFooter(std::fstream &fs, uint64_t table_start, uint32_t version) const;
+  bool ParseV2(const char *table, uint64_t table_length, std::shared_ptr<const void> owner);
+  void WriteV2(std::fstream &fs) const;
+  static bool ParseFooter(const char *data, uint32_t length, uint64_t file_size, Footer &footer);
+
+  bool IsPacked() const;
+  // record number of idx in the packed table, num_pages if absent
+  uint32_t FindRecord(uint32_t idx) const;
+  void DecodeRecord(uint32_t record, uint32_t &idx, PageDesc &desc, uint32_t &order,
+    bool with_name) const;
+  // decode the packed table into page_table_ for modification
+  void Materialize();
+
+  // copy the location and format of a page, without its name
+  bool Locate(uint32_t idx, PageDesc &desc) const;
+
+  const std::vector<LazyState::NameEntry> &NameEntries() const;
+
+  uint32_t version_ {kVersion1};
+  uint32_t alignment_ {1};
+  uint64_t data_end_ {0};  // end of page data, where the table starts
+  uint64_t file_end_ {0};  // archive length when the table was parsed or written
+
+  // journal state, pages added since the table was parsed follow the first
+  // journal_base_pages_ entries of page_order_
+  bool journal_base_ {false};  // a table exists that a delta can refer to
+  bool journal_rewrite_ {false};  // changed beyond what a delta can express
+  uint32_t journal_depth_ {0};
+  uint32_t journal_base_pages_ {0};
+  std::vector<uint32_t> journal_removed_;
   std::unordered_map<uint32_t, PageDesc> page_table_;
   std::vector<uint32_t> page_order_;
+  PackedTable packed_;
+  mutable LazyState lazy_;
 };
 
+class PagedFileReader;
+
 class PagedFile {
 public:
 
   PagedFile();
   ~PagedFile();
 
-  enum { kReadOnly, kCreate, kReadWrite };
-  // file type (least significant byte)
-  enum { kFile = 0, kDirectory = 0x1, kSymLink = 0x2, kHardLink = 0x3 };
+  // kReadOnlyMapped: read-only access through a memory mapping of the archive
+  enum { kReadOnly, kCreate, kReadWrite, kReadOnlyMapped };
+  // file type (least significant byte), kChunk pages hold content of kChunkList pages
+  enum { kFile = 0, kDirectory = 0x1, kSymLink = 0x2, kHardLink = 0x3, kChunk = 0x4 };
   // compression format (2nd least significant byte)
-  enum { kPlain = 0, kLZ4Block = 0x1 << 8, kLZ4Frame = 0x2 << 8 };
+  // kLZ4Chunked pages can be decoded in parts, see ReadPageRange
+  // kChunkList pages share content-defined chunks with other pages, see NewPage
+  enum { kPlain = 0, kLZ4Block = 0x1 << 8, kLZ4Frame = 0x2 << 8, kLZ4Chunked = 0x4 << 8,
+    kChunkList = 0x8 << 8 };
+  // kChunk pages take free indices counting down from here
+  enum : uint32_t { kMaxChunkIndex = 0xfffffffe };
+  enum { kCompressedChunkSize = 64 * 1024 };  // content per kLZ4Chunked chunk
+  enum { kReadDepth = 64 };  // reads ReadPages keeps in flight
+  enum { kMaxCoalescedRead = 1024 * 1024 };  // longest read ReadPages merges pages into
   enum { kMagicNumber = 0x52414650 };  // ascii: PFAR
+  enum : uint32_t { kMaxAlignment = 1u << 30 };
+  // VerifyPage results, kVerifyUnchecked pages have no checksum but could be read
+  enum { kVerifyOk, kVerifyUnchecked, kVerifyFailed };
+  // RemovePages methods: kRemoveCompact moves every later page forward,
+  // kRemoveTombstone only drops the table entries. Holes are punched into the dead data
+  // where supported, once the table without those pages is saved and synced
+  enum { kRemoveCompact, kRemoveTombstone };
 
   bool Open(const char *fn, int32_t mode);
   void Close(bool save_update = false);
@@ -93,11 +344,155 @@ public:
   bool GoToPage(uint32_t page);
 
   // high level I/O interface
-  // read entire page
-  uint64_t ReadPage(uint32_t idx, char *buffer, size_t buffer_size);
+  // read entire page, safe to call concurrently unless the archive is being written
+  uint64_t ReadPage(uint32_t idx, char *buffer, size_t buffer_size) const;
+  // read up to length bytes of page content starting at offset, returns bytes read.
+  // plain pages use positional reads and kLZ4Chunked pages only decode the chunks
+  // that overlap the range, other compressed pages are decoded as a whole.
+  // checksums are not verified, they cover whole pages
+  uint64_t ReadPageRange(uint32_t idx, uint64_t offset, char *buffer, size_t length) const;
+
+  /**
+   * @brief PageView
+   * @details Pointer to the content of a plain page inside the archive mapping.
+   * Only valid while the archive is open.
+   */
+  struct PageView {
+    const char *data {nullptr};
+    size_t size {0};
+  };
+
+  // zero-copy access to a plain page, only available in kReadOnlyMapped mode
+  PageView ViewPage(uint32_t idx) const;
+
+  // write the content of a file page to descriptor fd at its current position.
+  // Plain pages are copied inside the kernel where supported (see
+  // RandomAccessFile::CopyTo) unless reads bypass the page cache, compressed pages are
+  // decoded in bounded windows. False if the page could not be read or written
+  bool ExtractPageTo(uint32_t idx, int fd) const;
+
+  /**
+   * @brief PageHandle
+   * @details Shared ownership of the content of a page. Decompressed pages may be
+   * shared with the page cache, plain pages with the archive mapping, so the data
+   * stays valid after the archive is closed.
+   */
+  struct PageHandle {
+    std::shared_ptr<const uint8_t> data;
+    size_t size {0};
+  };
+
+  // load the content of a page, served from the page cache when it is enabled
+  PageHandle LoadPage(uint32_t idx) const;
+
+  // receives the pages of ReadPages with their position in the request, an empty
+  // handle if a page is missing, empty or could not be read
+  using PageCallback = std::function<void(size_t, PageHandle)>;
+
+  // load many pages at once. Pages are read in archive order, neighbours merged
+  // into one read (see SetCoalesceGap), and plain pages share the buffer of their
+  // read. On Linux up to kReadDepth reads are in flight through io_uring and each
+  // page is decoded as soon as its data arrives, elsewhere reads run on the decode
+  // pool (SetDecodeThreads). callback may run concurrently and in any order.
+  // Returns false if a page is missing or failed
+  bool ReadPages(const std::vector<uint32_t> &pages, const PageCallback &callback) const;
+  // collect the pages of ReadPages in request order
+  bool ReadPages(const std::vector<uint32_t> &pages, std::vector<PageHandle> &handles) const;
+
+  // keep up to capacity bytes of decompressed pages in memory, shared with all
+  // readers. 0 (the default) disables the cache, plain pages are never cached
+  void SetCacheCapacity(size_t capacity);
+  PageCache::Stats CacheStats() const;
+
+  // count pages, bytes, seeks and codec time of this archive and all of its
+  // readers. Off by default, takes effect immediately and survives Close
+  void SetCollectStats(bool collect);
+  IOStats::Counters Stats() const;
+  void ResetStats();
+
+  // decode large kLZ4Chunked pages on this many threads in ReadPage and
+  // ReadPageRange, shared with all readers. kLZ4Frame pages, the default for large
+  // pages, always decode on the calling thread. 0 uses all cores, the default of 1
+  // decodes on the calling thread. Takes effect at the next Open
+  void SetDecodeThreads(unsigned threads);
+
+  // make ReadPage, ViewPage and CreatePageIStream fail on pages whose checksum
+  // does not match, takes effect at the next Open
+  void SetVerifyChecksums(bool verify);
+
+  // let new pages share the stored data of an existing page with identical content
+  // instead of storing it again. Candidates are found by the checksums of the page
+  // table without reading pages, then compared byte by byte: plain pages and pages
+  // added in this session by content, compressed pages of earlier sessions by their
+  // stored data, so pages without a checksum (version 1 tables) are never shared.
+  // AppendPage checks before and after compressing, pages written with NewPage and
+  // Write are held back up to 4 MiB and checked before they are written, longer
+  // ones are stored as written. Compressed data passed to AppendCompressedPage is
+  // matched by its stored data
+  void SetDeduplicate(bool dedup);
+
+  // start the data of every page at a multiple of alignment bytes (a power of two up
+  // to kMaxAlignment), e.g. the 4 KiB of direct I/O or the 2 MiB of huge pages, so
+  // ViewPage pointers are aligned as well. Chunks and chunk lists stay packed.
+  // Applies to archives created at the next Open, others keep the alignment they
+  // were created with. False if alignment is not supported
+  bool SetAlignment(uint32_t alignment);
+
+  // read and write large page data with direct I/O where the platform and file
+  // system allow it, so streaming big archives does not evict the page cache. Writes
+  // need an alignment of at least RandomAccessFile::kDirectBlockSize, reads work on
+  // any archive not opened kReadOnlyMapped. Takes effect at the next Open
+  void SetDirectIO(bool direct);
+
+  // let ReadPages merge the reads of pages up to gap bytes apart, reading the gap
+  // along. 0 (the default) only merges adjacent pages, larger gaps suit devices
+  // where a seek costs more than reading the bytes in between. Takes effect at
+  // the next Open
+  void SetCoalesceGap(uint64_t gap);
+
+  // let kReadWrite sessions that only append or tombstone pages save a small
+  // journal delta instead of rewriting the page table, takes effect at the next Open.
+  // Close(false) drops the pages such a session appended.
+  // Journaled archives need a reader that knows the journal layout
+  void SetJournalAppends(bool journal);
+
+  // let Open use an archive whose last commit was cut short, as of the commit before.
+  // Journaled archives are read that way regardless, this also falls back to the
+  // footers of full tables and lets kReadWrite drop the torn tail, which fails to
+  // open otherwise. Takes effect at the next Open
+  void SetRecover(bool recover);
+
+  // group the following appends and removals of a kCreate or kReadWrite session
+  // into one durable commit. Pages go after the current table, so a crash before
+  // Commit leaves the archive as it was. Commits are saved as journal deltas, an
+  // archive that does not end in one yet gets an empty delta first
+  bool BeginBatch();
+  // write the pages and table of the batch, sync them with one fdatasync, then
+  // switch to the new table by writing its footer and sync that as well.
+  // Close(true) commits an open batch, Close(false) drops it
+  bool Commit();
+  // check a page against its checksum, or decode it if it has none
+  int32_t VerifyPage(uint32_t idx) const;
+
+  // kChunkList pages are written as with NewPage, other formats are compressed first
   bool AppendPage(uint32_t idx, const std::string &name, uint16_t format,
       const char *buffer, size_t length, bool verbose = false);
 
+  // add a page that shares the stored data of an existing page with the same
+  // content, false if there is none. See SetDeduplicate
+  bool AppendDuplicatePage(uint32_t idx, const std::string &name,
+    const char *buffer, size_t length);
+
+  // append a page whose content was already compressed with CompressPage
+  bool AppendCompressedPage(uint32_t idx, const std::string &name, uint16_t format,
+      const char *data, size_t length, uint64_t uncompressed_length);
+
+  // compress buffer into work_buffer according to format, thread-safe.
+  // the compression flag is cleared from format if compression does not pay off,
+  // in which case the page should be stored from the original buffer
+  static bool CompressPage(uint16_t &format, const char *buffer, size_t length,
+      std::vector<char> &work_buffer, size_t &compressed_length);
+
   // low level I/O interface
   // read
   void Read(void *buffer, size_t length);
@@ -105,14 +500,26 @@ public:
   // write
   bool NewPage(uint32_t idx);
   bool NewPage(uint32_t idx, const std::string &name);
+  // format may be kPlain, kLZ4Frame, kLZ4Chunked or kChunkList, compressed pages are
+  // compressed incrementally by Write and their uncompressed length is recorded by
+  // EndNewPage. kChunkList pages only store chunks not found in the archive yet,
+  // matches are confirmed byte by byte. Removing the last page that lists a chunk
+  // removes the chunk as well
+  bool NewPage(uint32_t idx, const std::string &name, uint16_t format);
   void Write(const void *buffer, size_t length);
   void EndNewPage();
 
   bool NewMetaPage(uint32_t idx, uint16_t format, const std::string &name);
 
-  bool RemovePages(const std::unordered_set<uint32_t> &pages);
+  bool RemovePages(const std::unordered_set<uint32_t> &pages, int32_t method = kRemoveCompact);
+  // move all pages to the front of the archive, reclaiming dead space in one pass
+  bool Compact();
 
   PagedFileHeader &Header();
+  const PagedFileHeader &Header() const;
+
+  // create a cheap read handle sharing this archive's page table and file
+  PagedFileReader CreateReader() const;
 
   // inspection
 
@@ -131,14 +538,131 @@ public:
     BufferStreamBuf buffer_;
   };
 
-  PageInputStream CreatePageIStream(uint32_t idx);
+  PageInputStream CreatePageIStream(uint32_t idx) const;
+
+  class PageStreamBuf;
+
+  /**
+   * @brief PageStream
+   * @details A std::istream that decodes a page incrementally. Memory use is
+   * bounded by a few fixed-size chunks for plain, kLZ4Frame, kLZ4Chunked and kChunkList
+   * pages, kLZ4Block pages can only be decoded as a whole.
+   */
+  struct PageStream : std::istream {
+    PageStream();
+    PageStream(PageStream &&rhs);
+    ~PageStream();
+
+  private:
+    friend class PagedFile;
+    explicit PageStream(std::unique_ptr<PageStreamBuf> buffer);
+
+    std::unique_ptr<PageStreamBuf> buffer_;
+  };
+
+  PageStream CreatePageStream(uint32_t idx) const;
 
-  static uint16_t ChooseCompressionFormat(size_t length);
+  // kLZ4Block for small pages and kLZ4Frame for large ones, which decode on one
+  // thread. seekable picks kLZ4Chunked for large pages instead, which ReadPageRange
+  // decodes in parts and the decode pool in parallel, but older readers do not
+  // understand
+  static uint16_t ChooseCompressionFormat(size_t length, bool seekable = false);
 
 private:
-  PagedFileHeader header_;
+  friend class PagedFileReader;
+
+  // state shared between a PagedFile and its readers
+  struct ReadContext {
+    std::shared_ptr<const PagedFileHeader> header;
+    std::shared_ptr<MappedFile> map;
+    RandomAccessFile file;
+    bool verify {false};
+    uint64_t coalesce_gap {0};
+    mutable PageCache cache;
+    std::shared_ptr<ThreadPool> pool;
+    std::shared_ptr<IOStats> stats;
+  };
+
+  static uint64_t ReadPageFrom(const ReadContext &ctx, uint32_t idx,
+    char *buffer, size_t buffer_size);
+  // read and decode a page from the archive, bypassing the cache
+  static uint64_t ReadStoredPage(const ReadContext &ctx, const PagedFileHeader::PageDesc &desc,
+    char *buffer, size_t buffer_size);
+  static PageHandle LoadPageFrom(const ReadContext &ctx, uint32_t idx);
+  static PageHandle LoadCompressedPage(const ReadContext &ctx, uint32_t idx,
+    const PagedFileHeader::PageDesc &desc);
+  static bool ReadPagesFrom(const ReadContext &ctx, const std::vector<uint32_t> &pages,
+    const PageCallback &callback);
+  static PageView ViewPageFrom(const ReadContext &ctx, uint32_t idx);
+  static bool ExtractPageToFrom(const std::shared_ptr<const ReadContext> &ctx, uint32_t idx,
+    int fd);
+  static uint64_t ReadPageRangeFrom(const ReadContext &ctx, uint32_t idx,
+    uint64_t offset, char *buffer, size_t length);
+  static uint64_t ReadChunkedRange(const ReadContext &ctx, const PagedFileHeader::PageDesc &desc,
+    uint64_t offset, char *buffer, size_t length);
+
+  // entry of a kChunkList page
+  struct ChunkRef {
+    uint32_t page;
+    uint32_t checksum;  // CRC32C of the chunk content
+  };
+  static bool LoadChunkList(const ReadContext &ctx, const PagedFileHeader::PageDesc &desc,
+    std::vector<ChunkRef> &refs);
+  static uint64_t ReadChunkListRange(const ReadContext &ctx,
+    const PagedFileHeader::PageDesc &desc, uint64_t offset, char *buffer, size_t length);
+  static int32_t VerifyPageFrom(const std::shared_ptr<const ReadContext> &ctx, uint32_t idx);
+  static bool ChecksumMatches(const ReadContext &ctx, const PagedFileHeader::PageDesc &desc);
+  static PageInputStream CreatePageIStreamFrom(
+    const std::shared_ptr<const ReadContext> &ctx, uint32_t idx);
+  static PageStream CreatePageStreamFrom(
+    const std::shared_ptr<const ReadContext> &ctx, uint32_t idx);
+
+  std::shared_ptr<PagedFileHeader> header_;
+  std::shared_ptr<ReadContext> ctx_;
 
   void ResetForWriting();
+  bool Writable() const;
+  // write page content and fold it into the checksum of the page being written
+  void WritePageData(const char *data, size_t length);
+  // write the whole blocks collected for the page being written, at the end of the
+  // page the rest as well, padded with zeros. Falls back to fs_ if refused
+  void FlushDirect(bool end_page);
+  void CloseDirect();
+  // compress and write one kLZ4Chunked chunk, recording its end offset
+  void WriteChunk(const char *data, size_t length);
+  void WriteChunkTable(const std::vector<uint64_t> &offsets, uint64_t uncompressed_length,
+    uint32_t chunk_size);
+  // move length bytes to the lower offset dst in bounded chunks, copied inside the
+  // kernel through fd where supported (-1 forces buffered copies)
+  bool MoveDown(int fd, uint64_t src, uint64_t dst, uint64_t length);
+  // punch holes into the data of tombstoned pages below end, skipping data still
+  // shared with a page. Only call once no table on disk refers to them any more
+  void PunchDeadRanges(uint64_t end);
+
+  bool AppendStoredPage(uint32_t idx, const std::string &name, uint16_t format,
+    const char *data, size_t length, uint64_t uncompressed_length, bool checksum_known,
+    uint32_t content_checksum);
+  bool LinkDuplicate(uint32_t idx, const std::string &name, const char *buffer,
+    size_t length, uint32_t checksum);
+  // share the page stored as data in format, which holds content_checksum
+  bool LinkStoredDuplicate(uint32_t idx, const std::string &name, uint16_t format,
+    const char *data, size_t length, uint32_t content_checksum);
+  // find a page with the given content or stored data
+  bool FindDuplicate(uint64_t length, uint32_t checksum, const char *buffer, uint32_t &dup);
+  bool FindStoredDuplicate(uint16_t format, const char *data, size_t length,
+    uint32_t checksum, uint32_t &dup);
+  void BuildDedupIndex();
+  // add a page to the dedup index, content_checksum is only used if checksum_known
+  void IndexPage(uint32_t idx, bool checksum_known, uint32_t content_checksum);
+  bool ContentEquals(uint32_t idx, const char *buffer, size_t length) const;
+  bool StoredEquals(uint32_t idx, const char *data, size_t length) const;
+  // write out the data held back by SetDeduplicate
+  void ReleaseDedupStage();
+
+  // add a chunk of the kChunkList page being written, stored unless it exists already
+  void StoreChunk(const char *data, size_t length);
+  // collect the chunks listed by the pages of the archive
+  void IndexChunks();
 
   int32_t mode_;
   bool is_open_;
@@ -147,12 +671,157 @@ private:
   std::fstream fs_;
   std::fstream::pos_type tail_pos_;
   std::fstream::pos_type old_tail_;
+  int fd_;  // the archive in writable modes, for syncing, truncating and punching holes
+  std::vector<std::pair<uint64_t, uint64_t>> dead_ranges_;  // start, length of tombstoned data
 
   std::vector<char> comp_buffer_;
+  uint32_t page_checksum_;
+  bool verify_checksums_;
+  bool journal_appends_;
+  bool journaling_;  // journal_appends_ of the current session
+  bool batch_;  // between BeginBatch and Commit
+  bool recover_;
+  uint64_t coalesce_gap_;
+  bool dedup_;
+  bool dedup_indexed_;  // the indexes below cover the pages of the session
+  // pages by content length and checksum, and by format, stored length and checksum
+  std::unordered_multimap<uint64_t, uint32_t> dedup_index_;
+  std::unordered_multimap<uint64_t, uint32_t> stored_index_;
+  uint32_t alignment_;  // for new archives
+  size_t cache_capacity_;
+  unsigned decode_threads_;
+  std::shared_ptr<IOStats> stats_;
+
+  // incremental compression between NewPage and EndNewPage
+  enum { kStreamChunkSize = 64 * 1024 };
+  LZ4F_cctx_s *cctx_;
+  uint16_t stream_format_;
+  uint64_t stream_length_;
+  std::vector<char> chunk_input_;  // partial kLZ4Chunked or kChunkList chunk
+  std::vector<uint64_t> chunk_offsets_;
+  // kChunkList
+  ContentChunker chunker_;
+  std::vector<ChunkRef> chunk_refs_;
+  // chunk pages by content length (high half) and checksum, built on first use
+  std::unordered_multimap<uint64_t, uint32_t> chunk_index_;
+  bool chunk_indexed_;
+  uint32_t next_chunk_idx_;  // only counts down within a session
+  // CRC32C of the content of the page being written, if known
+  uint32_t content_checksum_;
+  bool content_checksum_known_;
+  bool stream_dedup_;  // compare the page once complete
+  // page data held back until the page is known not to be a duplicate
+  enum { kDedupStageSize = 4 * 1024 * 1024 };
+  bool dedup_staging_;
+  std::vector<char> dedup_stage_;
+
+  // direct writes of the page being written, see SetDirectIO
+  enum { kDirectStagingSize = 4 * 1024 * 1024 };
+  bool direct_io_;
+  int direct_fd_;  // -1 if not supported
+  bool direct_page_;
+  uint64_t direct_pos_;  // archive offset of the staged data
+  size_t direct_fill_;
+  std::vector<char> direct_buffer_;
+  char *direct_staging_;  // block aligned start of direct_buffer_
+
+  // kReadOnlyMapped mode
+  std::shared_ptr<MappedFile> map_;
+  uint64_t map_pos_;
 
   std::string filename_;
 };
 
+/**
+ * @brief PagedFile::PageStreamBuf
+ * @details Pulls a page from the archive in kChunkSize pieces and feeds
+ * compressed input to LZ4F_decompress as the reader consumes output.
+ */
+class PagedFile::PageStreamBuf : public std::streambuf {
+public:
+  enum { kChunkSize = 64 * 1024 };
+
+  PageStreamBuf(std::shared_ptr<const ReadContext> ctx, const PagedFileHeader::PageDesc &desc);
+  ~PageStreamBuf();
+
+  PageStreamBuf(const PageStreamBuf &) = delete;
+  PageStreamBuf &operator=(const PageStreamBuf &) = delete;
+
+  bool good() const;
+
+protected:
+  virtual int_type underflow();
+
+private:
+  // produce the next piece of output into out_buffer_, returns its size
+  size_t Fill();
+  // make the next piece of page data available in [src_, src_ + src_left_)
+  bool FetchInput();
+  // read the offset table of a kLZ4Chunked page
+  bool LoadChunkTable();
+
+  std::shared_ptr<const ReadContext> ctx_;
+  uint16_t format_;
+  uint64_t start_;
+  uint64_t length_;
+  uint64_t consumed_;  // page bytes fetched so far
+
+  const char *src_;
+  size_t src_left_;
+  std::vector<char> in_buffer_;
+  std::vector<char> out_buffer_;
+
+  LZ4F_dctx_s *dctx_;
+
+  // kLZ4Chunked
+  std::vector<uint64_t> chunk_offsets_;
+  uint32_t chunk_size_;
+  uint32_t next_chunk_;
+  uint64_t content_length_;
+
+  // kChunkList, next_chunk_ counts these
+  std::vector<uint32_t> chunk_pages_;
+
+  bool finished_;
+  bool good_;
+};
+
+/**
+ * @brief PagedFileReader
+ * @details A cheap, copyable read handle created by PagedFile::CreateReader.
+ * All handles share one parsed page table and one file descriptor (or mapping),
+ * and stay usable after the PagedFile that created them is closed. Reads are
+ * positional and may run concurrently from any number of threads, as long as
+ * the archive is not modified meanwhile.
+ */
+class PagedFileReader {
+public:
+  PagedFileReader();
+
+  bool IsValid() const;
+  const PagedFileHeader &Header() const;
+
+  uint64_t ReadPage(uint32_t idx, char *buffer, size_t buffer_size) const;
+  uint64_t ReadPageRange(uint32_t idx, uint64_t offset, char *buffer, size_t length) const;
+  PagedFile::PageView ViewPage(uint32_t idx) const;
+  bool ExtractPageTo(uint32_t idx, int fd) const;
+  PagedFile::PageInputStream CreatePageIStream(uint32_t idx) const;
+  PagedFile::PageStream CreatePageStream(uint32_t idx) const;
+  PagedFile::PageHandle LoadPage(uint32_t idx) const;
+  bool ReadPages(const std::vector<uint32_t> &pages, const PagedFile::PageCallback &callback) const;
+  bool ReadPages(const std::vector<uint32_t> &pages,
+    std::vector<PagedFile::PageHandle> &handles) const;
+  PageCache::Stats CacheStats() const;
+  IOStats::Counters Stats() const;
+  int32_t VerifyPage(uint32_t idx) const;
+
+private:
+  friend class PagedFile;
+  explicit PagedFileReader(std::shared_ptr<const PagedFile::ReadContext> ctx);
+
+  std::shared_ptr<const PagedFile::ReadContext> ctx_;
+};
+
 }  // namespace
 
 
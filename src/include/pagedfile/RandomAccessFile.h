@@ -0,0 +1,78 @@
+#ifndef PFAR_RANDOMACCESSFILE_H
+#define PFAR_RANDOMACCESSFILE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace pagedfile {
+
+/**
+ * @brief RandomAccessFile
+ * @details Positional (pread style) access to a file. ReadAt does not touch
+ * any shared file position and is safe to call from multiple threads.
+ */
+class RandomAccessFile {
+public:
+  // offsets, lengths and buffers of direct reads are multiples of this
+  enum { kDirectBlockSize = 4096 };
+  // shorter reads keep going through the page cache
+  enum { kMinDirectRead = 64 * 1024 };
+
+  RandomAccessFile();
+  ~RandomAccessFile();
+
+  RandomAccessFile(const RandomAccessFile &) = delete;
+  RandomAccessFile &operator=(const RandomAccessFile &) = delete;
+
+  // with direct_reads, ReadAt bypasses the page cache for reads of at least
+  // kMinDirectRead bytes through O_DIRECT (F_NOCACHE on macOS), unaligned ends are
+  // read through a bounce buffer. Where that is not supported reads stay buffered
+  bool Open(const char *fn, bool direct_reads = false);
+  void Close();
+  bool IsOpen() const;
+  bool DirectReads() const;
+
+  // read up to length bytes at offset, returns number of bytes read
+  size_t ReadAt(uint64_t offset, void *buffer, size_t length) const;
+
+  struct ReadRequest {
+    uint64_t offset {0};
+    size_t length {0};
+  };
+
+  // read many ranges with up to depth reads in flight, through io_uring on Linux.
+  // buffer(i) is called right before range i is submitted and returns where it
+  // goes, done(i, bytes) once it completed. Both run on the calling thread,
+  // completions in any order. Each thread keeps one ring for all of its batches.
+  // A ring that fails with reads in flight keeps their buffers for good, those
+  // ranges are read again into new ones.
+  // Returns false without reading anything if batched reads are not available, direct
+  // reads are enabled or a batch is already running on this thread (from a callback),
+  // callers then fall back to ReadAt
+  bool ReadBatch(const std::vector<ReadRequest> &requests, unsigned depth,
+    const std::function<std::shared_ptr<char>(size_t)> &buffer,
+    const std::function<void(size_t, size_t)> &done) const;
+  uint64_t Size() const;
+
+  // copy length bytes at offset to the current position of descriptor fd inside the
+  // kernel, through copy_file_range on Linux (sharing extents where the file system
+  // can) or sendfile. Returns how many bytes were copied, callers write the rest
+  uint64_t CopyTo(uint64_t offset, uint64_t length, int fd) const;
+
+private:
+#ifdef _WIN32
+  void *handle_;
+#else
+  size_t ReadDirect(uint64_t offset, char *buffer, size_t length) const;
+
+  int fd_;
+  int direct_fd_;  // second descriptor for direct reads, -1 if unused
+#endif
+};
+
+}  // namespace
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef PFAR_THREADPOOL_H
+#define PFAR_THREADPOOL_H
+
+#include <cstddef>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pagedfile {
+
+/**
+ * @brief ThreadPool
+ * @details Fixed set of worker threads running parallel loops. Any number of
+ * threads may call ParallelFor at the same time, their loops share the workers
+ * and each caller works on its own loop while it waits.
+ */
+class ThreadPool {
+public:
+  // threads == 0 uses all cores
+  explicit ThreadPool(unsigned threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // number of threads a loop can run on, including the caller
+  unsigned Size() const;
+
+  // run task(0) ... task(count - 1) and return once all of them finished
+  void ParallelFor(size_t count, const std::function<void(size_t)> &task);
+
+private:
+  struct Loop {
+    const std::function<void(size_t)> *task {nullptr};
+    size_t count {0};
+    std::atomic<size_t> next {0};
+    size_t finished {0};
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+
+  // run iterations of loop until none are left
+  static void Work(Loop &loop);
+  void WorkerMain();
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<std::shared_ptr<Loop>> loops_;
+  bool stop_;
+};
+
+}  // namespace
+
+#endif
@@ -0,0 +1,140 @@
+#include "stdafx.h"
+#include <pagedfile/Checksum.h>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define PFAR_CRC32C_SSE42
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <nmmintrin.h>
+#define PFAR_CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define PFAR_CRC32C_ARM
+#endif
+
+namespace pagedfile {
+
+namespace {
+
+// reflected Castagnoli polynomial
+const uint32_t kPolynomial = 0x82f63b78;
+
+struct Crc32cTable {
+  uint32_t t[8][256];
+
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int k = 0; k < 8; ++k) {
+        crc = (crc >> 1) ^ (kPolynomial & (0u - (crc & 1)));
+      }
+      t[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (int k = 1; k < 8; ++k) {
+        t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+uint32_t Crc32cSoftware(uint32_t crc, const uint8_t *p, size_t length) {
+  static const Crc32cTable table;
+  const auto &t = table.t;
+
+  // slice-by-8, assumes a little endian host like the rest of the archive code
+  while (length >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, sizeof(uint32_t));
+    memcpy(&hi, p + 4, sizeof(uint32_t));
+    lo ^= crc;
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+      ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    p += 8;
+    length -= 8;
+  }
+  while (length-- > 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+#ifdef PFAR_CRC32C_SSE42
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("sse4.2")))
+#endif
+uint32_t Crc32cHardware(uint32_t crc, const uint8_t *p, size_t length) {
+#if defined(__x86_64__) || defined(_M_X64)
+  uint64_t crc64 = crc;
+  while (length >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(uint64_t));
+    crc64 = _mm_crc32_u64(crc64, v);
+    p += 8;
+    length -= 8;
+  }
+  crc = (uint32_t)crc64;
+#endif
+  while (length >= 4) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(uint32_t));
+    crc = _mm_crc32_u32(crc, v);
+    p += 4;
+    length -= 4;
+  }
+  while (length-- > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+
+bool HasHardwareCrc32c() {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_cpu_supports("sse4.2");
+#else
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 20)) != 0;
+#endif
+}
+
+#elif defined(PFAR_CRC32C_ARM)
+
+uint32_t Crc32cHardware(uint32_t crc, const uint8_t *p, size_t length) {
+  while (length >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(uint64_t));
+    crc = __crc32cd(crc, v);
+    p += 8;
+    length -= 8;
+  }
+  while (length-- > 0) {
+    crc = __crc32cb(crc, *p++);
+  }
+  return crc;
+}
+
+bool HasHardwareCrc32c() {
+  return true;
+}
+
+#endif
+
+}  // namespace
+
+uint32_t Crc32c(uint32_t crc, const void *data, size_t length) {
+  const uint8_t *p = (const uint8_t *)data;
+  crc = ~crc;
+#if defined(PFAR_CRC32C_SSE42) || defined(PFAR_CRC32C_ARM)
+  static const bool hardware = HasHardwareCrc32c();
+  if (hardware) {
+    return ~Crc32cHardware(crc, p, length);
+  }
+#endif
+  return ~Crc32cSoftware(crc, p, length);
+}
+
+}  // namespace
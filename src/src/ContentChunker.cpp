@@ -0,0 +1,73 @@
+#include "stdafx.h"
+#include <pagedfile/ContentChunker.h>
+#include <algorithm>
+
+namespace pagedfile {
+
+namespace {
+
+// the top bits of the hash depend on the last 64 bytes, boundaries are tested there.
+// 17 bits before the average size and 13 after keep chunk sizes close to it
+const uint64_t kMaskHard = ~0ull << (64 - 17);
+const uint64_t kMaskEasy = ~0ull << (64 - 13);
+
+// fixed pseudo-random value per byte, the same in every build so archives
+// written anywhere cut identical content the same way
+struct GearTable {
+  uint64_t values[256];
+
+  GearTable() {
+    uint64_t state = 0x5046415243444300;  // ascii: PFARCDC
+    for (auto &value : values) {
+      // splitmix64
+      uint64_t z = (state += 0x9e3779b97f4a7c15);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+      value = z ^ (z >> 31);
+    }
+  }
+};
+
+const GearTable &Gear() {
+  static const GearTable table;
+  return table;
+}
+
+}  // namespace
+
+ContentChunker::ContentChunker() :
+  hash_(0),
+  chunk_length_(0) {
+}
+
+void ContentChunker::Reset() {
+  hash_ = 0;
+  chunk_length_ = 0;
+}
+
+size_t ContentChunker::Next(const char *data, size_t length, bool &boundary) {
+  const uint64_t *gear = Gear().values;
+  boundary = false;
+
+  // no boundary can come before the minimum size, so those bytes are not hashed
+  size_t pos = 0;
+  if (chunk_length_ < kMinSize) {
+    pos = std::min<size_t>(length, kMinSize - chunk_length_);
+    chunk_length_ += pos;
+  }
+
+  while (pos < length) {
+    hash_ = (hash_ << 1) + gear[(uint8_t)data[pos]];
+    ++pos;
+    ++chunk_length_;
+    uint64_t mask = chunk_length_ < kAverageSize ? kMaskHard : kMaskEasy;
+    if ((hash_ & mask) == 0 || chunk_length_ >= kMaxSize) {
+      boundary = true;
+      Reset();
+      break;
+    }
+  }
+  return pos;
+}
+
+}  // namespace
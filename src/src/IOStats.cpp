@@ -0,0 +1,71 @@
+#include "stdafx.h"
+#include <pagedfile/IOStats.h>
+
+namespace pagedfile {
+
+IOStats::IOStats() :
+  enabled_(false),
+  next_offset_(0) {
+}
+
+void IOStats::SetEnabled(bool enabled) {
+  enabled_ = enabled;
+}
+
+void IOStats::CountRead(uint64_t offset, uint64_t length) {
+  if (Enabled()) {
+    counters_[kBytesRead].value.fetch_add(length, std::memory_order_relaxed);
+    CountAccess(offset, length);
+  }
+}
+
+void IOStats::CountWrite(uint64_t offset, uint64_t length) {
+  if (Enabled()) {
+    counters_[kBytesWritten].value.fetch_add(length, std::memory_order_relaxed);
+    CountAccess(offset, length);
+  }
+}
+
+void IOStats::CountPageRead(uint64_t length) {
+  if (Enabled()) {
+    counters_[kPagesRead].value.fetch_add(1, std::memory_order_relaxed);
+    counters_[kBytesReadUncompressed].value.fetch_add(length, std::memory_order_relaxed);
+  }
+}
+
+void IOStats::CountAccess(uint64_t offset, uint64_t length) {
+  // with concurrent readers this approximates how scattered the accesses are
+  if (next_offset_.exchange(offset + length, std::memory_order_relaxed) != offset) {
+    counters_[kSeeks].value.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+IOStats::Counters IOStats::Get() const {
+  auto get = [&](Counter counter) {
+    return counters_[counter].value.load(std::memory_order_relaxed);
+  };
+
+  Counters counters;
+  counters.pages_read = get(kPagesRead);
+  counters.pages_written = get(kPagesWritten);
+  counters.bytes_read = get(kBytesRead);
+  counters.bytes_read_uncompressed = get(kBytesReadUncompressed);
+  counters.bytes_written = get(kBytesWritten);
+  counters.bytes_written_uncompressed = get(kBytesWrittenUncompressed);
+  counters.seeks = get(kSeeks);
+  counters.compress_ns = get(kCompressNanos);
+  counters.decompress_ns = get(kDecompressNanos);
+  counters.buffer_grows = get(kBufferGrows);
+  counters.header_parses = get(kHeaderParses);
+  counters.header_parse_ns = get(kHeaderParseNanos);
+  return counters;
+}
+
+void IOStats::Reset() {
+  for (auto &slot : counters_) {
+    slot.value = 0;
+  }
+  next_offset_ = 0;
+}
+
+}  // namespace
@@ -0,0 +1,138 @@
+#include "stdafx.h"
+#include <pagedfile/MappedFile.h>
+#include <algorithm>
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#elif _WIN32
+#include <windows.h>
+#endif
+
+namespace pagedfile {
+
+MappedFile::MappedFile() :
+  data_(nullptr),
+  size_(0)
+#ifdef _WIN32
+  , file_handle_(INVALID_HANDLE_VALUE),
+  mapping_handle_(nullptr)
+#endif
+{
+}
+
+MappedFile::~MappedFile() {
+  Close();
+}
+
+bool MappedFile::Open(const char *fn) {
+  if (data_ != nullptr || fn == nullptr) {
+    return false;
+  }
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void *ptr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);  // the mapping holds its own reference to the file
+  if (ptr == MAP_FAILED) {
+    return false;
+  }
+
+  data_ = (const char *)ptr;
+  size_ = (uint64_t)st.st_size;
+  return true;
+#elif _WIN32
+  HANDLE file = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, nullptr,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping == nullptr) {
+    CloseHandle(file);
+    return false;
+  }
+
+  void *ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (ptr == nullptr) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+
+  file_handle_ = file;
+  mapping_handle_ = mapping;
+  data_ = (const char *)ptr;
+  size_ = (uint64_t)size.QuadPart;
+  return true;
+#endif
+}
+
+void MappedFile::Close() {
+  if (data_ == nullptr) {
+    return;
+  }
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+  munmap((void *)data_, (size_t)size_);
+#elif _WIN32
+  UnmapViewOfFile(data_);
+  CloseHandle(mapping_handle_);
+  CloseHandle(file_handle_);
+  mapping_handle_ = nullptr;
+  file_handle_ = INVALID_HANDLE_VALUE;
+#endif
+
+  data_ = nullptr;
+  size_ = 0;
+}
+
+bool MappedFile::IsOpen() const {
+  return data_ != nullptr;
+}
+
+const char *MappedFile::Data() const {
+  return data_;
+}
+
+uint64_t MappedFile::Size() const {
+  return size_;
+}
+
+void MappedFile::Release(uint64_t offset, uint64_t length) const {
+  if (data_ == nullptr || offset >= size_) {
+    return;
+  }
+  length = std::min(length, size_ - offset);
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+  // only whole pages inside the range, the partial ones at its ends may still be needed
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  uint64_t begin = (offset + page - 1) / page * page;
+  uint64_t end = offset + length == size_ ? size_ : (offset + length) / page * page;
+  if (begin < end) {
+    madvise((void *)(data_ + begin), (size_t)(end - begin), MADV_DONTNEED);
+  }
+#endif
+}
+
+}  // namespace
@@ -0,0 +1,106 @@
+#include "stdafx.h"
+#include <pagedfile/PageCache.h>
+
+namespace pagedfile {
+
+PageCache::PageCache(size_t capacity) :
+  size_(0),
+  capacity_(capacity),
+  hits_(0),
+  misses_(0),
+  evictions_(0) {
+}
+
+void PageCache::SetCapacity(size_t capacity) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = capacity;
+  EvictTo(capacity);
+}
+
+size_t PageCache::Capacity() const {
+  return capacity_.load(std::memory_order_relaxed);
+}
+
+bool PageCache::Enabled() const {
+  return Capacity() != 0;
+}
+
+std::shared_ptr<uint8_t> PageCache::Find(uint32_t idx, size_t &size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = entries_.find(idx);
+  if (iter == entries_.end()) {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  hits_.fetch_add(1, std::memory_order_relaxed);
+  lru_.splice(lru_.begin(), lru_, iter->second);
+  size = iter->second->size;
+  return iter->second->data;
+}
+
+void PageCache::Insert(uint32_t idx, std::shared_ptr<uint8_t> data, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t capacity = capacity_.load(std::memory_order_relaxed);
+  if (!data || size > capacity) {
+    return;
+  }
+
+  // a concurrent reader may have loaded the same page first, keep its copy
+  if (entries_.find(idx) != entries_.end()) {
+    return;
+  }
+
+  EvictTo(capacity - size);
+  lru_.push_front({idx, std::move(data), size});
+  entries_[idx] = lru_.begin();
+  size_ += size;
+}
+
+void PageCache::Erase(uint32_t idx) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = entries_.find(idx);
+  if (iter != entries_.end()) {
+    size_ -= iter->second->size;
+    lru_.erase(iter->second);
+    entries_.erase(iter);
+  }
+}
+
+void PageCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  lru_.clear();
+  entries_.clear();
+  size_ = 0;
+}
+
+PageCache::Stats PageCache::GetStats() const {
+  Stats stats;
+  stats.hits = hits_.load(std::memory_order_relaxed);
+  stats.misses = misses_.load(std::memory_order_relaxed);
+  stats.evictions = evictions_.load(std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats.entries = entries_.size();
+  stats.size = size_;
+  stats.capacity = capacity_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void PageCache::ResetStats() {
+  hits_ = 0;
+  misses_ = 0;
+  evictions_ = 0;
+}
+
+void PageCache::EvictTo(size_t capacity) {
+  while (size_ > capacity && !lru_.empty()) {
+    const auto &victim = lru_.back();
+    size_ -= victim.size;
+    entries_.erase(victim.idx);
+    lru_.pop_back();
+    evictions_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+}  // namespace
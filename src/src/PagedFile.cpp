@@ -1,15 +1,22 @@
 #include "stdafx.h"
 #include <pagedfile/PagedFile.h>
+#include <pagedfile/Checksum.h>
 #include <iostream>
 #include <fstream>
 #include <algorithm>
 #include <string>
+#include <cstring>
+#include <cerrno>
 #include <lz4.h>
 #include <lz4frame.h>
 #include <boost/algorithm/string.hpp>
 
 #if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
 #include <unistd.h>
+#include <fcntl.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 #elif _WIN32
 #include <io.h>
 #include <errno.h>
@@ -18,28 +25,281 @@
 
 namespace {
 
-bool TruncateFile(const char *fn, uint64_t length) {
+// open a read-write descriptor of an existing file, -1 on failure
+int OpenDescriptor(const char *fn) {
 #if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
-  int ret = truncate(fn, length);
-  return (ret == 0);
+  return open(fn, O_RDWR);
 #elif _WIN32
-  int fh = 0;
-  if (_sopen_s(&fh, fn, _O_RDWR | _O_CREAT, _SH_DENYNO, _S_IREAD | _S_IWRITE) == 0) {
-    int result = _chsize(fh, length);
-    _close(fh);
-    if (result == 0) {
-      return true;
+  int fh = -1;
+  if (_sopen_s(&fh, fn, _O_RDWR | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE) != 0) {
+    return -1;
+  }
+  return fh;
+#endif
+}
+
+void CloseDescriptor(int &fd) {
+  if (fd >= 0) {
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+    close(fd);
+#elif _WIN32
+    _close(fd);
+#endif
+  }
+  fd = -1;
+}
+
+bool TruncateFile(int fd, uint64_t length) {
+  if (fd < 0) {
+    return false;
+  }
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+  return ftruncate(fd, (off_t)length) == 0;
+#elif _WIN32
+  return _chsize_s(fd, (__int64)length) == 0;
+#endif
+}
+
+// flush the written data of a file to the device, metadata only if needed to
+// read the data back
+bool SyncFile(int fd) {
+  if (fd < 0) {
+    return false;
+  }
+#if defined(__linux__) || defined(__ANDROID_API__)
+  return fdatasync(fd) == 0;
+#elif defined(__APPLE__)
+  return fcntl(fd, F_FULLFSYNC) == 0;
+#elif _WIN32
+  return _commit(fd) == 0;
+#endif
+}
+
+// release the disk space of byte ranges while keeping the file size, only
+// supported on Linux. Ranges read back as zeros afterwards
+bool PunchHoles(int fd, const std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = true;
+  for (const auto &range : ranges) {
+    if (range.second != 0 && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+      (off_t)range.first, (off_t)range.second) != 0) {
+      ok = false;
     }
   }
+  return ok;
+#else
+  (void)fd;
+  (void)ranges;
   return false;
 #endif
 }
 
+// copy length bytes from src to a lower offset dst of the same file inside the
+// kernel, returns how many bytes were copied before an error. Each call copies at
+// most the distance between the ranges, the kernel rejects overlapping copies
+uint64_t KernelMoveDown(int fd, uint64_t src, uint64_t dst, uint64_t length,
+  uint64_t chunk_size) {
+#if defined(__linux__) && defined(SYS_copy_file_range)
+  uint64_t copied = 0;
+  chunk_size = std::min(chunk_size, src - dst);
+  while (copied < length) {
+    int64_t in = (int64_t)(src + copied), out = (int64_t)(dst + copied);
+    size_t bytes = (size_t)std::min(chunk_size, length - copied);
+    long ret = syscall(SYS_copy_file_range, fd, &in, fd, &out, bytes, 0u);
+    if (ret <= 0) {
+      break;
+    }
+    copied += (uint64_t)ret;
+  }
+  return copied;
+#else
+  (void)fd;
+  (void)src;
+  (void)dst;
+  (void)length;
+  (void)chunk_size;
+  return 0;
+#endif
+}
+
+// write all of data to a descriptor at its current position
+bool WriteFully(int fd, const char *data, size_t length) {
+  while (length > 0) {
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+    ssize_t bytes = write(fd, data, length);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+#elif _WIN32
+    int bytes = _write(fd, data, (unsigned)std::min<size_t>(length, 0x40000000));
+#endif
+    if (bytes <= 0) {
+      return false;
+    }
+    data += bytes;
+    length -= (size_t)bytes;
+  }
+  return true;
+}
+
+// unaligned load from a serialized table
+template <typename T>
+T Load(const char *src) {
+  T value;
+  memcpy(&value, src, sizeof(T));
+  return value;
+}
+
+// FNV-1a, used for the version 2 hash section
+uint64_t HashName(const char *data, size_t length) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= (uint8_t)data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// kLZ4Chunked pages end with the chunk offset table and this trailer
+struct ChunkTrailer {
+  uint64_t uncompressed_length {0};
+  uint32_t chunk_size {0};
+  uint32_t num_chunks {0};
+  uint64_t table_offset {0};  // relative to page start, not stored
+};
+const size_t kChunkTrailerSize = 16;
+
+bool ParseChunkTrailer(const char *src, uint64_t page_length, ChunkTrailer &trailer) {
+  trailer.uncompressed_length = Load<uint64_t>(src);
+  trailer.chunk_size = Load<uint32_t>(src + 8);
+  trailer.num_chunks = Load<uint32_t>(src + 12);
+  if (trailer.chunk_size == 0
+    || trailer.num_chunks != (trailer.uncompressed_length + trailer.chunk_size - 1)
+      / trailer.chunk_size) {
+    return false;
+  }
+
+  uint64_t table_length = ((uint64_t)trailer.num_chunks + 1) * sizeof(uint64_t);
+  if (page_length < kChunkTrailerSize + table_length) {
+    return false;
+  }
+  trailer.table_offset = page_length - kChunkTrailerSize - table_length;
+  return true;
+}
+
+// raw size of chunk i
+size_t ChunkLength(const ChunkTrailer &trailer, uint32_t i) {
+  return (size_t)std::min<uint64_t>(trailer.chunk_size,
+    trailer.uncompressed_length - (uint64_t)i * trailer.chunk_size);
+}
+
+// compress one chunk into dst (LZ4_compressBound(length) bytes), returns stored size.
+// chunks that do not shrink are stored raw, so stored == raw size marks a raw chunk
+size_t CompressChunk(const char *src, size_t length, char *dst) {
+  int bound = LZ4_compressBound((int)length);
+  int bytes = LZ4_compress_default(src, dst, (int)length, bound);
+  if (bytes <= 0 || (size_t)bytes >= length) {
+    memcpy(dst, src, length);
+    return length;
+  }
+  return (size_t)bytes;
+}
+
+bool DecodeChunk(const char *src, size_t stored_length, char *dst, size_t length) {
+  if (stored_length == length) {
+    memcpy(dst, src, length);
+    return true;
+  }
+  return stored_length < length
+    && LZ4_decompress_safe(src, dst, (int)stored_length, (int)length) == (int)length;
+}
+
+// decompress a page from src into dst, returns uncompressed bytes or 0 on failure
+uint64_t DecompressPage(uint16_t format, const char *src, size_t src_length,
+  char *dst, size_t dst_size) {
+
+  if (format & pagedfile::PagedFile::kLZ4Block) {
+    int bytes = LZ4_decompress_safe(src, dst, src_length, dst_size);
+    if (bytes < 0) {
+      return 0;
+    }
+
+    return (uint64_t)bytes;
+  } else if (format & pagedfile::PagedFile::kLZ4Frame) {
+    LZ4F_dctx* ctx = nullptr;
+    auto err = LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION);
+    if (LZ4F_isError(err)) {
+      // lz4 version mismatch? out of memory?
+      return 0;
+    }
+
+    // set stable dst for lz4 internal optimization
+    LZ4F_decompressOptions_t options;
+    memset(&options, 0, sizeof options);
+    options.stableDst = 1;
+
+    // loop until src buffer is exhausted or frame end
+    size_t dst_consumed = 0;
+    size_t src_left = src_length;
+    while (src_left > 0) {
+      size_t dst_bytes = dst_size - dst_consumed;
+      size_t src_bytes = src_left;
+      auto hint = LZ4F_decompress(ctx, dst, &dst_bytes, src, &src_bytes, &options);
+
+      if (LZ4F_isError(hint)) {
+        // something went wrong, maybe data is corrupted
+        LZ4F_freeDecompressionContext(ctx);
+        return 0;
+      }
+
+      dst += dst_bytes;
+      dst_consumed += dst_bytes;
+      src += src_bytes;
+      src_left -= src_bytes;
+    }
+
+    err = LZ4F_freeDecompressionContext(ctx);
+    if (LZ4F_isError(err)) {
+      return 0;
+    }
+
+    return dst_consumed;
+  }
+  return 0;
+}
+
+// pages whose table entry refers to data in the archive
+bool HoldsData(uint16_t format) {
+  uint16_t type = format & 0xff;
+  return type == pagedfile::PagedFile::kFile || type == pagedfile::PagedFile::kChunk;
+}
+
+// pages whose data starts at the archive alignment, chunks and chunk lists are packed
+bool StartsAligned(uint16_t format) {
+  return (format & 0xff) == pagedfile::PagedFile::kFile
+    && !(format & pagedfile::PagedFile::kChunkList);
+}
+
+uint64_t AlignUp(uint64_t pos, uint64_t alignment) {
+  return (pos + alignment - 1) / alignment * alignment;
+}
+
+// key of the dedup indexes, collisions only cost a comparison
+uint64_t DedupKey(uint16_t format, uint64_t length, uint32_t checksum) {
+  return (length * 0x9e3779b97f4a7c15ull) ^ ((uint64_t)format << 32) ^ checksum;
+}
+
 }
 
 namespace pagedfile {
 
-bool PagedFileHeader::ParseFromStream(std::istream &s, std::istream::pos_type &tail_pos) {
+const int64_t PagedFileHeader::kFooterTag = -0x3254424c52414650;  // negated ascii "PFARLBT2"
+
+bool PagedFileHeader::ParseFromStream(std::istream &s, std::istream::pos_type &tail_pos,
+  bool recover) {
   if (!s.good()) {
     return false;
   }
@@ -52,27 +312,223 @@ bool PagedFileHeader::ParseFromStream(std::istream &s, std::istream::pos_type &t
     return false;
   }
 
-  page_table_.clear();
-  page_order_.clear();
+  s.seekg(0, std::ios::end);
+  uint64_t end = (uint64_t)s.tellg();
+  if (ParseAt(s, end, tail_pos)) {
+    return true;
+  }
+
+  // a commit cut short by a crash leaves a torn tail, fall back to the newest
+  // complete commit before it. Only footers can be found this way, and unless asked
+  // to recover only those of journal deltas: Commit ends with one, other archives
+  // should not have anything after their table. Never further back than the newest
+  // footer that parses, older ones describe states the archive has moved on from.
+  // Torn tails are the pages of one batch, so unless recovering only the end of the
+  // archive is searched, not all of a large one on every open that fails
+  enum { kScanBlockSize = 1024 * 1024 };
+  std::vector<char> block(kScanBlockSize + sizeof(int64_t));
+  uint64_t scan_start = recover || end < kMaxTornTail ? sizeof(uint32_t) : end - kMaxTornTail;
+  uint64_t block_end = end;
+  while (block_end > scan_start) {
+    uint64_t block_start = std::max<uint64_t>(scan_start,
+      block_end > kScanBlockSize ? block_end - kScanBlockSize : 0);
+    size_t bytes = (size_t)(std::min<uint64_t>(end, block_end + sizeof(int64_t) - 1) - block_start);
+    s.clear();
+    s.seekg(block_start, std::ios::beg);
+    s.read(block.data(), bytes);
+    if (!s.good()) {
+      break;
+    }
+    for (size_t pos = bytes >= sizeof(int64_t) ? bytes - sizeof(int64_t) + 1 : 0; pos-- > 0;) {
+      uint64_t candidate = block_start + pos + sizeof(int64_t);
+      if (block_start + pos < block_end && candidate < end
+        && Load<int64_t>(block.data() + pos) == kFooterTag
+        && ParseAt(s, candidate, tail_pos)) {
+        if (recover || journal_depth_ != 0) {
+          return true;
+        }
+        Clear();
+        return false;
+      }
+      s.clear();
+    }
+    block_end = block_start;
+  }
+  Clear();
+  return false;
+}
+
+bool PagedFileHeader::ParseAt(std::istream &s, uint64_t end, std::istream::pos_type &tail_pos) {
+  Clear();
+  file_end_ = end;
+
+  // walk back through journal deltas to the last full table
+  std::vector<std::vector<char>> deltas;
+  bool latest = true;
+  while (true) {
+    if (end < sizeof(uint32_t) + sizeof(int64_t)) {
+      return false;
+    }
+
+    // read page table length, or the footer tag of newer versions
+    int64_t header_length = 0;
+    s.seekg(end - sizeof(int64_t), std::ios::beg);
+    s.read((char*)&header_length, sizeof(int64_t));
+    if (!s.good()) {
+      return false;
+    }
+    if (header_length >= 0) {
+      std::istream::pos_type pos;
+      if (!ParseV1(s, header_length, end, pos)) {
+        return false;
+      }
+      if (latest) {
+        tail_pos = pos;
+      }
+      break;
+    }
+
+    // read footer
+    uint32_t footer_length = 0;
+    s.seekg(end - sizeof(int64_t) - sizeof(uint32_t), std::ios::beg);
+    s.read((char *)&footer_length, sizeof(uint32_t));
+    if (footer_length < kFooterSize || footer_length > end) {
+      return false;
+    }
+    std::vector<char> footer_data(footer_length);
+    s.seekg(end - footer_length, std::ios::beg);
+    s.read(footer_data.data(), footer_length);
+
+    Footer footer;
+    if (!s.good() || !ParseFooter(footer_data.data(), footer_length, end, footer)) {
+      return false;
+    }
+    if (latest) {
+      tail_pos = footer.table_start;
+      alignment_ = footer.alignment;
+      latest = false;
+    }
+
+    // load the table with a single read, records are decoded on demand
+    auto table = std::make_shared<std::vector<char>>(footer.table_length);
+    s.seekg(footer.table_start, std::ios::beg);
+    s.read(table->data(), footer.table_length);
+    if (!s.good()) {
+      return false;
+    }
+
+    if (footer.version == kJournalVersion) {
+      // each delta has to point further back, or the chain could loop
+      if (table->size() < kDeltaHeaderSize || Load<uint64_t>(table->data()) > footer.table_start) {
+        return false;
+      }
+      end = Load<uint64_t>(table->data());
+      deltas.push_back(std::move(*table));
+      continue;
+    }
+
+    if (!ParseV2(table->data(), footer.table_length, table)) {
+      return false;
+    }
+    break;
+  }
+
+  // replay deltas oldest first
+  for (auto iter = deltas.rbegin(); iter != deltas.rend(); ++iter) {
+    if (!ApplyDelta(iter->data(), iter->size())) {
+      return false;
+    }
+  }
+  if (!deltas.empty()) {
+    journal_depth_ = Load<uint32_t>(deltas.front().data() + 8);
+    // readers of deltas know version 2 as well, so the next full table can keep
+    // the checksums the deltas recorded
+    version_ = kVersion2;
+  }
+
+  data_end_ = (uint64_t)tail_pos;
+  journal_base_ = true;
+  journal_base_pages_ = IsPacked() ? packed_.num_pages : (uint32_t)page_order_.size();
+  return true;
+}
+
+bool PagedFileHeader::ParseFromMapping(std::shared_ptr<const MappedFile> map, uint64_t &tail_pos,
+  bool recover) {
+  if (!map || map->Size() < sizeof(uint32_t) + sizeof(int64_t)) {
+    return false;
+  }
+
+  const char *data = map->Data();
+  uint64_t size = map->Size();
+  if (Load<int64_t>(data + size - sizeof(int64_t)) >= 0) {
+    // version 1 tables have to be decoded entry by entry
+    BufferStreamBuf buf(const_cast<char *>(data), const_cast<char *>(data) + size);
+    std::istream s(&buf);
+    std::istream::pos_type pos;
+    if (!ParseFromStream(s, pos, recover)) {
+      return false;
+    }
+    tail_pos = (uint64_t)pos;
+    return true;
+  }
+
+  if (Load<uint32_t>(data) != PagedFile::kMagicNumber) {
+    return false;
+  }
+
+  Clear();
+
+  uint32_t footer_length = Load<uint32_t>(data + size - sizeof(int64_t) - sizeof(uint32_t));
+  Footer footer;
+  if (footer_length < kFooterSize || footer_length > size
+    || !ParseFooter(data + size - footer_length, footer_length, size, footer)
+    || footer.version == kJournalVersion) {
+    // journaled tables are merged into a decoded table, and a torn tail is
+    // rolled back by the stream parser
+    BufferStreamBuf buf(const_cast<char *>(data), const_cast<char *>(data) + size);
+    std::istream s(&buf);
+    std::istream::pos_type pos;
+    if (!ParseFromStream(s, pos, recover)) {
+      return false;
+    }
+    tail_pos = (uint64_t)pos;
+    return true;
+  }
+
+  // use the table straight from the mapping
+  if (!ParseV2(data + footer.table_start, footer.table_length, map)) {
+    return false;
+  }
+
+  tail_pos = footer.table_start;
+  alignment_ = footer.alignment;
+  data_end_ = footer.table_start;
+  file_end_ = size;
+  journal_base_ = true;
+  journal_base_pages_ = packed_.num_pages;
+  return true;
+}
 
-  // read page table length
-  int64_t header_length = 0;
-  s.seekg(-(int64_t)sizeof(int64_t), std::ios::end);
-  s.read((char*)&header_length, sizeof(int64_t));
+bool PagedFileHeader::ParseV1(std::istream &s, int64_t header_length, uint64_t end,
+  std::istream::pos_type &tail_pos) {
 
   // seek to beginning of page table
-  s.seekg(-header_length - sizeof(int64_t), std::ios::end);
-  tail_pos = s.tellg();
+  if ((uint64_t)header_length > end - sizeof(int64_t)) {
+    return false;
+  }
+  tail_pos = end - header_length - sizeof(int64_t);
+  s.seekg(tail_pos, std::ios::beg);
 
   // read num_pages
   uint32_t num_pages = 0;
   s.read((char *)&num_pages, sizeof(uint32_t));
 
-  // read all page descs
-  PageDesc page_desc;
+  // read all page descs, each from scratch as names and uncompressed lengths are
+  // only stored when present
   uint32_t idx = 0;
   page_order_.resize(num_pages);
   for (uint32_t i = 0; i < num_pages; ++i) {
+    PageDesc page_desc;
     s.read((char *)&idx, sizeof(uint32_t));
     s.read((char *)&page_desc.start, sizeof(uint64_t));
     s.read((char *)&page_desc.length, sizeof(uint64_t));
@@ -89,16 +545,81 @@ bool PagedFileHeader::ParseFromStream(std::istream &s, std::istream::pos_type &t
       page_desc.name.resize(name_length);
       s.read(&page_desc.name[0], name_length);
     }
-    page_table_[idx] = page_desc;
+    page_table_[idx] = std::move(page_desc);
     page_order_[i] = idx;
   }
 
+  version_ = kVersion1;
+  return true;
+}
+
+bool PagedFileHeader::ParseV2(const char *table, uint64_t table_length,
+  std::shared_ptr<const void> owner) {
+
+  if (table_length < kTableHeaderSize) {
+    return false;
+  }
+
+  PackedTable packed;
+  packed.num_pages = Load<uint32_t>(table);
+  packed.record_size = Load<uint32_t>(table + 4);
+  uint32_t flags = Load<uint32_t>(table + 8);
+  packed.hash_buckets = Load<uint32_t>(table + 12);
+  uint64_t names_offset = Load<uint64_t>(table + 16);
+  packed.names_length = Load<uint64_t>(table + 24);
+  uint64_t hash_offset = Load<uint64_t>(table + 32);
+
+  // records may grow in later versions, but never shrink
+  if (packed.record_size < kMinRecordSize
+    || kTableHeaderSize + (uint64_t)packed.num_pages * packed.record_size > table_length
+    || names_offset > table_length || packed.names_length > table_length - names_offset) {
+    return false;
+  }
+  packed.records = table + kTableHeaderSize;
+  packed.names = table + names_offset;
+
+  if ((flags & kHashSection) && packed.hash_buckets != 0
+    && hash_offset <= table_length
+    && (uint64_t)packed.hash_buckets * sizeof(uint32_t) <= table_length - hash_offset) {
+    packed.hash = table + hash_offset;
+  } else {
+    packed.hash_buckets = 0;
+  }
+
+  packed.owner = std::move(owner);
+  packed_ = std::move(packed);
+  version_ = kVersion2;
   return true;
 }
 
+bool PagedFileHeader::ParseFooter(const char *data, uint32_t length, uint64_t file_size,
+  Footer &footer) {
+
+  footer.table_start = Load<uint64_t>(data);
+  footer.table_length = Load<uint64_t>(data + 8);
+  footer.version = Load<uint32_t>(data + 16);
+  footer.alignment = length >= kAlignedFooterSize ? Load<uint32_t>(data + 20) : 1;
+
+  return (footer.version == kVersion2 || footer.version == kJournalVersion)
+    && footer.alignment != 0 && (footer.alignment & (footer.alignment - 1)) == 0
+    && footer.table_start <= file_size
+    && footer.table_length <= file_size - footer.table_start
+    && footer.table_start + footer.table_length + length <= file_size;
+}
+
 void PagedFileHeader::Clear() {
+  alignment_ = 1;
+  data_end_ = 0;
+  file_end_ = 0;
+  journal_base_ = false;
+  journal_rewrite_ = false;
+  journal_depth_ = 0;
+  journal_base_pages_ = 0;
+  journal_removed_.clear();
   page_table_.clear();
   page_order_.clear();
+  packed_ = PackedTable();
+  lazy_.Invalidate();
 }
 
 bool PagedFileHeader::WriteToFile(std::fstream::pos_type tail_pos, std::fstream &fs) {
@@ -106,7 +627,23 @@ bool PagedFileHeader::WriteToFile(std::fstream::pos_type tail_pos, std::fstream
     return false;
   }
 
+  Materialize();
   fs.seekp(tail_pos);
+  data_end_ = (uint64_t)tail_pos;
+
+  // a full table ends the journal chain
+  journal_base_ = true;
+  journal_rewrite_ = false;
+  journal_depth_ = 0;
+  journal_base_pages_ = (uint32_t)page_order_.size();
+  journal_removed_.clear();
+
+  if (version_ == kVersion2) {
+    WriteV2(fs);
+    WriteFooter(fs, (uint64_t)tail_pos, kVersion2);
+    file_end_ = (uint64_t)fs.tellp();
+    return fs.good();
+  }
 
   // write num_pages
   uint32_t num_pages = (uint32_t)page_table_.size();
@@ -136,103 +673,650 @@ bool PagedFileHeader::WriteToFile(std::fstream::pos_type tail_pos, std::fstream
 
   // write page table length
   fs.write((char *)&header_length, sizeof(int64_t));
+  file_end_ = (uint64_t)fs.tellp();
   return true;
 }
 
-bool PagedFileHeader::PageLength(
-  uint32_t page_idx, uint64_t &length, uint64_t &uncompressed_length) const {
-
-  auto iter = page_table_.find(page_idx);
-  if (iter != page_table_.end()) {
-    length = iter->second.length;
-    uncompressed_length = iter->second.uncompressed_length;
-    return true;
+void PagedFileHeader::WriteFooter(std::fstream &fs, uint64_t table_start,
+  uint32_t version) const {
+
+  Footer footer;
+  footer.table_start = table_start;
+  footer.table_length = (uint64_t)fs.tellp() - table_start;
+  footer.version = version;
+  uint32_t footer_length = alignment_ > 1 ? kAlignedFooterSize : kFooterSize;
+  fs.write((char *)&footer.table_start, sizeof(uint64_t));
+  fs.write((char *)&footer.table_length, sizeof(uint64_t));
+  fs.write((char *)&footer.version, sizeof(uint32_t));
+  if (alignment_ > 1) {
+    fs.write((char *)&alignment_, sizeof(uint32_t));
   }
-  return false;
+  fs.write((char *)&footer_length, sizeof(uint32_t));
+  fs.write((char *)&kFooterTag, sizeof(int64_t));
 }
 
-bool PagedFileHeader::PageOffset(uint32_t page_idx, uint64_t &offset) const {
-  auto iter = page_table_.find(page_idx);
-  if (iter != page_table_.end()) {
-    offset = iter->second.start;
-    return true;
+bool PagedFileHeader::WriteDelta(std::fstream::pos_type tail_pos, std::fstream &fs,
+  const std::function<bool()> &before_footer) {
+  if (!fs.good() || !journal_base_) {
+    return false;
   }
-  return false;
-}
 
-const std::string &PagedFileHeader::PageName(uint32_t page_idx) const {
-  auto iter = page_table_.find(page_idx);
-  if (iter != page_table_.end()) {
-    return iter->second.name;
+  Materialize();
+  fs.seekp(tail_pos);
+  data_end_ = (uint64_t)tail_pos;
+
+  std::vector<char> delta;
+  auto put = [&](const void *data, size_t length) {
+    delta.insert(delta.end(), (const char *)data, (const char *)data + length);
+  };
+
+  uint64_t previous_end = file_end_;
+  uint32_t depth = journal_depth_ + 1;
+  uint32_t num_removed = (uint32_t)journal_removed_.size();
+  uint32_t num_added = (uint32_t)page_order_.size() - journal_base_pages_;
+  put(&previous_end, sizeof(uint64_t));
+  put(&depth, sizeof(uint32_t));
+  put(&num_removed, sizeof(uint32_t));
+  put(&num_added, sizeof(uint32_t));
+  put(journal_removed_.data(), journal_removed_.size() * sizeof(uint32_t));
+
+  for (uint32_t i = journal_base_pages_; i < page_order_.size(); ++i) {
+    uint32_t idx = page_order_[i];
+    const auto &desc = page_table_[idx];
+    uint16_t record_flags = desc.has_checksum ? kRecordChecksum : 0;
+    uint16_t name_length = (uint16_t)desc.name.size();
+    put(&idx, sizeof(uint32_t));
+    put(&desc.format, sizeof(uint16_t));
+    put(&record_flags, sizeof(uint16_t));
+    put(&desc.start, sizeof(uint64_t));
+    put(&desc.length, sizeof(uint64_t));
+    put(&desc.uncompressed_length, sizeof(uint64_t));
+    put(&desc.checksum, sizeof(uint32_t));
+    put(&name_length, sizeof(uint16_t));
+    put(desc.name.data(), name_length);
   }
-  static const std::string empty_str;
-  return empty_str;
-}
 
-uint16_t PagedFileHeader::PageFormat(uint32_t page_idx) const {
-  auto iter = page_table_.find(page_idx);
-  if (iter != page_table_.end()) {
-    return iter->second.format;
+  fs.write(delta.data(), delta.size());
+  if (before_footer && !before_footer()) {
+    return false;
   }
-  return 0;
-}
+  WriteFooter(fs, (uint64_t)tail_pos, kJournalVersion);
 
-PagedFileHeader::PageDesc *PagedFileHeader::Desc(uint32_t idx) {
-  auto iter = page_table_.find(idx);
-  if (iter != page_table_.end()) {
-    return &iter->second;
-  }
-  return nullptr;
+  journal_depth_ = depth;
+  journal_base_pages_ = (uint32_t)page_order_.size();
+  journal_removed_.clear();
+  file_end_ = (uint64_t)fs.tellp();
+  return fs.good();
 }
 
-const PagedFileHeader::PageDesc *PagedFileHeader::Desc(uint32_t idx) const {
-  auto iter = page_table_.find(idx);
-  if (iter != page_table_.end()) {
-    return &iter->second;
-  }
-  return nullptr;
-}
+bool PagedFileHeader::ApplyDelta(const char *delta, uint64_t length) {
+  Materialize();
+  lazy_.Invalidate();
 
-bool PagedFileHeader::Exists(uint32_t idx) const {
-  return page_table_.find(idx) != page_table_.end();
-}
+  uint32_t num_removed = Load<uint32_t>(delta + 12);
+  uint32_t num_added = Load<uint32_t>(delta + 16);
+  uint64_t pos = kDeltaHeaderSize;
+  if ((uint64_t)num_removed * sizeof(uint32_t) > length - pos) {
+    return false;
+  }
 
-void PagedFileHeader::AddPage(uint32_t idx, const PageDesc &desc) {
-  page_table_[idx] = desc;
-  page_order_.push_back(idx);
-}
+  if (num_removed != 0) {
+    std::unordered_set<uint32_t> removed;
+    for (uint32_t i = 0; i < num_removed; ++i, pos += sizeof(uint32_t)) {
+      uint32_t idx = Load<uint32_t>(delta + pos);
+      removed.insert(idx);
+      page_table_.erase(idx);
+    }
+    page_order_.erase(std::remove_if(page_order_.begin(), page_order_.end(),
+      [&](uint32_t idx) { return removed.count(idx) != 0; }), page_order_.end());
+  }
 
-void PagedFileHeader::AddPage(uint32_t idx, PageDesc &&desc) {
-  page_table_[idx] = std::move(desc);
-  page_order_.push_back(idx);
-}
+  for (uint32_t i = 0; i < num_added; ++i) {
+    if (kDeltaRecordSize > length - pos) {
+      return false;
+    }
+    const char *record = delta + pos;
+    uint32_t idx = Load<uint32_t>(record);
+    PageDesc desc;
+    desc.format = Load<uint16_t>(record + 4);
+    desc.has_checksum = (Load<uint16_t>(record + 6) & kRecordChecksum) != 0;
+    desc.start = Load<uint64_t>(record + 8);
+    desc.length = Load<uint64_t>(record + 16);
+    desc.uncompressed_length = Load<uint64_t>(record + 24);
+    desc.checksum = Load<uint32_t>(record + 32);
+    uint16_t name_length = Load<uint16_t>(record + 36);
+    pos += kDeltaRecordSize;
+    if (name_length > length - pos) {
+      return false;
+    }
+    desc.name.assign(delta + pos, name_length);
+    pos += name_length;
 
-const std::vector<uint32_t> &PagedFileHeader::ListPages() const {
-  return page_order_;
+    if (page_table_.find(idx) == page_table_.end()) {
+      page_order_.push_back(idx);
+    }
+    page_table_[idx] = std::move(desc);
+  }
+  return true;
 }
 
-std::vector<uint32_t> PagedFileHeader::ListPages(const std::string &prefix) const {
-  if (prefix.empty()) {
-    return ListPages();
+void PagedFileHeader::WriteV2(std::fstream &fs) const {
+  struct Record {
+    uint32_t idx;
+    uint32_t order;
+    const PageDesc *desc;
+  };
+
+  // records sorted by index
+  std::vector<Record> records;
+  records.reserve(page_order_.size());
+  for (uint32_t i = 0; i < page_order_.size(); ++i) {
+    auto iter = page_table_.find(page_order_[i]);
+    if (iter != page_table_.end()) {
+      records.push_back({iter->first, (uint32_t)records.size(), &iter->second});
+    }
+  }
+  std::sort(records.begin(), records.end(),
+    [](const Record &a, const Record &b) { return a.idx < b.idx; });
+
+  uint32_t num_pages = (uint32_t)records.size();
+  uint32_t num_named = 0;
+  uint64_t names_length = 0;
+  for (const auto &record : records) {
+    names_length += record.desc->name.size();
+    num_named += !record.desc->name.empty();
   }
 
-  std::vector<uint32_t> result;
-  for (const auto &kvp : page_table_) {
-    const auto &desc = kvp.second;
-    if (boost::starts_with(desc.name, prefix)) {
-      result.push_back(kvp.first);
+  // hash section, filled in archive order so duplicates resolve to the first page.
+  // Nameless pages (kChunk) are left out, they would all probe the same cluster
+  uint32_t hash_buckets = 0;
+  std::vector<uint32_t> hash;
+  if (num_named != 0) {
+    hash_buckets = 1;
+    while (hash_buckets < 2 * (uint64_t)num_named) {
+      hash_buckets <<= 1;
     }
-  }
+    std::vector<uint32_t> by_order(num_pages);
+    for (uint32_t r = 0; r < num_pages; ++r) {
+      by_order[records[r].order] = r;
+    }
+    hash.assign(hash_buckets, kEmptyBucket);
+    for (uint32_t r : by_order) {
+      const auto &name = records[r].desc->name;
+      if (name.empty())
+        continue;
+      uint32_t bucket = (uint32_t)HashName(name.data(), name.size()) & (hash_buckets - 1);
+      while (hash[bucket] != kEmptyBucket) {
+        bucket = (bucket + 1) & (hash_buckets - 1);
+      }
+      hash[bucket] = r;
+    }
+  }
+
+  uint32_t record_size = kRecordSize;
+  uint32_t flags = hash_buckets != 0 ? kHashSection : 0;
+  uint64_t names_offset = kTableHeaderSize + (uint64_t)num_pages * kRecordSize;
+  uint64_t hash_offset = hash_buckets != 0 ? names_offset + names_length : 0;
+
+  // table header
+  fs.write((char *)&num_pages, sizeof(uint32_t));
+  fs.write((char *)&record_size, sizeof(uint32_t));
+  fs.write((char *)&flags, sizeof(uint32_t));
+  fs.write((char *)&hash_buckets, sizeof(uint32_t));
+  fs.write((char *)&names_offset, sizeof(uint64_t));
+  fs.write((char *)&names_length, sizeof(uint64_t));
+  fs.write((char *)&hash_offset, sizeof(uint64_t));
+
+  // records, staged so the stream sees few large writes
+  std::vector<char> staging;
+  staging.reserve(kStagingSize);
+  auto flush = [&]() {
+    fs.write(staging.data(), staging.size());
+    staging.clear();
+  };
+  auto put = [&](const void *data, size_t length) {
+    if (staging.size() + length > kStagingSize) {
+      flush();
+    }
+    staging.insert(staging.end(), (const char *)data, (const char *)data + length);
+  };
+
+  uint64_t name_offset = 0;
+  uint32_t reserved = 0;
+  for (const auto &record : records) {
+    const auto &desc = *record.desc;
+    uint32_t name_length = (uint32_t)desc.name.size();
+    uint16_t record_flags = desc.has_checksum ? kRecordChecksum : 0;
+    put(&record.idx, sizeof(uint32_t));
+    put(&desc.format, sizeof(uint16_t));
+    put(&record_flags, sizeof(uint16_t));
+    put(&desc.start, sizeof(uint64_t));
+    put(&desc.length, sizeof(uint64_t));
+    put(&desc.uncompressed_length, sizeof(uint64_t));
+    put(&name_offset, sizeof(uint64_t));
+    put(&name_length, sizeof(uint32_t));
+    put(&record.order, sizeof(uint32_t));
+    put(&desc.checksum, sizeof(uint32_t));
+    put(&reserved, sizeof(uint32_t));
+    name_offset += name_length;
+  }
+  for (const auto &record : records) {
+    put(record.desc->name.data(), record.desc->name.size());
+  }
+  flush();
+
+  fs.write((char *)hash.data(), hash.size() * sizeof(uint32_t));
+}
+
+uint32_t PagedFileHeader::Version() const {
+  return version_;
+}
+
+void PagedFileHeader::SetVersion(uint32_t version) {
+  if ((version == kVersion1 || version == kVersion2) && version != version_
+    && (version != kVersion1 || alignment_ == 1)) {
+    version_ = version;
+    journal_rewrite_ = true;
+  }
+}
+
+uint32_t PagedFileHeader::Alignment() const {
+  return alignment_;
+}
+
+bool PagedFileHeader::IsPacked() const {
+  return packed_.owner != nullptr;
+}
+
+uint32_t PagedFileHeader::FindRecord(uint32_t idx) const {
+  uint32_t lo = 0, hi = packed_.num_pages;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    uint32_t mid_idx = Load<uint32_t>(packed_.records + (uint64_t)mid * packed_.record_size);
+    if (mid_idx < idx) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < packed_.num_pages
+    && Load<uint32_t>(packed_.records + (uint64_t)lo * packed_.record_size) == idx) {
+    return lo;
+  }
+  return packed_.num_pages;
+}
+
+void PagedFileHeader::DecodeRecord(uint32_t record, uint32_t &idx, PageDesc &desc,
+  uint32_t &order, bool with_name) const {
+
+  const char *r = packed_.records + (uint64_t)record * packed_.record_size;
+  idx = Load<uint32_t>(r);
+  desc.format = Load<uint16_t>(r + 4);
+  uint16_t record_flags = Load<uint16_t>(r + 6);
+  desc.start = Load<uint64_t>(r + 8);
+  desc.length = Load<uint64_t>(r + 16);
+  desc.uncompressed_length = Load<uint64_t>(r + 24);
+  order = Load<uint32_t>(r + 44);
+  desc.has_checksum = packed_.record_size >= kRecordSize && (record_flags & kRecordChecksum);
+  desc.checksum = desc.has_checksum ? Load<uint32_t>(r + 48) : 0;
+
+  if (with_name) {
+    uint64_t name_offset = Load<uint64_t>(r + 32);
+    uint32_t name_length = Load<uint32_t>(r + 40);
+    if (name_offset <= packed_.names_length && name_length <= packed_.names_length - name_offset) {
+      desc.name.assign(packed_.names + name_offset, name_length);
+    } else {
+      desc.name.clear();
+    }
+  }
+}
+
+void PagedFileHeader::Materialize() {
+  if (!IsPacked()) {
+    return;
+  }
+
+  std::vector<std::pair<uint32_t, uint32_t>> order;  // (position, idx)
+  order.reserve(packed_.num_pages);
+  page_table_.clear();
+  page_table_.reserve(packed_.num_pages);
+  for (uint32_t r = 0; r < packed_.num_pages; ++r) {
+    uint32_t idx = 0, position = 0;
+    PageDesc desc;
+    DecodeRecord(r, idx, desc, position, true);
+    page_table_[idx] = std::move(desc);
+    order.emplace_back(position, idx);
+  }
+  std::sort(order.begin(), order.end());
+
+  page_order_.clear();
+  page_order_.reserve(order.size());
+  for (const auto &entry : order) {
+    page_order_.push_back(entry.second);
+  }
+
+  packed_ = PackedTable();
+  lazy_.Invalidate();
+}
+
+bool PagedFileHeader::Locate(uint32_t idx, PageDesc &desc) const {
+  if (IsPacked()) {
+    uint32_t record = FindRecord(idx);
+    if (record == packed_.num_pages) {
+      return false;
+    }
+    uint32_t record_idx = 0, order = 0;
+    DecodeRecord(record, record_idx, desc, order, false);
+    return true;
+  }
+
+  auto iter = page_table_.find(idx);
+  if (iter == page_table_.end()) {
+    return false;
+  }
+  desc.format = iter->second.format;
+  desc.start = iter->second.start;
+  desc.length = iter->second.length;
+  desc.uncompressed_length = iter->second.uncompressed_length;
+  desc.checksum = iter->second.checksum;
+  desc.has_checksum = iter->second.has_checksum;
+  return true;
+}
+
+bool PagedFileHeader::PageLength(
+  uint32_t page_idx, uint64_t &length, uint64_t &uncompressed_length) const {
+
+  PageDesc desc;
+  if (Locate(page_idx, desc)) {
+    length = desc.length;
+    uncompressed_length = desc.uncompressed_length;
+    return true;
+  }
+  return false;
+}
+
+bool PagedFileHeader::PageOffset(uint32_t page_idx, uint64_t &offset) const {
+  PageDesc desc;
+  if (Locate(page_idx, desc)) {
+    offset = desc.start;
+    return true;
+  }
+  return false;
+}
+
+const std::string &PagedFileHeader::PageName(uint32_t page_idx) const {
+  auto desc = Desc(page_idx);
+  if (desc != nullptr) {
+    return desc->name;
+  }
+  static const std::string empty_str;
+  return empty_str;
+}
+
+uint16_t PagedFileHeader::PageFormat(uint32_t page_idx) const {
+  PageDesc desc;
+  if (Locate(page_idx, desc)) {
+    return desc.format;
+  }
+  return 0;
+}
+
+bool PagedFileHeader::PageChecksum(uint32_t page_idx, uint32_t &checksum) const {
+  PageDesc desc;
+  if (Locate(page_idx, desc) && desc.has_checksum) {
+    checksum = desc.checksum;
+    return true;
+  }
+  return false;
+}
+
+PagedFileHeader::PageDesc *PagedFileHeader::Desc(uint32_t idx) {
+  // the caller may rename the page
+  Materialize();
+  lazy_.Invalidate();
+  auto iter = page_table_.find(idx);
+  if (iter != page_table_.end()) {
+    return &iter->second;
+  }
+  return nullptr;
+}
+
+const PagedFileHeader::PageDesc *PagedFileHeader::Desc(uint32_t idx) const {
+  if (IsPacked()) {
+    // decode on first access, map nodes keep the returned pointer stable
+    std::lock_guard<std::mutex> lock(lazy_.mutex);
+    auto iter = lazy_.descs.find(idx);
+    if (iter != lazy_.descs.end()) {
+      return &iter->second;
+    }
+    uint32_t record = FindRecord(idx);
+    if (record == packed_.num_pages) {
+      return nullptr;
+    }
+    uint32_t record_idx = 0, order = 0;
+    PageDesc desc;
+    DecodeRecord(record, record_idx, desc, order, true);
+    return &lazy_.descs.emplace(idx, std::move(desc)).first->second;
+  }
+
+  auto iter = page_table_.find(idx);
+  if (iter != page_table_.end()) {
+    return &iter->second;
+  }
+  return nullptr;
+}
+
+bool PagedFileHeader::Exists(uint32_t idx) const {
+  if (IsPacked()) {
+    return FindRecord(idx) != packed_.num_pages;
+  }
+  return page_table_.find(idx) != page_table_.end();
+}
+
+uint64_t PagedFileHeader::DeadBytes() const {
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  PageDesc desc;
+  for (uint32_t idx : ListPages()) {
+    if (Locate(idx, desc) && HoldsData(desc.format) && desc.length != 0) {
+      ranges.emplace_back(desc.start, desc.start + desc.length);
+    }
+  }
+  std::sort(ranges.begin(), ranges.end());
+
+  // pages may share data, so live bytes are the union of their ranges. Gaps that
+  // only pad up to the next aligned offset are not dead either
+  uint64_t live = 0, covered = sizeof(uint32_t);
+  auto padding = [&](uint64_t next) -> uint64_t {
+    return next > covered && next % alignment_ == 0 && next - covered < alignment_ ?
+      next - covered : 0;
+  };
+  for (const auto &range : ranges) {
+    live += padding(range.first);
+    uint64_t begin = std::max(range.first, covered);
+    if (range.second > begin) {
+      live += range.second - begin;
+      covered = range.second;
+    }
+  }
+  live += padding(data_end_);
+
+  uint64_t data_length = data_end_ > sizeof(uint32_t) ? data_end_ - sizeof(uint32_t) : 0;
+  return data_length > live ? data_length - live : 0;
+}
+
+double PagedFileHeader::DeadRatio() const {
+  uint64_t data_length = data_end_ > sizeof(uint32_t) ? data_end_ - sizeof(uint32_t) : 0;
+  return data_length != 0 ? (double)DeadBytes() / data_length : 0.0;
+}
+
+void PagedFileHeader::AddPage(uint32_t idx, const PageDesc &desc) {
+  Materialize();
+  lazy_.Invalidate();
+  page_table_[idx] = desc;
+  page_order_.push_back(idx);
+}
+
+void PagedFileHeader::AddPage(uint32_t idx, PageDesc &&desc) {
+  Materialize();
+  lazy_.Invalidate();
+  page_table_[idx] = std::move(desc);
+  page_order_.push_back(idx);
+}
+
+const std::vector<uint32_t> &PagedFileHeader::ListPages() const {
+  if (!IsPacked()) {
+    return page_order_;
+  }
+
+  if (lazy_.order_valid.load(std::memory_order_acquire)) {
+    return lazy_.order;
+  }
+
+  std::lock_guard<std::mutex> lock(lazy_.mutex);
+  if (!lazy_.order_valid.load(std::memory_order_relaxed)) {
+    // scatter record indices to their archive positions
+    auto &order = lazy_.order;
+    order.assign(packed_.num_pages, 0);
+    for (uint32_t r = 0; r < packed_.num_pages; ++r) {
+      const char *record = packed_.records + (uint64_t)r * packed_.record_size;
+      uint32_t position = Load<uint32_t>(record + 44);
+      if (position < order.size()) {
+        order[position] = Load<uint32_t>(record);
+      }
+    }
+    lazy_.order_valid.store(true, std::memory_order_release);
+  }
+  return lazy_.order;
+}
+
+std::vector<uint32_t> PagedFileHeader::ListPages(const std::string &prefix) const {
+  if (prefix.empty()) {
+    return ListPages();
+  }
+
+  // names sharing a prefix are adjacent in the index
+  const auto &entries = NameEntries();
+  auto iter = std::lower_bound(entries.begin(), entries.end(), std::string_view(prefix),
+    [](const LazyState::NameEntry &entry, std::string_view key) { return entry.name < key; });
+
+  std::vector<LazyState::NameEntry> matches;
+  for (; iter != entries.end() && iter->name.substr(0, prefix.size()) == prefix; ++iter) {
+    matches.push_back(*iter);
+  }
+  std::sort(matches.begin(), matches.end(),
+    [](const LazyState::NameEntry &a, const LazyState::NameEntry &b) {
+      return a.order < b.order;
+    });
+
+  std::vector<uint32_t> result;
+  result.reserve(matches.size());
+  for (const auto &entry : matches) {
+    result.push_back(entry.idx);
+  }
   return result;
 }
 
+bool PagedFileHeader::FindPage(const std::string &name, uint32_t &idx) const {
+  if (name.empty())
+    return false;  // nameless pages are only reachable by index
+
+  if (IsPacked() && packed_.hash != nullptr) {
+    // probe the on-disk hash section without building the name index
+    uint32_t mask = packed_.hash_buckets - 1;
+    uint32_t bucket = (uint32_t)HashName(name.data(), name.size()) & mask;
+    for (uint32_t probe = 0; probe < packed_.hash_buckets; ++probe) {
+      uint32_t record = Load<uint32_t>(packed_.hash + (uint64_t)bucket * sizeof(uint32_t));
+      if (record == kEmptyBucket || record >= packed_.num_pages) {
+        return false;
+      }
+      const char *r = packed_.records + (uint64_t)record * packed_.record_size;
+      uint64_t name_offset = Load<uint64_t>(r + 32);
+      uint32_t name_length = Load<uint32_t>(r + 40);
+      if (name_length == name.size() && name_offset <= packed_.names_length
+        && name_length <= packed_.names_length - name_offset
+        && memcmp(packed_.names + name_offset, name.data(), name_length) == 0) {
+        idx = Load<uint32_t>(r);
+        return true;
+      }
+      bucket = (bucket + 1) & mask;
+    }
+    return false;
+  }
+
+  const auto &entries = NameEntries();
+  auto iter = std::lower_bound(entries.begin(), entries.end(), std::string_view(name),
+    [](const LazyState::NameEntry &entry, std::string_view key) { return entry.name < key; });
+  if (iter != entries.end() && iter->name == name) {
+    idx = iter->idx;
+    return true;
+  }
+  return false;
+}
+
+const std::vector<PagedFileHeader::LazyState::NameEntry> &PagedFileHeader::NameEntries() const {
+  if (lazy_.names_valid.load(std::memory_order_acquire)) {
+    return lazy_.names;
+  }
+
+  std::lock_guard<std::mutex> lock(lazy_.mutex);
+  if (!lazy_.names_valid.load(std::memory_order_relaxed)) {
+    auto &entries = lazy_.names;
+    entries.clear();
+    if (IsPacked()) {
+      entries.reserve(packed_.num_pages);
+      for (uint32_t r = 0; r < packed_.num_pages; ++r) {
+        const char *record = packed_.records + (uint64_t)r * packed_.record_size;
+        uint64_t name_offset = Load<uint64_t>(record + 32);
+        uint32_t name_length = Load<uint32_t>(record + 40);
+        if (name_offset > packed_.names_length
+          || name_length > packed_.names_length - name_offset) {
+          continue;
+        }
+        entries.push_back({std::string_view(packed_.names + name_offset, name_length),
+          Load<uint32_t>(record), Load<uint32_t>(record + 44)});
+      }
+    } else {
+      entries.reserve(page_order_.size());
+      for (uint32_t i = 0; i < page_order_.size(); ++i) {
+        auto iter = page_table_.find(page_order_[i]);
+        if (iter != page_table_.end()) {
+          entries.push_back({iter->second.name, iter->first, i});
+        }
+      }
+    }
+    // ties are broken by archive order so lookups find the first page
+    std::sort(entries.begin(), entries.end(),
+      [](const LazyState::NameEntry &a, const LazyState::NameEntry &b) {
+        int cmp = a.name.compare(b.name);
+        return cmp < 0 || (cmp == 0 && a.order < b.order);
+      });
+    lazy_.names_valid.store(true, std::memory_order_release);
+  }
+  return lazy_.names;
+}
+
+void PagedFileHeader::LazyState::Invalidate() {
+  // modifications are not concurrent with lookups, skip the lock when idle
+  if (!names_valid.load(std::memory_order_acquire)
+    && !order_valid.load(std::memory_order_acquire) && descs.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  names_valid.store(false, std::memory_order_release);
+  order_valid.store(false, std::memory_order_release);
+  std::vector<NameEntry>().swap(names);
+  std::vector<uint32_t>().swap(order);
+  descs.clear();
+}
 
 bool PagedFileHeader::NewMetaPage(uint32_t idx, uint16_t format, const std::string &data) {
+  Materialize();
   auto iter = page_table_.find(idx);
   if (iter != page_table_.end()) {
     return false;
   }
 
+  lazy_.Invalidate();
   page_table_[idx] = {format, 0, 0, 0, data};
   page_order_.push_back(idx);
   return true;
@@ -243,6 +1327,7 @@ bool PagedFileHeader::IsCompressed(uint16_t format) {
 }
 
 void PagedFileHeader::PrintPageTable() {
+  Materialize();
   for (const auto &kvp : page_table_) {
     std::cout << kvp.first << ": " << kvp.second.start << "(" << kvp.second.length << ")\n";
   }
@@ -252,15 +1337,49 @@ void PagedFileHeader::PrintPageTable() {
 
 ///////////////////////////////////////////////
 PagedFile::PagedFile() :
+  header_(std::make_shared<PagedFileHeader>()),
   is_open_(false),
   editing_page_(-1),
-  old_tail_(0) {
+  old_tail_(0),
+  fd_(-1),
+  page_checksum_(0),
+  verify_checksums_(false),
+  journal_appends_(false),
+  journaling_(false),
+  batch_(false),
+  recover_(false),
+  coalesce_gap_(0),
+  dedup_(false),
+  dedup_indexed_(false),
+  alignment_(1),
+  cache_capacity_(0),
+  decode_threads_(1),
+  stats_(std::make_shared<IOStats>()),
+  cctx_(nullptr),
+  stream_format_(kPlain),
+  stream_length_(0),
+  chunk_indexed_(false),
+  next_chunk_idx_(kMaxChunkIndex),
+  content_checksum_(0),
+  content_checksum_known_(false),
+  stream_dedup_(false),
+  dedup_staging_(false),
+  direct_io_(false),
+  direct_fd_(-1),
+  direct_page_(false),
+  direct_pos_(0),
+  direct_fill_(0),
+  direct_staging_(nullptr),
+  map_pos_(0) {
 }
 
 PagedFile::~PagedFile() {
   if (is_open_) {
     Close(false);  // close without saving
   }
+  if (cctx_ != nullptr) {
+    LZ4F_freeCompressionContext(cctx_);
+  }
 }
 
 bool PagedFile::Open(const char *fn, int32_t mode) {
@@ -269,8 +1388,61 @@ bool PagedFile::Open(const char *fn, int32_t mode) {
     return false;
   }
 
+  // start from a fresh page table, readers of a previous session keep theirs
   mode_ = mode;
-  if (mode == kReadOnly) {
+  journaling_ = journal_appends_ && mode == kReadWrite;
+  batch_ = false;
+  dedup_index_.clear();
+  stored_index_.clear();
+  dedup_indexed_ = false;
+  chunk_index_.clear();
+  chunk_indexed_ = false;
+  next_chunk_idx_ = kMaxChunkIndex;
+  stream_format_ = kPlain;
+  dedup_staging_ = false;
+  direct_page_ = false;
+  dead_ranges_.clear();
+  header_ = std::make_shared<PagedFileHeader>();
+  auto ctx = std::make_shared<ReadContext>();
+  ctx->header = header_;
+  ctx->verify = verify_checksums_;
+  ctx->coalesce_gap = coalesce_gap_;
+  ctx->cache.SetCapacity(cache_capacity_);
+  if (decode_threads_ != 1) {
+    ctx->pool = std::make_shared<ThreadPool>(decode_threads_);
+  }
+  ctx->stats = stats_;
+
+  auto timed_parse = [&](auto &&parse) {
+    IOStats::Timer timer(stats_.get(), IOStats::kHeaderParseNanos);
+    stats_->Add(IOStats::kHeaderParses);
+    return parse();
+  };
+
+  if (mode == kReadOnlyMapped) {
+    auto map = std::make_shared<MappedFile>();
+    if (!map->Open(fn)) {
+      return false;
+    }
+
+    // parse page table directly from the mapping
+    uint64_t tail_pos = 0;
+    if (!timed_parse([&]() { return header_->ParseFromMapping(map, tail_pos, recover_); })) {
+      return false;
+    }
+    tail_pos_ = tail_pos;
+
+    map_ = std::move(map);
+    map_pos_ = 0;
+    ctx->map = map_;
+    ctx->file.Open(fn);  // for in-kernel copies only, ExtractPageTo can do without
+    ctx_ = std::move(ctx);
+    editing_page_ = -1;
+    old_tail_ = tail_pos_;
+    filename_ = fn;
+    is_open_ = true;
+    return true;
+  } else if (mode == kReadOnly) {
     fs_.open(fn, std::ios::binary | std::ios::in);
   } else if (mode == kCreate) {
     fs_.open(fn, std::ios::binary | std::ios::out | std::ios::trunc);
@@ -278,20 +1450,74 @@ bool PagedFile::Open(const char *fn, int32_t mode) {
     fs_.open(fn, std::ios::binary | std::ios::in | std::ios::out);
   }
 
+  // syncs, truncation and hole punching go through a descriptor of the file the
+  // stream has open, so they never hit a file renamed into its place later
+  if (fs_.good() && Writable()) {
+    fd_ = OpenDescriptor(fn);
+    if (fd_ < 0) {
+      fs_.close();
+    }
+  }
+
   if (fs_.good()) {
     is_open_ = true;
     if (mode == kReadOnly || mode == kReadWrite) {
-      if (!header_.ParseFromStream(fs_, tail_pos_)) {
+      if (!timed_parse([&]() { return header_->ParseFromStream(fs_, tail_pos_, recover_); })) {
         fs_.close();
+        CloseDescriptor(fd_);
         is_open_ = false;
         return false;
       }
+      if (mode == kReadWrite) {
+        header_->Materialize();
+
+        // the tail of a commit that did not finish is only dropped on request
+        fs_.seekg(0, std::ios::end);
+        if ((uint64_t)fs_.tellg() > header_->file_end_
+          && (!recover_ || !TruncateFile(fd_, header_->file_end_))) {
+          fs_.close();
+          CloseDescriptor(fd_);
+          is_open_ = false;
+          return false;
+        }
+      }
+      if (journaling_) {
+        // keep the current table, new pages go after it
+        tail_pos_ = header_->file_end_;
+      }
       editing_page_ = -1;
     } else if (mode == kCreate) {
       ResetForWriting();
+      if (alignment_ > 1) {
+        header_->alignment_ = alignment_;
+        header_->version_ = PagedFileHeader::kVersion2;
+      }
     }
     old_tail_ = tail_pos_;  // record original length
 
+    // positional reads go through a separate descriptor
+    if (!ctx->file.Open(fn, direct_io_)) {
+      fs_.close();
+      CloseDescriptor(fd_);
+      is_open_ = false;
+      return false;
+    }
+    ctx_ = std::move(ctx);
+
+    // so does page data written with direct I/O
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+    if (direct_io_ && Writable()) {
+#if defined(O_DIRECT)
+      direct_fd_ = open(fn, O_WRONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+      direct_fd_ = open(fn, O_WRONLY);
+      if (direct_fd_ >= 0 && fcntl(direct_fd_, F_NOCACHE, 1) != 0) {
+        CloseDirect();
+      }
+#endif
+    }
+#endif
+
     filename_ = fn;
     return true;
   }
@@ -302,8 +1528,34 @@ void PagedFile::Close(bool save_update) {
   if (!is_open_)
     return;
 
+  ctx_.reset();
+
+  if (mode_ == kReadOnlyMapped) {
+    map_.reset();
+    is_open_ = false;
+    return;
+  }
+
   if (!save_update || mode_ == kReadOnly) {
     fs_.close();
+    CloseDirect();
+    dead_ranges_.clear();  // the removals are not saved
+    if (batch_ && tail_pos_ > old_tail_) {
+      TruncateFile(fd_, old_tail_);  // drop the uncommitted pages
+    } else if (journaling_ && mode_ == kReadWrite
+      && (uint64_t)tail_pos_ > header_->file_end_) {
+      TruncateFile(fd_, header_->file_end_);  // pages after the table it keeps
+    }
+    CloseDescriptor(fd_);
+    is_open_ = false;
+    return;
+  }
+
+  if (batch_) {
+    Commit();
+    fs_.close();
+    CloseDirect();
+    CloseDescriptor(fd_);
     is_open_ = false;
     return;
   }
@@ -311,355 +1563,2533 @@ void PagedFile::Close(bool save_update) {
   if (editing_page_ >= 0) {
     EndNewPage();
   }
-
-  header_.WriteToFile(tail_pos_, fs_);
+  CloseDirect();
+
+  if (journaling_ && header_->journal_base_ && !header_->journal_rewrite_
+    && header_->journal_depth_ < PagedFileHeader::kMaxJournalDepth) {
+    // only additions and tombstones, the table on disk stays valid
+    if (header_->journal_removed_.empty()
+      && header_->journal_base_pages_ == header_->page_order_.size()) {
+      fs_.close();
+      CloseDescriptor(fd_);
+      dead_ranges_.clear();  // only pages of this session, no table refers to them
+      is_open_ = false;
+      return;
+    }
+    header_->WriteDelta(tail_pos_, fs_);
+  } else {
+    header_->WriteToFile(tail_pos_, fs_);
+  }
   auto file_length = fs_.tellp();
+  stats_->CountWrite(tail_pos_, file_length - tail_pos_);
+  if (!dead_ranges_.empty()) {
+    // the table on disk must stop referring to tombstoned data before it is zeroed
+    fs_.flush();
+    if (fs_.good() && SyncFile(fd_)) {
+      PunchDeadRanges((uint64_t)tail_pos_);
+    }
+    dead_ranges_.clear();
+  }
+  // the table may end before data that was removed or dropped as a duplicate
+  fs_.seekp(0, std::ios::end);
+  auto physical_length = fs_.tellp();
   fs_.close();
 
   // truncate file if necessary
-  if (tail_pos_ < old_tail_) {
-    TruncateFile(filename_.c_str(), file_length);
+  if (file_length < physical_length) {
+    TruncateFile(fd_, file_length);
   }
+  CloseDescriptor(fd_);
 
   is_open_ = false;
   return;
 }
 
 void PagedFile::ResetForWriting() {
-  header_.Clear();
+  header_->Clear();
   fs_.seekp(0);
   static const uint32_t magic_num = PagedFile::kMagicNumber;
   fs_.write((char *)&magic_num, sizeof(uint32_t));
   tail_pos_ = fs_.tellp();
+  header_->data_end_ = (uint64_t)tail_pos_;
+  header_->file_end_ = (uint64_t)tail_pos_;
   editing_page_ = -1;
 }
 
+bool PagedFile::Writable() const {
+  return mode_ == kCreate || mode_ == kReadWrite;
+}
 
-bool PagedFile::GoToPage(uint32_t page) {
-  if (!is_open_)
-    return false;
+void PagedFile::WritePageData(const char *data, size_t length) {
+  page_checksum_ = Crc32c(page_checksum_, data, length);
 
-  auto desc = header_.Desc(page);
-  if (desc != nullptr) {
-    // page does not contain data
-    if ((desc->format & 0xff) != 0)
-      return false;
+  // held back while the page may still turn out to be a duplicate
+  if (dedup_staging_) {
+    if (dedup_stage_.size() + length <= kDedupStageSize) {
+      dedup_stage_.insert(dedup_stage_.end(), data, data + length);
+      return;
+    }
+    ReleaseDedupStage();
+  }
 
-    fs_.seekg(desc->start, std::ios::beg);
-    fs_.seekp(desc->start, std::ios::beg);
-    return true;
+  // direct writes are staged until whole blocks can go out
+  while (direct_page_ && length > 0) {
+    size_t bytes = std::min<size_t>(length, kDirectStagingSize - direct_fill_);
+    memcpy(direct_staging_ + direct_fill_, data, bytes);
+    direct_fill_ += bytes;
+    data += bytes;
+    length -= bytes;
+    if (direct_fill_ == kDirectStagingSize) {
+      FlushDirect(false);
+    }
+  }
+  if (!direct_page_) {
+    fs_.write(data, length);
   }
-  return false;
 }
 
-void PagedFile::Read(void *buffer, size_t length) {
-  if (!is_open_ || editing_page_ >= 0)
+void PagedFile::ReleaseDedupStage() {
+  dedup_staging_ = false;
+  if (dedup_stage_.empty()) {
     return;
-
-  fs_.read((char*)buffer, length);
+  }
+  uint32_t checksum = page_checksum_;
+  WritePageData(dedup_stage_.data(), dedup_stage_.size());
+  page_checksum_ = checksum;  // covered the data when it was staged
+  dedup_stage_.clear();
 }
 
-void PagedFile::Write(const void *buffer, size_t length) {
-  if (!is_open_ || editing_page_ < 0)
-    return;
+void PagedFile::FlushDirect(bool end_page) {
+  const size_t block = RandomAccessFile::kDirectBlockSize;
+  size_t bytes = direct_fill_ / block * block;
+  if (end_page && bytes < direct_fill_) {
+    // the zeros end before the next page, which starts at the next aligned offset
+    bytes += block;
+    memset(direct_staging_ + direct_fill_, 0, bytes - direct_fill_);
+  }
 
-  fs_.write((char*)buffer, length);
-}
+  size_t written = 0;
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+  while (written < bytes) {
+    ssize_t ret = pwrite(direct_fd_, direct_staging_ + written, bytes - written,
+      (off_t)(direct_pos_ + written));
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      break;
+    }
+    written += (size_t)ret;
+  }
+#endif
+  if (written < bytes) {
+    // refused by the file system, the page continues through the stream
+    fs_.seekp(direct_pos_);
+    fs_.write(direct_staging_, direct_fill_);
+    direct_page_ = false;
+    return;
+  }
 
-bool PagedFile::NewPage(uint32_t idx) {
-  return NewPage(idx, "");
+  if (end_page) {
+    direct_pos_ += direct_fill_;
+    direct_fill_ = 0;
+    fs_.seekp(direct_pos_);
+    return;
+  }
+  memmove(direct_staging_, direct_staging_ + bytes, direct_fill_ - bytes);
+  direct_pos_ += bytes;
+  direct_fill_ -= bytes;
 }
 
-bool PagedFile::NewPage(uint32_t idx, const std::string &name) {
+void PagedFile::CloseDirect() {
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+  if (direct_fd_ >= 0) {
+    close(direct_fd_);
+  }
+#endif
+  direct_fd_ = -1;
+  direct_page_ = false;
+}
+
+void PagedFile::WriteChunk(const char *data, size_t length) {
+  size_t bytes = 0;
+  {
+    IOStats::Timer timer(stats_.get(), IOStats::kCompressNanos);
+    bytes = CompressChunk(data, length, comp_buffer_.data());
+  }
+  WritePageData(comp_buffer_.data(), bytes);
+  chunk_offsets_.push_back(chunk_offsets_.back() + bytes);
+}
+
+void PagedFile::WriteChunkTable(const std::vector<uint64_t> &offsets,
+  uint64_t uncompressed_length, uint32_t chunk_size) {
+
+  uint32_t num_chunks = (uint32_t)(offsets.size() - 1);
+  WritePageData((const char *)offsets.data(), offsets.size() * sizeof(uint64_t));
+  WritePageData((const char *)&uncompressed_length, sizeof(uint64_t));
+  WritePageData((const char *)&chunk_size, sizeof(uint32_t));
+  WritePageData((const char *)&num_chunks, sizeof(uint32_t));
+}
+
+void PagedFile::SetDecodeThreads(unsigned threads) {
+  decode_threads_ = threads;
+}
+
+void PagedFile::SetVerifyChecksums(bool verify) {
+  verify_checksums_ = verify;
+}
+
+void PagedFile::SetDeduplicate(bool dedup) {
+  dedup_ = dedup;
+}
+
+bool PagedFile::SetAlignment(uint32_t alignment) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > kMaxAlignment) {
+    return false;
+  }
+  alignment_ = alignment;
+  return true;
+}
+
+void PagedFile::SetDirectIO(bool direct) {
+  direct_io_ = direct;
+}
+
+void PagedFile::SetCoalesceGap(uint64_t gap) {
+  coalesce_gap_ = gap;
+}
+
+void PagedFile::SetJournalAppends(bool journal) {
+  journal_appends_ = journal;
+}
+
+void PagedFile::SetRecover(bool recover) {
+  recover_ = recover;
+}
+
+bool PagedFile::BeginBatch() {
+  if (!is_open_ || !Writable() || batch_ || editing_page_ >= 0) {
+    return false;
+  }
+
+  auto file_end = (std::fstream::pos_type)header_->file_end_;
+  if (old_tail_ < file_end) {
+    // pages already written over the table can not be rolled back
+    if (tail_pos_ != old_tail_) {
+      return false;
+    }
+    tail_pos_ = file_end;
+  }
+  old_tail_ = tail_pos_;
+  journaling_ = true;
+  batch_ = true;
+
+  // a crash is only recovered from as of a footer, so an archive that does not end
+  // in a delta, a version 1 table or a new one in particular, is committed as it is
+  // before the first page goes after it
+  if (header_->journal_depth_ == 0) {
+    if (!Commit()) {
+      return false;
+    }
+    batch_ = true;
+  }
+  return true;
+}
+
+bool PagedFile::Commit() {
+  if (!is_open_ || !batch_) {
+    return false;
+  }
+
+  if (editing_page_ >= 0) {
+    EndNewPage();
+  }
+  batch_ = false;
+
+  bool can_delta = header_->journal_base_ && !header_->journal_rewrite_
+    && header_->journal_depth_ < PagedFileHeader::kMaxJournalDepth;
+  if (can_delta && header_->journal_depth_ != 0 && header_->journal_removed_.empty()
+    && header_->journal_base_pages_ == header_->page_order_.size()) {
+    return true;  // nothing to commit
+  }
+
+  // the footer is written only after everything it refers to is on disk
+  auto sync = [this]() {
+    fs_.flush();
+    return fs_.good() && SyncFile(fd_);
+  };
+
+  bool ok = true;
+  if (!can_delta) {
+    // a full table followed by an empty delta, so the commit ends with a footer
+    ok = header_->WriteToFile(tail_pos_, fs_);
+  }
+  auto delta_pos = fs_.tellp();
+  ok = ok && header_->WriteDelta(can_delta ? tail_pos_ : delta_pos, fs_, sync) && sync();
+  stats_->CountWrite(tail_pos_, fs_.tellp() - tail_pos_);
+  if (!ok) {
+    return false;
+  }
+  PunchDeadRanges((uint64_t)tail_pos_);
+
+  // the next batch goes after the committed table, anything beyond it was dropped
+  tail_pos_ = fs_.tellp();
+  old_tail_ = tail_pos_;
+  fs_.seekp(0, std::ios::end);
+  if (fs_.tellp() > tail_pos_) {
+    TruncateFile(fd_, tail_pos_);
+  }
+  return true;
+}
+
+
+bool PagedFile::GoToPage(uint32_t page) {
   if (!is_open_)
     return false;
 
+  PagedFileHeader::PageDesc desc;
+  if (header_->Locate(page, desc)) {
+    // page does not contain data
+    if ((desc.format & 0xff) != 0)
+      return false;
+
+    if (map_) {
+      map_pos_ = desc.start;
+      return true;
+    }
+
+    fs_.seekg(desc.start, std::ios::beg);
+    fs_.seekp(desc.start, std::ios::beg);
+    return true;
+  }
+  return false;
+}
+
+void PagedFile::Read(void *buffer, size_t length) {
+  if (!is_open_ || editing_page_ >= 0)
+    return;
+
+  if (map_) {
+    uint64_t available = map_->Size() - std::min(map_pos_, map_->Size());
+    length = (size_t)std::min((uint64_t)length, available);
+    memcpy(buffer, map_->Data() + map_pos_, length);
+    stats_->CountRead(map_pos_, length);
+    map_pos_ += length;
+    return;
+  }
+
+  if (stats_->Enabled()) {
+    stats_->CountRead((uint64_t)fs_.tellg(), length);
+  }
+  fs_.read((char*)buffer, length);
+}
+
+void PagedFile::Write(const void *buffer, size_t length) {
+  if (!is_open_ || editing_page_ < 0)
+    return;
+
+  if (stream_dedup_ && stream_format_ != kPlain) {
+    // plain content is covered by the page checksum already
+    content_checksum_ = Crc32c(content_checksum_, (const char *)buffer, length);
+  }
+  if (stream_format_ == kPlain) {
+    WritePageData((const char *)buffer, length);
+    return;
+  }
+
+  const char *src = (const char *)buffer;
+  if (stream_format_ == kLZ4Chunked) {
+    stream_length_ += length;
+    while (length > 0) {
+      if (chunk_input_.empty() && length >= kCompressedChunkSize) {
+        // whole chunks are compressed straight from the caller's buffer
+        WriteChunk(src, kCompressedChunkSize);
+        src += kCompressedChunkSize;
+        length -= kCompressedChunkSize;
+        continue;
+      }
+      size_t bytes = std::min<size_t>(length, kCompressedChunkSize - chunk_input_.size());
+      chunk_input_.insert(chunk_input_.end(), src, src + bytes);
+      src += bytes;
+      length -= bytes;
+      if (chunk_input_.size() == kCompressedChunkSize) {
+        WriteChunk(chunk_input_.data(), chunk_input_.size());
+        chunk_input_.clear();
+      }
+    }
+    return;
+  }
+
+  if (stream_format_ == kChunkList) {
+    stream_length_ += length;
+    while (length > 0) {
+      bool boundary = false;
+      size_t bytes = chunker_.Next(src, length, boundary);
+      if (boundary && chunk_input_.empty()) {
+        // whole chunks are stored straight from the caller's buffer
+        StoreChunk(src, bytes);
+      } else {
+        chunk_input_.insert(chunk_input_.end(), src, src + bytes);
+        if (boundary) {
+          StoreChunk(chunk_input_.data(), chunk_input_.size());
+          chunk_input_.clear();
+        }
+      }
+      src += bytes;
+      length -= bytes;
+    }
+    return;
+  }
+
+  // feed the frame compressor in bounded pieces so comp_buffer_ stays small
+  while (length > 0) {
+    size_t chunk = std::min<size_t>(length, kStreamChunkSize);
+    size_t bytes = 0;
+    {
+      IOStats::Timer timer(stats_.get(), IOStats::kCompressNanos);
+      bytes = LZ4F_compressUpdate(cctx_, comp_buffer_.data(), comp_buffer_.size(),
+        src, chunk, nullptr);
+    }
+    if (LZ4F_isError(bytes)) {
+      return;
+    }
+    WritePageData(comp_buffer_.data(), bytes);
+
+    src += chunk;
+    length -= chunk;
+    stream_length_ += chunk;
+  }
+}
+
+bool PagedFile::NewPage(uint32_t idx) {
+  return NewPage(idx, "");
+}
+
+bool PagedFile::NewPage(uint32_t idx, const std::string &name) {
+  return NewPage(idx, name, kPlain);
+}
+
+bool PagedFile::NewPage(uint32_t idx, const std::string &name, uint16_t format) {
+  if (!is_open_ || !Writable() || editing_page_ >= 0)
+    return false;
+
   // check if page with the same idx already exists
-  if (header_.Exists(idx)) {
+  if (header_->Exists(idx)) {
+    return false;
+  }
+
+  // only frames and chunked pages can be compressed incrementally
+  format &= 0xff00;
+  if (format != kPlain && format != kLZ4Frame && format != kLZ4Chunked
+    && format != kChunkList) {
     return false;
   }
 
-  fs_.seekp(tail_pos_);
-  uint64_t start = fs_.tellp();
+  // chunk lists go after the chunks of their page, everything else is aligned
+  uint64_t start = (uint64_t)tail_pos_;
+  if (format != kChunkList) {
+    start = AlignUp(start, header_->alignment_);
+  }
+  fs_.seekp(start);
+  page_checksum_ = 0;
+  // held back until EndNewPage has looked for a duplicate
+  dedup_staging_ = dedup_ && format != kChunkList;
+  dedup_stage_.clear();
+
+  // pages starting at a block boundary can bypass the page cache
+  direct_page_ = direct_fd_ >= 0 && format != kChunkList
+    && start % RandomAccessFile::kDirectBlockSize == 0;
+  if (direct_page_) {
+    if (direct_staging_ == nullptr) {
+      const size_t block = RandomAccessFile::kDirectBlockSize;
+      direct_buffer_.resize(kDirectStagingSize + block);
+      uintptr_t misalignment = (uintptr_t)direct_buffer_.data() % block;
+      direct_staging_ = direct_buffer_.data() + (misalignment != 0 ? block - misalignment : 0);
+    }
+    fs_.flush();  // buffered data before the page lands first
+    direct_pos_ = start;
+    direct_fill_ = 0;
+  }
+
+  if (format == kLZ4Frame) {
+    if (cctx_ == nullptr
+      && LZ4F_isError(LZ4F_createCompressionContext(&cctx_, LZ4F_VERSION))) {
+      cctx_ = nullptr;
+      return false;
+    }
+
+    LZ4F_preferences_t pref = LZ4F_INIT_PREFERENCES;
+    size_t bound = std::max<size_t>(
+      LZ4F_compressBound(kStreamChunkSize, &pref), LZ4F_HEADER_SIZE_MAX);
+    if (comp_buffer_.size() < bound) {
+      comp_buffer_.resize(bound);
+      stats_->Add(IOStats::kBufferGrows);
+    }
+
+    size_t bytes = LZ4F_compressBegin(cctx_, comp_buffer_.data(), comp_buffer_.size(), &pref);
+    if (LZ4F_isError(bytes)) {
+      return false;
+    }
+    WritePageData(comp_buffer_.data(), bytes);
+  } else if (format == kLZ4Chunked) {
+    size_t bound = (size_t)LZ4_compressBound(kCompressedChunkSize);
+    if (comp_buffer_.size() < bound) {
+      comp_buffer_.resize(bound);
+      stats_->Add(IOStats::kBufferGrows);
+    }
+    chunk_input_.clear();
+    chunk_input_.reserve(kCompressedChunkSize);
+    chunk_offsets_.assign(1, 0);
+  } else if (format == kChunkList) {
+    size_t bound = (size_t)LZ4_compressBound(ContentChunker::kMaxSize);
+    if (comp_buffer_.size() < bound) {
+      comp_buffer_.resize(bound);
+      stats_->Add(IOStats::kBufferGrows);
+    }
+    if (!chunk_indexed_) {
+      IndexChunks();
+    }
+    chunker_.Reset();
+    chunk_input_.clear();
+    chunk_input_.reserve(ContentChunker::kMaxSize);
+    chunk_refs_.clear();
+  }
+  stream_format_ = format;
+  stream_length_ = 0;
+  content_checksum_ = 0;
+  // chunk lists share their chunks already, whole pages are not compared
+  stream_dedup_ = dedup_ && format != kChunkList;
+  content_checksum_known_ = stream_dedup_;
+
+  header_->AddPage(idx, {(uint16_t)(kFile | format), start, 0, 0, name});
+  editing_page_ = (int32_t)idx;
+  return true;
+}
+
+
+void PagedFile::EndNewPage() {
+  if (!is_open_ || editing_page_ < 0)
+    return;
+
+  auto desc = header_->Desc((uint32_t)editing_page_);
+  if (stream_format_ == kLZ4Frame) {
+    // flush the frame footer and record the total uncompressed size
+    size_t bytes = 0;
+    {
+      IOStats::Timer timer(stats_.get(), IOStats::kCompressNanos);
+      bytes = LZ4F_compressEnd(cctx_, comp_buffer_.data(), comp_buffer_.size(), nullptr);
+    }
+    if (!LZ4F_isError(bytes)) {
+      WritePageData(comp_buffer_.data(), bytes);
+    }
+    desc->uncompressed_length = stream_length_;
+  } else if (stream_format_ == kLZ4Chunked) {
+    // flush the last partial chunk, then the offset table and trailer
+    if (!chunk_input_.empty()) {
+      WriteChunk(chunk_input_.data(), chunk_input_.size());
+      chunk_input_.clear();
+    }
+    WriteChunkTable(chunk_offsets_, stream_length_, kCompressedChunkSize);
+    desc->uncompressed_length = stream_length_;
+  } else if (stream_format_ == kChunkList) {
+    // the last chunk, then the list goes after the chunks stored for the page
+    if (!chunk_input_.empty()) {
+      StoreChunk(chunk_input_.data(), chunk_input_.size());
+      chunk_input_.clear();
+    }
+    desc->start = (uint64_t)fs_.tellp();
+    page_checksum_ = 0;
+    WritePageData((const char *)chunk_refs_.data(), chunk_refs_.size() * sizeof(ChunkRef));
+    desc->uncompressed_length = stream_length_;
+  }
+  stream_format_ = kPlain;
+
+  uint32_t idx = (uint32_t)editing_page_;
+  if (dedup_staging_) {
+    // the whole page is held back, so a duplicate is never written
+    uint64_t length = dedup_stage_.size();
+    uint32_t dup = 0;
+    bool found = false;
+    if (length != 0 && PagedFileHeader::IsCompressed(desc->format)) {
+      found = FindStoredDuplicate(desc->format, dedup_stage_.data(), (size_t)length,
+        page_checksum_, dup);
+    } else if (length != 0) {
+      found = FindDuplicate(length, page_checksum_, dedup_stage_.data(), dup);
+    }
+    if (found) {
+      dedup_staging_ = false;
+      dedup_stage_.clear();
+      direct_page_ = false;
+      const auto &shared = *header_->Desc(dup);
+      desc->format = shared.format;
+      desc->start = shared.start;
+      desc->length = shared.length;
+      desc->uncompressed_length = shared.uncompressed_length;
+      desc->checksum = shared.checksum;
+      desc->has_checksum = shared.has_checksum;
+      IndexPage(idx, content_checksum_known_, content_checksum_);
+      stream_dedup_ = false;
+      editing_page_ = -1;
+      return;
+    }
+    ReleaseDedupStage();
+  }
+  if (direct_page_) {
+    FlushDirect(true);
+    direct_page_ = false;
+  }
+
+  tail_pos_ = fs_.tellp();
+  header_->data_end_ = (uint64_t)tail_pos_;
+  uint64_t cur_pos = (uint64_t)tail_pos_;
+  uint64_t offset = cur_pos - desc->start;
+
+  desc->length = offset;
+  desc->checksum = page_checksum_;
+  desc->has_checksum = true;
+
+  // pages are written contiguously, so they are counted as a whole
+  stats_->CountWrite(desc->start, desc->length);
+  stats_->Add(IOStats::kPagesWritten);
+  stats_->Add(IOStats::kBytesWrittenUncompressed,
+    PagedFileHeader::IsCompressed(desc->format) ? desc->uncompressed_length : desc->length);
+
+  // make the page visible to positional readers
+  fs_.flush();
+
+  if (dedup_ && !(desc->format & kChunkList)) {
+    IndexPage(idx, content_checksum_known_, content_checksum_);
+  }
+  stream_dedup_ = false;
+  editing_page_ = -1;
+}
+
+uint64_t PagedFile::ReadPage(uint32_t idx, char *buffer, size_t buffer_size) const {
+  if (!is_open_ || editing_page_ >= 0)
+    return 0;
+
+  return ReadPageFrom(*ctx_, idx, buffer, buffer_size);
+}
+
+uint64_t PagedFile::ReadPageRange(uint32_t idx, uint64_t offset, char *buffer,
+  size_t length) const {
+  if (!is_open_ || editing_page_ >= 0)
+    return 0;
+
+  return ReadPageRangeFrom(*ctx_, idx, offset, buffer, length);
+}
+
+PagedFile::PageView PagedFile::ViewPage(uint32_t idx) const {
+  if (!is_open_)
+    return {};
+
+  return ViewPageFrom(*ctx_, idx);
+}
+
+uint64_t PagedFile::ReadPageFrom(const ReadContext &ctx, uint32_t idx,
+  char *buffer, size_t buffer_size) {
+
+  PagedFileHeader::PageDesc desc;
+  if (!ctx.header->Locate(idx, desc)) {
+    return 0;
+  }
+
+  // compressed pages only need room for their content, which a frame may not undercut
+  uint64_t required = PagedFileHeader::IsCompressed(desc.format) ?
+    desc.uncompressed_length : desc.length;
+  if (buffer_size < required) {
+    return 0;
+  }
+
+  uint64_t bytes = 0;
+  if (PagedFileHeader::IsCompressed(desc.format) && ctx.cache.Enabled()) {
+    auto page = LoadCompressedPage(ctx, idx, desc);
+    if (page.data == nullptr || page.size > buffer_size) {
+      return 0;
+    }
+    memcpy(buffer, page.data.get(), page.size);
+    bytes = page.size;
+  } else {
+    bytes = ReadStoredPage(ctx, desc, buffer, buffer_size);
+  }
+  if (bytes != 0) {
+    ctx.stats->CountPageRead(bytes);
+  }
+  return bytes;
+}
+
+uint64_t PagedFile::ReadStoredPage(const ReadContext &ctx,
+  const PagedFileHeader::PageDesc &page, char *buffer, size_t buffer_size) {
+
+  const auto desc = &page;
+
+  if (desc->format & kLZ4Chunked) {
+    // decoded chunk by chunk without staging the compressed page, in parallel
+    // on the decode pool when one is set up
+    if (buffer_size < desc->uncompressed_length
+      || (ctx.verify && desc->has_checksum && !ChecksumMatches(ctx, *desc))) {
+      return 0;
+    }
+    return ReadChunkedRange(ctx, *desc, 0, buffer, (size_t)desc->uncompressed_length);
+  }
+  if (desc->format & kChunkList) {
+    if (buffer_size < desc->uncompressed_length) {
+      return 0;
+    }
+    return ReadChunkListRange(ctx, *desc, 0, buffer, (size_t)desc->uncompressed_length);
+  }
+
+  // stored bytes are checked before anything is decoded from them
+  auto corrupted = [&](const char *stored) {
+    return ctx.verify && desc->has_checksum
+      && Crc32c(0, stored, desc->length) != desc->checksum;
+  };
+
+  if (ctx.map) {
+    // read straight from the mapping
+    if (desc->start + desc->length > ctx.map->Size()) {
+      return 0;
+    }
+    const char *src = ctx.map->Data() + desc->start;
+    ctx.stats->CountRead(desc->start, desc->length);
+    if (corrupted(src)) {
+      return 0;
+    }
+    if (PagedFileHeader::IsCompressed(desc->format)) {
+      IOStats::Timer timer(ctx.stats.get(), IOStats::kDecompressNanos);
+      return DecompressPage(desc->format, src, desc->length, buffer, buffer_size);
+    }
+    memcpy(buffer, src, desc->length);
+    return desc->length;
+  }
+
+  if (PagedFileHeader::IsCompressed(desc->format)) {
+    // per-thread work buffer keeps concurrent readers independent
+    thread_local std::vector<char> comp_buffer;
+    if (comp_buffer.size() < desc->length) {
+      comp_buffer.resize(desc->length);
+      ctx.stats->Add(IOStats::kBufferGrows);
+    }
+    ctx.stats->CountRead(desc->start, desc->length);
+    if (ctx.file.ReadAt(desc->start, comp_buffer.data(), desc->length) != desc->length
+      || corrupted(comp_buffer.data())) {
+      return 0;
+    }
+    IOStats::Timer timer(ctx.stats.get(), IOStats::kDecompressNanos);
+    return DecompressPage(desc->format, comp_buffer.data(), desc->length, buffer, buffer_size);
+  } else {
+    ctx.stats->CountRead(desc->start, desc->length);
+    if (ctx.file.ReadAt(desc->start, buffer, desc->length) != desc->length
+      || corrupted(buffer)) {
+      return 0;
+    }
+    return desc->length;
+  }
+}
+
+uint64_t PagedFile::ReadPageRangeFrom(const ReadContext &ctx, uint32_t idx,
+  uint64_t offset, char *buffer, size_t length) {
+
+  PagedFileHeader::PageDesc desc;
+  if (!ctx.header->Locate(idx, desc)) {
+    return 0;
+  }
+
+  bool compressed = PagedFileHeader::IsCompressed(desc.format);
+  uint64_t content_length = compressed ? desc.uncompressed_length : desc.length;
+  if (offset >= content_length) {
+    return 0;
+  }
+  length = (size_t)std::min<uint64_t>(length, content_length - offset);
+
+  uint64_t bytes = 0;
+  if (!compressed) {
+    if (ctx.map) {
+      if (desc.start + desc.length > ctx.map->Size()) {
+        return 0;
+      }
+      memcpy(buffer, ctx.map->Data() + desc.start + offset, length);
+      bytes = length;
+    } else {
+      bytes = ctx.file.ReadAt(desc.start + offset, buffer, length);
+    }
+    ctx.stats->CountRead(desc.start + offset, bytes);
+  } else if (desc.format & kLZ4Chunked) {
+    bytes = ReadChunkedRange(ctx, desc, offset, buffer, length);
+  } else if (desc.format & kChunkList) {
+    bytes = ReadChunkListRange(ctx, desc, offset, buffer, length);
+  } else {
+    // blocks and frames can only be decoded as a whole, the page cache softens repeats
+    auto page = LoadCompressedPage(ctx, idx, desc);
+    if (page.data == nullptr || offset >= page.size) {
+      return 0;
+    }
+    bytes = (size_t)std::min<uint64_t>(length, page.size - offset);
+    memcpy(buffer, page.data.get() + offset, bytes);
+  }
+
+  if (bytes != 0) {
+    ctx.stats->CountPageRead(bytes);
+  }
+  return bytes;
+}
+
+uint64_t PagedFile::ReadChunkedRange(const ReadContext &ctx,
+  const PagedFileHeader::PageDesc &desc, uint64_t offset, char *buffer, size_t length) {
+
+  if (length == 0 || (ctx.map && desc.start + desc.length > ctx.map->Size())) {
+    return 0;
+  }
+
+  // page bytes come straight from the mapping, or through per-thread buffers
+  auto fetch = [&](uint64_t pos, size_t bytes, std::vector<char> &scratch) -> const char * {
+    if (pos > desc.length || bytes > desc.length - pos) {
+      return nullptr;
+    }
+    ctx.stats->CountRead(desc.start + pos, bytes);
+    if (ctx.map) {
+      return ctx.map->Data() + desc.start + pos;
+    }
+    if (scratch.size() < bytes) {
+      scratch.resize(bytes);
+    }
+    if (ctx.file.ReadAt(desc.start + pos, scratch.data(), bytes) != bytes) {
+      return nullptr;
+    }
+    return scratch.data();
+  };
+
+  ChunkTrailer trailer;
+  std::vector<char> scratch;
+  const char *src = fetch(desc.length - std::min<uint64_t>(desc.length, kChunkTrailerSize),
+    kChunkTrailerSize, scratch);
+  if (src == nullptr || !ParseChunkTrailer(src, desc.length, trailer)
+    || trailer.uncompressed_length != desc.uncompressed_length) {
+    return 0;
+  }
+
+  uint32_t first = (uint32_t)(offset / trailer.chunk_size);
+  uint32_t last = (uint32_t)((offset + length - 1) / trailer.chunk_size);
+  std::vector<uint64_t> offsets(last - first + 2);
+  src = fetch(trailer.table_offset + (uint64_t)first * sizeof(uint64_t),
+    offsets.size() * sizeof(uint64_t), scratch);
+  if (src == nullptr) {
+    return 0;
+  }
+  memcpy(offsets.data(), src, offsets.size() * sizeof(uint64_t));
+  for (size_t i = 1; i < offsets.size(); ++i) {
+    if (offsets[i] < offsets[i - 1]) {
+      return 0;
+    }
+  }
+  if (offsets.back() > trailer.table_offset) {
+    return 0;
+  }
+
+  // chunks are decoded in batches sharing one fetch, batches are independent
+  static const uint32_t kBatchChunks = 64;
+  uint64_t end = offset + length;
+  auto decode_batch = [&](size_t batch) {
+    thread_local std::vector<char> input;
+    thread_local std::vector<char> chunk;
+
+    uint32_t batch_first = first + (uint32_t)batch * kBatchChunks;
+    uint32_t batch_last = std::min(last, batch_first + kBatchChunks - 1);
+    uint64_t batch_start = offsets[batch_first - first];
+    const char *batch_src = fetch(batch_start,
+      (size_t)(offsets[batch_last - first + 1] - batch_start), input);
+    if (batch_src == nullptr) {
+      return false;
+    }
+
+    IOStats::Timer timer(ctx.stats.get(), IOStats::kDecompressNanos);
+    for (uint32_t i = batch_first; i <= batch_last; ++i) {
+      uint64_t begin = offsets[i - first], stop = offsets[i - first + 1];
+      const char *stored = batch_src + (begin - batch_start);
+      uint64_t chunk_start = (uint64_t)i * trailer.chunk_size;
+      size_t chunk_length = ChunkLength(trailer, i);
+
+      if (chunk_start >= offset && chunk_start + chunk_length <= end) {
+        // whole chunks are decoded in place
+        if (!DecodeChunk(stored, (size_t)(stop - begin), buffer + (chunk_start - offset),
+          chunk_length)) {
+          return false;
+        }
+        continue;
+      }
+
+      if (chunk.size() < chunk_length) {
+        chunk.resize(chunk_length);
+      }
+      if (!DecodeChunk(stored, (size_t)(stop - begin), chunk.data(), chunk_length)) {
+        return false;
+      }
+      uint64_t copy_start = std::max(offset, chunk_start);
+      uint64_t copy_end = std::min(end, chunk_start + chunk_length);
+      memcpy(buffer + (copy_start - offset), chunk.data() + (copy_start - chunk_start),
+        (size_t)(copy_end - copy_start));
+    }
+    return true;
+  };
+
+  size_t num_batches = (last - first) / kBatchChunks + 1;
+  if (ctx.pool && num_batches > 1) {
+    // every batch writes its own part of buffer
+    std::atomic<bool> ok {true};
+    ctx.pool->ParallelFor(num_batches, [&](size_t batch) {
+      if (ok.load(std::memory_order_relaxed) && !decode_batch(batch)) {
+        ok = false;
+      }
+    });
+    return ok ? length : 0;
+  }
+
+  for (size_t batch = 0; batch < num_batches; ++batch) {
+    if (!decode_batch(batch)) {
+      return 0;
+    }
+  }
+  return length;
+}
+
+bool PagedFile::LoadChunkList(const ReadContext &ctx, const PagedFileHeader::PageDesc &desc,
+  std::vector<ChunkRef> &refs) {
+
+  static_assert(sizeof(ChunkRef) == 8, "chunk refs are stored as they are in memory");
+  if (desc.length % sizeof(ChunkRef) != 0) {
+    return false;
+  }
+  refs.resize((size_t)(desc.length / sizeof(ChunkRef)));
+  ctx.stats->CountRead(desc.start, desc.length);
+  if (ctx.map) {
+    if (desc.start + desc.length > ctx.map->Size()) {
+      return false;
+    }
+    memcpy(refs.data(), ctx.map->Data() + desc.start, (size_t)desc.length);
+  } else if (ctx.file.ReadAt(desc.start, refs.data(), (size_t)desc.length) != desc.length) {
+    return false;
+  }
+  return !(ctx.verify && desc.has_checksum
+    && Crc32c(0, refs.data(), (size_t)desc.length) != desc.checksum);
+}
+
+uint64_t PagedFile::ReadChunkListRange(const ReadContext &ctx,
+  const PagedFileHeader::PageDesc &desc, uint64_t offset, char *buffer, size_t length) {
+
+  std::vector<ChunkRef> refs;
+  if (length == 0 || !LoadChunkList(ctx, desc, refs)) {
+    return 0;
+  }
+
+  // content offsets of the chunks follow from their lengths in the table
+  std::vector<PagedFileHeader::PageDesc> chunks(refs.size());
+  std::vector<uint64_t> starts(refs.size() + 1, 0);
+  for (size_t i = 0; i < refs.size(); ++i) {
+    if (!ctx.header->Locate(refs[i].page, chunks[i])) {
+      return 0;
+    }
+    starts[i + 1] = starts[i] + (PagedFileHeader::IsCompressed(chunks[i].format) ?
+      chunks[i].uncompressed_length : chunks[i].length);
+  }
+  if (starts.back() != desc.uncompressed_length) {
+    return 0;
+  }
+
+  uint64_t end = offset + length;
+  size_t first = (size_t)(std::upper_bound(starts.begin(), starts.end(), offset)
+    - starts.begin()) - 1;
+  size_t last = (size_t)(std::lower_bound(starts.begin(), starts.end(), end)
+    - starts.begin()) - 1;
+  auto read_chunk = [&](size_t k) {
+    size_t i = first + k;
+    uint64_t chunk_start = starts[i];
+    size_t chunk_length = (size_t)(starts[i + 1] - chunk_start);
+    if (chunk_start >= offset && chunk_start + chunk_length <= end) {
+      // whole chunks are decoded in place
+      return ReadStoredPage(ctx, chunks[i], buffer + (chunk_start - offset), chunk_length)
+        == chunk_length;
+    }
+
+    thread_local std::vector<char> chunk;
+    if (chunk.size() < chunk_length) {
+      chunk.resize(chunk_length);
+    }
+    if (ReadStoredPage(ctx, chunks[i], chunk.data(), chunk_length) != chunk_length) {
+      return false;
+    }
+    uint64_t copy_start = std::max(offset, chunk_start);
+    uint64_t copy_end = std::min(end, chunk_start + chunk_length);
+    memcpy(buffer + (copy_start - offset), chunk.data() + (copy_start - chunk_start),
+      (size_t)(copy_end - copy_start));
+    return true;
+  };
+
+  size_t count = last - first + 1;
+  if (ctx.pool && count > 1) {
+    // every chunk writes its own part of buffer
+    std::atomic<bool> ok {true};
+    ctx.pool->ParallelFor(count, [&](size_t k) {
+      if (ok.load(std::memory_order_relaxed) && !read_chunk(k)) {
+        ok = false;
+      }
+    });
+    return ok ? length : 0;
+  }
+
+  for (size_t k = 0; k < count; ++k) {
+    if (!read_chunk(k)) {
+      return 0;
+    }
+  }
+  return length;
+}
+
+PagedFile::PageView PagedFile::ViewPageFrom(const ReadContext &ctx, uint32_t idx) {
+  if (!ctx.map)
+    return {};
+
+  PagedFileHeader::PageDesc page;
+  if (!ctx.header->Locate(idx, page)) {
+    return {};
+  }
+  const auto desc = &page;
+  if ((desc->format & 0xff) != kFile
+    || PagedFileHeader::IsCompressed(desc->format)
+    || desc->start + desc->length > ctx.map->Size()) {
+    return {};
+  }
+
+  const char *data = ctx.map->Data() + desc->start;
+  if (ctx.verify && desc->has_checksum && Crc32c(0, data, desc->length) != desc->checksum) {
+    return {};
+  }
+  ctx.stats->CountRead(desc->start, desc->length);
+  ctx.stats->CountPageRead(desc->length);
+  return {data, (size_t)desc->length};
+}
+
+bool PagedFile::ExtractPageTo(uint32_t idx, int fd) const {
+  if (!is_open_ || editing_page_ >= 0)
+    return false;
+
+  return ExtractPageToFrom(ctx_, idx, fd);
+}
+
+bool PagedFile::ExtractPageToFrom(const std::shared_ptr<const ReadContext> &ctx, uint32_t idx,
+  int fd) {
+  PagedFileHeader::PageDesc desc;
+  if (fd < 0 || !ctx->header->Locate(idx, desc) || (desc.format & 0xff) != kFile) {
+    return false;
+  }
+  uint64_t file_size = ctx->map ? ctx->map->Size() : ctx->file.Size();
+  if (desc.start > file_size || desc.length > file_size - desc.start
+    || (ctx->verify && desc.has_checksum && !ChecksumMatches(*ctx, desc))) {
+    return false;
+  }
+
+  bool compressed = PagedFileHeader::IsCompressed(desc.format);
+  uint64_t content_length = compressed ? desc.uncompressed_length : desc.length;
+  uint64_t done = 0;
+  if (!compressed) {
+    // plain data does not have to pass through user space
+    if (ctx->file.IsOpen() && !ctx->file.DirectReads()) {
+      done = ctx->file.CopyTo(desc.start, desc.length, fd);
+      ctx->stats->CountRead(desc.start, done);
+    }
+    if (ctx->map && done < desc.length) {
+      ctx->stats->CountRead(desc.start + done, desc.length - done);
+      if (!WriteFully(fd, ctx->map->Data() + desc.start + done, (size_t)(desc.length - done))) {
+        return false;
+      }
+      done = desc.length;
+    }
+    if (done == desc.length) {
+      ctx->stats->CountPageRead(desc.length);
+      return true;
+    }
+  } else if (desc.format & kLZ4Frame) {
+    auto stream = CreatePageStreamFrom(ctx, idx);
+    std::vector<char> piece(PageStreamBuf::kChunkSize);
+    while (stream.read(piece.data(), piece.size()) || stream.gcount() > 0) {
+      if (!WriteFully(fd, piece.data(), (size_t)stream.gcount())) {
+        return false;
+      }
+      done += (uint64_t)stream.gcount();
+    }
+    return !stream.bad() && done == content_length;
+  } else if (!(desc.format & (kLZ4Chunked | kChunkList))) {
+    // blocks can only be decoded as a whole
+    auto page = LoadPageFrom(*ctx, idx);
+    return page.size == content_length && (page.size == 0
+      || (page.data != nullptr && WriteFully(fd, (const char *)page.data.get(), page.size)));
+  }
+
+  // the rest in bounded windows, decoding kLZ4Chunked ones on the decode threads
+  enum { kExtractWindowSize = 32 * 1024 * 1024 };
+  std::vector<char> window((size_t)std::min<uint64_t>(kExtractWindowSize, content_length - done));
+  while (done < content_length) {
+    uint64_t bytes = ReadPageRangeFrom(*ctx, idx, done, window.data(), window.size());
+    if (bytes == 0 || !WriteFully(fd, window.data(), (size_t)bytes)) {
+      return false;
+    }
+    done += bytes;
+  }
+  return true;
+}
+
+int32_t PagedFile::VerifyPage(uint32_t idx) const {
+  if (!is_open_ || editing_page_ >= 0)
+    return kVerifyFailed;
+
+  return VerifyPageFrom(ctx_, idx);
+}
+
+bool PagedFile::ChecksumMatches(const ReadContext &ctx, const PagedFileHeader::PageDesc &desc) {
+  ctx.stats->CountRead(desc.start, desc.length);
+  if (ctx.map) {
+    return desc.start + desc.length <= ctx.map->Size()
+      && Crc32c(0, ctx.map->Data() + desc.start, desc.length) == desc.checksum;
+  }
+
+  // checksum in chunks so huge pages do not need a page-sized buffer
+  enum { kVerifyChunkSize = 1024 * 1024 };
+  thread_local std::vector<char> chunk;
+  chunk.resize(kVerifyChunkSize);
+  uint32_t crc = 0;
+  for (uint64_t offset = 0; offset < desc.length; offset += chunk.size()) {
+    size_t bytes = (size_t)std::min<uint64_t>(chunk.size(), desc.length - offset);
+    if (ctx.file.ReadAt(desc.start + offset, chunk.data(), bytes) != bytes) {
+      return false;
+    }
+    crc = Crc32c(crc, chunk.data(), bytes);
+  }
+  return crc == desc.checksum;
+}
+
+int32_t PagedFile::VerifyPageFrom(const std::shared_ptr<const ReadContext> &ctx, uint32_t idx) {
+  PagedFileHeader::PageDesc desc;
+  if (!ctx->header->Locate(idx, desc)) {
+    return kVerifyFailed;
+  }
+
+  uint64_t file_size = ctx->map ? ctx->map->Size() : ctx->file.Size();
+  if (desc.start > file_size || desc.length > file_size - desc.start) {
+    return kVerifyFailed;
+  }
+
+  if (desc.format & kChunkList) {
+    // a list is only as intact as the chunks it refers to
+    std::vector<ChunkRef> refs;
+    if ((desc.has_checksum && !ChecksumMatches(*ctx, desc)) || !LoadChunkList(*ctx, desc, refs)) {
+      return kVerifyFailed;
+    }
+    int32_t result = desc.has_checksum ? kVerifyOk : kVerifyUnchecked;
+    uint64_t content_length = 0;
+    PagedFileHeader::PageDesc chunk;
+    for (const auto &ref : refs) {
+      if (!ctx->header->Locate(ref.page, chunk)) {
+        return kVerifyFailed;
+      }
+      content_length += PagedFileHeader::IsCompressed(chunk.format) ?
+        chunk.uncompressed_length : chunk.length;
+      int32_t chunk_result = VerifyPageFrom(ctx, ref.page);
+      if (chunk_result == kVerifyFailed) {
+        return kVerifyFailed;
+      }
+      if (chunk_result == kVerifyUnchecked) {
+        result = kVerifyUnchecked;
+      }
+    }
+    return content_length == desc.uncompressed_length ? result : kVerifyFailed;
+  }
+
+  if (desc.has_checksum) {
+    return ChecksumMatches(*ctx, desc) ? kVerifyOk : kVerifyFailed;
+  }
+
+  if (!PagedFileHeader::IsCompressed(desc.format) || desc.length == 0) {
+    return kVerifyUnchecked;
+  }
+
+  // without a checksum the best we can do is decode the whole page
+  PageStream stream = CreatePageStreamFrom(ctx, idx);
+  if (!stream.good()) {
+    return kVerifyFailed;
+  }
+  char sink[PageStreamBuf::kChunkSize];
+  uint64_t total = 0;
+  while (stream.read(sink, sizeof(sink)) || stream.gcount() > 0) {
+    total += (uint64_t)stream.gcount();
+  }
+  return total == desc.uncompressed_length && stream.buffer_->good() ?
+    kVerifyUnchecked : kVerifyFailed;
+}
+
+bool PagedFile::CompressPage(uint16_t &format, const char *buffer, size_t length,
+  std::vector<char> &work_buffer, size_t &compressed_length) {
+
+  compressed_length = 0;
+  if (PagedFileHeader::IsCompressed(format)) {
+    if (format & kLZ4Chunked) {
+      size_t num_chunks = (length + kCompressedChunkSize - 1) / kCompressedChunkSize;
+      size_t table_length = (num_chunks + 1) * sizeof(uint64_t);
+      size_t max_dst_size = num_chunks * (size_t)LZ4_compressBound(kCompressedChunkSize)
+        + table_length + kChunkTrailerSize;
+      if (work_buffer.size() < max_dst_size) {
+        work_buffer.resize(max_dst_size);
+      }
+
+      std::vector<uint64_t> offsets(1, 0);
+      offsets.reserve(num_chunks + 1);
+      char *dst = work_buffer.data();
+      for (size_t pos = 0; pos < length; pos += kCompressedChunkSize) {
+        size_t bytes = std::min<size_t>(kCompressedChunkSize, length - pos);
+        offsets.push_back(offsets.back() + CompressChunk(buffer + pos, bytes,
+          dst + offsets.back()));
+      }
+
+      // offset table and trailer, same layout EndNewPage writes for streamed pages
+      char *tail = dst + offsets.back();
+      uint64_t uncompressed_length = length;
+      uint32_t chunk_size = kCompressedChunkSize, chunk_count = (uint32_t)num_chunks;
+      memcpy(tail, offsets.data(), table_length);
+      memcpy(tail + table_length, &uncompressed_length, sizeof(uint64_t));
+      memcpy(tail + table_length + 8, &chunk_size, sizeof(uint32_t));
+      memcpy(tail + table_length + 12, &chunk_count, sizeof(uint32_t));
+      compressed_length = (size_t)offsets.back() + table_length + kChunkTrailerSize;
+    } else if (format & kLZ4Block) {
+      int max_dst_size = LZ4_compressBound(length);
+      if (work_buffer.size() < (size_t)max_dst_size) {
+        work_buffer.resize(max_dst_size);
+      }
+      compressed_length = (size_t)LZ4_compress_default(
+        buffer, &work_buffer[0], length, max_dst_size);
+      if (compressed_length == 0) {  // compression failed
+        return false;
+      }
+    } else if (format & kLZ4Frame) {
+      size_t max_dst_size = LZ4F_compressFrameBound(length, nullptr);
+      if (work_buffer.size() < max_dst_size) {
+        work_buffer.resize(max_dst_size);
+      }
+
+      LZ4F_preferences_t pref = LZ4F_INIT_PREFERENCES;
+      // record contentSize to prevent memory reallocation when using Python binding
+      pref.frameInfo.contentSize = length;
+      compressed_length = LZ4F_compressFrame(
+        work_buffer.data(), work_buffer.size(), buffer, length, &pref);
+      if (LZ4F_isError(compressed_length)) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+
+  if (compressed_length >= length) {
+    format &= 0xffff00ff;  // clear comrpession flag
+  }
+  return true;
+}
+
+bool PagedFile::AppendPage(uint32_t idx, const std::string &name, uint16_t format,
+  const char *buffer, size_t length, bool verbose) {
+  if (!is_open_ || editing_page_ >= 0)
+    return false;
+
+  // share the data of an identical page before spending time on compression
+  uint32_t checksum = 0;
+  if (dedup_ && (format & 0xff) == kFile && length != 0) {
+    if (!Writable() || header_->Exists(idx))
+      return false;
+    checksum = Crc32c(0, buffer, length);
+    if (LinkDuplicate(idx, name, buffer, length, checksum))
+      return true;
+  }
+
+  if (format & kChunkList) {
+    // chunks are compressed one by one as they are stored
+    if (!NewPage(idx, name, kChunkList))
+      return false;
+    Write(buffer, length);
+    EndNewPage();
+    return true;
+  }
+
+  // try compression first
+  size_t bytes = 0;
+  size_t capacity = comp_buffer_.capacity();
+  {
+    IOStats::Timer timer(stats_.get(), IOStats::kCompressNanos);
+    if (!CompressPage(format, buffer, length, comp_buffer_, bytes))
+      return false;
+  }
+  if (comp_buffer_.capacity() != capacity) {
+    stats_->Add(IOStats::kBufferGrows);
+  }
+
+  bool known = dedup_ && length != 0;
+  if (PagedFileHeader::IsCompressed(format)) {
+    // compressed pages of earlier sessions are only known by their stored data
+    if (known && (format & 0xff) == kFile
+      && LinkStoredDuplicate(idx, name, format, comp_buffer_.data(), bytes, checksum))
+      return true;
+    if (!AppendStoredPage(idx, name, format, comp_buffer_.data(), bytes, length,
+      known, checksum))
+      return false;
+
+    if (verbose) {
+      std::cout << name << " [" << (int)((float)bytes / length * 100) << "%]" << std::endl;
+    }
+    return true;
+  }
+  return AppendStoredPage(idx, name, format, buffer, length, length, known, checksum);
+}
+
+bool PagedFile::AppendCompressedPage(uint32_t idx, const std::string &name, uint16_t format,
+  const char *data, size_t length, uint64_t uncompressed_length) {
+  if (!is_open_ || editing_page_ >= 0 || (format & kChunkList))
+    return false;
+
+  if (dedup_ && !PagedFileHeader::IsCompressed(format)) {
+    // plain data is the content, so it can be matched like AppendPage does
+    return AppendPage(idx, name, format, data, length);
+  }
+  if (dedup_ && (format & 0xff) == kFile && length != 0) {
+    if (!Writable() || header_->Exists(idx))
+      return false;
+    uint32_t dup = 0;
+    if (FindStoredDuplicate(format, data, length, Crc32c(0, data, length), dup)) {
+      auto desc = *header_->Desc(dup);
+      desc.name = name;
+      header_->AddPage(idx, std::move(desc));
+      IndexPage(idx, false, 0);
+      return true;
+    }
+  }
+  return AppendStoredPage(idx, name, format, data, length, uncompressed_length, false, 0);
+}
+
+bool PagedFile::AppendDuplicatePage(uint32_t idx, const std::string &name,
+  const char *buffer, size_t length) {
+  if (!is_open_ || !Writable() || editing_page_ >= 0 || length == 0 || header_->Exists(idx))
+    return false;
+
+  return LinkDuplicate(idx, name, buffer, length, Crc32c(0, buffer, length));
+}
+
+bool PagedFile::LinkDuplicate(uint32_t idx, const std::string &name, const char *buffer,
+  size_t length, uint32_t checksum) {
+
+  uint32_t dup = 0;
+  if (!FindDuplicate(length, checksum, buffer, dup)) {
+    return false;
+  }
+  auto desc = *header_->Desc(dup);
+  desc.name = name;
+  header_->AddPage(idx, std::move(desc));
+  IndexPage(idx, true, checksum);
+  return true;
+}
+
+bool PagedFile::LinkStoredDuplicate(uint32_t idx, const std::string &name, uint16_t format,
+  const char *data, size_t length, uint32_t content_checksum) {
+
+  uint32_t dup = 0;
+  if (!FindStoredDuplicate(format, data, length, Crc32c(0, data, length), dup)) {
+    return false;
+  }
+  auto desc = *header_->Desc(dup);
+  desc.name = name;
+  header_->AddPage(idx, std::move(desc));
+  IndexPage(idx, true, content_checksum);
+  return true;
+}
+
+bool PagedFile::AppendStoredPage(uint32_t idx, const std::string &name, uint16_t format,
+  const char *data, size_t length, uint64_t uncompressed_length, bool checksum_known,
+  uint32_t content_checksum) {
+
+  if (!NewPage(idx, name))
+    return false;
+  auto desc = header_->Desc(idx);
+  desc->format = format;
+  if (PagedFileHeader::IsCompressed(format)) {
+    desc->uncompressed_length = uncompressed_length;
+  }
+  // callers have looked for duplicates already
+  content_checksum_ = content_checksum;
+  content_checksum_known_ = checksum_known;
+  stream_dedup_ = false;
+  dedup_staging_ = false;
+
+  WritePageData(data, length);
+  EndNewPage();
+
+  return true;
+}
+
+bool PagedFile::FindDuplicate(uint64_t length, uint32_t checksum, const char *buffer,
+  uint32_t &dup) {
+
+  if (!dedup_indexed_) {
+    BuildDedupIndex();
+  }
+  auto range = dedup_index_.equal_range(DedupKey(0, length, checksum));
+  for (auto candidate = range.first; candidate != range.second; ++candidate) {
+    if (ContentEquals(candidate->second, buffer, (size_t)length)) {
+      dup = candidate->second;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PagedFile::FindStoredDuplicate(uint16_t format, const char *data, size_t length,
+  uint32_t checksum, uint32_t &dup) {
+
+  if (!dedup_indexed_) {
+    BuildDedupIndex();
+  }
+  auto range = stored_index_.equal_range(DedupKey(format & 0xff00, length, checksum));
+  for (auto candidate = range.first; candidate != range.second; ++candidate) {
+    if (StoredEquals(candidate->second, data, length)) {
+      dup = candidate->second;
+      return true;
+    }
+  }
+  return false;
+}
+
+void PagedFile::BuildDedupIndex() {
+  // only the checksums of the table, pages are not read until a candidate shows up
+  dedup_indexed_ = true;
+  for (uint32_t idx : header_->ListPages()) {
+    if (idx != (uint32_t)editing_page_) {
+      IndexPage(idx, false, 0);
+    }
+  }
+}
+
+void PagedFile::IndexPage(uint32_t idx, bool checksum_known, uint32_t content_checksum) {
+  if (!dedup_indexed_) {
+    return;  // picked up when the index is built
+  }
+  const auto &desc = *header_->Desc(idx);
+  if ((desc.format & 0xff) != kFile || (desc.format & kChunkList) || desc.length == 0) {
+    return;
+  }
+
+  // plain data is the content, so its checksum is the content checksum
+  if (!PagedFileHeader::IsCompressed(desc.format)) {
+    if (desc.has_checksum) {
+      dedup_index_.emplace(DedupKey(0, desc.length, desc.checksum), idx);
+    }
+    return;
+  }
+  if (checksum_known) {
+    dedup_index_.emplace(DedupKey(0, desc.uncompressed_length, content_checksum), idx);
+  }
+  if (desc.has_checksum) {
+    stored_index_.emplace(DedupKey(desc.format & 0xff00, desc.length, desc.checksum), idx);
+  }
+}
+
+bool PagedFile::ContentEquals(uint32_t idx, const char *buffer, size_t length) const {
+  // a page that fails to decode stops short of its recorded length
+  const auto &desc = *header_->Desc(idx);
+  if ((PagedFileHeader::IsCompressed(desc.format) ? desc.uncompressed_length : desc.length)
+    != length) {
+    return false;
+  }
+  auto stream = CreatePageStreamFrom(ctx_, idx);
+  std::vector<char> content(PageStreamBuf::kChunkSize);
+  size_t pos = 0;
+  while (stream.read(content.data(), content.size()) || stream.gcount() > 0) {
+    size_t bytes = (size_t)stream.gcount();
+    if (bytes > length - pos || memcmp(content.data(), buffer + pos, bytes) != 0) {
+      return false;
+    }
+    pos += bytes;
+  }
+  return !stream.bad() && pos == length;
+}
+
+bool PagedFile::StoredEquals(uint32_t idx, const char *data, size_t length) const {
+  const auto &desc = *header_->Desc(idx);
+  if (desc.length != length) {
+    return false;
+  }
+
+  enum { kCompareChunkSize = 1024 * 1024 };
+  std::vector<char> stored(std::min<size_t>(length, kCompareChunkSize));
+  for (size_t offset = 0; offset < length; offset += stored.size()) {
+    size_t bytes = std::min(stored.size(), length - offset);
+    if (ctx_->file.ReadAt(desc.start + offset, stored.data(), bytes) != bytes
+      || memcmp(stored.data(), data + offset, bytes) != 0) {
+      return false;
+    }
+  }
+  stats_->CountRead(desc.start, desc.length);
+  return true;
+}
+
+void PagedFile::StoreChunk(const char *data, size_t length) {
+  uint32_t checksum = Crc32c(0, data, length);
+  uint64_t key = ((uint64_t)length << 32) | checksum;
+  auto range = chunk_index_.equal_range(key);
+  if (range.first != range.second) {
+    // chunks of this page may still sit in the stream buffer
+    fs_.flush();
+  }
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    if (ContentEquals(iter->second, data, length)) {
+      chunk_refs_.push_back({iter->second, checksum});
+      return;
+    }
+  }
+
+  while (header_->Exists(next_chunk_idx_)) {
+    --next_chunk_idx_;
+  }
+  uint32_t chunk = next_chunk_idx_--;
+  size_t bytes = 0;
+  {
+    IOStats::Timer timer(stats_.get(), IOStats::kCompressNanos);
+    bytes = CompressChunk(data, length, comp_buffer_.data());
+  }
+  bool compressed = bytes < length;
+
+  uint64_t start = (uint64_t)fs_.tellp();
+  fs_.write(comp_buffer_.data(), bytes);
+  header_->AddPage(chunk, {(uint16_t)(kChunk | (compressed ? kLZ4Block : kPlain)), start,
+    bytes, compressed ? length : 0, "", Crc32c(0, comp_buffer_.data(), bytes), true});
+  stats_->CountWrite(start, bytes);
+
+  chunk_index_.emplace(key, chunk);
+  chunk_refs_.push_back({chunk, checksum});
+}
+
+void PagedFile::IndexChunks() {
+  // lists carry the content checksums, so chunks themselves are not read
+  chunk_index_.clear();
+  std::unordered_set<uint32_t> indexed;
+  std::vector<ChunkRef> refs;
+  for (uint32_t idx : header_->ListPages()) {
+    PagedFileHeader::PageDesc desc;
+    if (!header_->Locate(idx, desc)) {
+      continue;
+    }
+    if ((desc.format & 0xff) == kChunk) {
+      next_chunk_idx_ = std::min(next_chunk_idx_, idx - 1);
+    }
+    if ((desc.format & 0xff) != kFile || !(desc.format & kChunkList)
+      || !LoadChunkList(*ctx_, desc, refs)) {
+      continue;
+    }
+    for (const auto &ref : refs) {
+      PagedFileHeader::PageDesc chunk;
+      if (indexed.insert(ref.page).second && header_->Locate(ref.page, chunk)) {
+        uint64_t length = PagedFileHeader::IsCompressed(chunk.format) ?
+          chunk.uncompressed_length : chunk.length;
+        chunk_index_.emplace((length << 32) | ref.checksum, ref.page);
+      }
+    }
+  }
+  chunk_indexed_ = true;
+}
+
+bool PagedFile::NewMetaPage(uint32_t idx, uint16_t format, const std::string &data) {
+  if (!is_open_ || !Writable() || editing_page_ >= 0) {
+    return false;
+  }
+  return header_->NewMetaPage(idx, format, data);
+}
+
+
+bool PagedFile::RemovePages(const std::unordered_set<uint32_t> &pages, int32_t method) {
+  if (!is_open_ || !Writable() || editing_page_ >= 0)
+    return false;
+  // a batch only tombstones, the committed pages stay intact until Commit
+  if (batch_ && method != kRemoveTombstone)
+    return false;
+
+  // chunks go with the last list referring to them
+  bool drops_lists = false;
+  for (uint32_t idx : pages) {
+    auto desc = header_->Desc(idx);
+    drops_lists = drops_lists || (desc != nullptr && (desc->format & 0xff) == kFile
+      && (desc->format & kChunkList));
+  }
+  const auto &old_order = header_->ListPages();
+  std::unordered_set<uint32_t> unreferenced;
+  if (drops_lists) {
+    for (uint32_t idx : old_order) {
+      if ((header_->Desc(idx)->format & 0xff) == kChunk) {
+        unreferenced.insert(idx);
+      }
+    }
+    std::vector<ChunkRef> refs;
+    for (uint32_t idx : old_order) {
+      auto desc = header_->Desc(idx);
+      if ((desc->format & 0xff) != kFile || !(desc->format & kChunkList)
+        || pages.find(idx) != pages.end()) {
+        continue;
+      }
+      if (!LoadChunkList(*ctx_, *desc, refs)) {
+        unreferenced.clear();  // keep every chunk rather than lose one
+        break;
+      }
+      for (const auto &ref : refs) {
+        unreferenced.erase(ref.page);
+      }
+    }
+  }
+
+  // drop the table entries first, their data is dead from here on
+  std::vector<std::pair<uint64_t, uint64_t>> dead;  // start, length
+  std::vector<uint32_t> new_order;
+  uint32_t base_removed = 0;
+  for (uint32_t i = 0; i < old_order.size(); ++i) {
+    uint32_t idx = old_order[i];
+    auto desc = header_->Desc(idx);
+    // can only remove files and the chunks they leave behind
+    uint16_t type = desc->format & 0xff;
+    if (type == kFile ? pages.find(idx) == pages.end()
+      : type != kChunk || unreferenced.find(idx) == unreferenced.end()) {
+      new_order.push_back(idx);
+      continue;
+    }
+    dead.emplace_back(desc->start, desc->length);
+    header_->page_table_.erase(idx);
+    ctx_->cache.Erase(idx);
+
+    // pages added in this session never reached the journal
+    if (i < header_->journal_base_pages_) {
+      header_->journal_removed_.push_back(idx);
+      ++base_removed;
+    }
+  }
+  header_->journal_base_pages_ -= base_removed;
+
+  using std::swap;
+  swap(header_->page_order_, new_order);
+  header_->lazy_.Invalidate();
+  dedup_index_.clear();
+  stored_index_.clear();
+  dedup_indexed_ = false;
+  chunk_index_.clear();
+  chunk_indexed_ = false;
+
+  if (method == kRemoveCompact) {
+    return Compact();
+  }
+
+  // dead space at the end is cut off by Close, holes are punched elsewhere
+  uint64_t data_end = sizeof(uint32_t);
+  for (uint32_t idx : header_->page_order_) {
+    const auto &desc = header_->page_table_[idx];
+    if (HoldsData(desc.format)) {
+      data_end = std::max(data_end, desc.start + desc.length);
+    }
+  }
+  if (journaling_) {
+    // the tables the journal builds on must survive
+    data_end = std::max(data_end, (uint64_t)old_tail_);
+  }
+  if ((uint64_t)tail_pos_ > data_end) {
+    tail_pos_ = data_end;
+    header_->data_end_ = data_end;
+  }
+
+  // holes are punched once the table without these pages is durable
+  for (const auto &range : dead) {
+    if (range.first < data_end) {
+      dead_ranges_.push_back(range);
+    }
+  }
+  return true;
+}
+
+void PagedFile::PunchDeadRanges(uint64_t end) {
+  std::vector<std::pair<uint64_t, uint64_t>> dead;
+  dead.swap(dead_ranges_);
+  if (dead.empty())
+    return;
+
+  std::vector<std::pair<uint64_t, uint64_t>> live;  // start, end
+  for (uint32_t idx : header_->page_order_) {
+    const auto &desc = header_->page_table_[idx];
+    if (HoldsData(desc.format)) {
+      live.emplace_back(desc.start, desc.start + desc.length);
+    }
+  }
+
+  // data shared with a remaining page stays, live data is merged into ranges
+  // whose ends ascend so overlaps can be found by binary search
+  std::sort(live.begin(), live.end());
+  std::vector<std::pair<uint64_t, uint64_t>> merged;
+  for (const auto &range : live) {
+    if (!merged.empty() && range.first <= merged.back().second) {
+      merged.back().second = std::max(merged.back().second, range.second);
+    } else {
+      merged.push_back(range);
+    }
+  }
+  dead.erase(std::remove_if(dead.begin(), dead.end(),
+    [&](const std::pair<uint64_t, uint64_t> &range) {
+      auto iter = std::upper_bound(merged.begin(), merged.end(), range.first,
+        [](uint64_t pos, const std::pair<uint64_t, uint64_t> &m) { return pos < m.second; });
+      return iter != merged.end() && iter->first < range.first + range.second;
+    }),
+    dead.end());
+  for (auto &range : dead) {
+    // later pages or the table may have been written where removed data ended
+    range.second = range.first < end ? std::min(range.second, end - range.first) : 0;
+  }
+  PunchHoles(fd_, dead);  // best effort, only frees disk space
+}
+
+bool PagedFile::Compact() {
+  if (!is_open_ || !Writable() || editing_page_ >= 0 || batch_)
+    return false;
+  dead_ranges_.clear();  // pages move over the dead data
+
+  std::vector<PagedFileHeader::PageDesc *> descs;
+  for (uint32_t idx : header_->ListPages()) {
+    auto desc = header_->Desc(idx);
+    if (HoldsData(desc->format)) {
+      descs.push_back(desc);
+    }
+  }
+  std::sort(descs.begin(), descs.end(),
+    [](const PagedFileHeader::PageDesc *a, const PagedFileHeader::PageDesc *b) {
+      return a->start < b->start;
+    });
+
+  // pages already in place are skipped, the rest slide down over the gaps.
+  // adjacent pages moving by the same distance are moved as one run
+  fs_.flush();
+#if defined(__linux__)
+  int fd = fd_;
+#else
+  int fd = -1;
+#endif
+  bool ok = true;
+  uint64_t move_dst = sizeof(uint32_t);  // magic number
+  uint64_t run_src = 0, run_dst = 0, run_length = 0;
+  // deduplicated pages share data, overlapping pages form one extent that moves once
+  uint64_t extent_src = 0, extent_end = 0, extent_dst = 0;
+  auto move_extent = [&]() {
+    uint64_t length = extent_end - extent_src;
+    if (extent_src != extent_dst && length != 0) {
+      if (run_length != 0 && extent_src == run_src + run_length
+        && extent_dst == run_dst + run_length) {
+        run_length += length;
+      } else {
+        ok = ok && MoveDown(fd, run_src, run_dst, run_length);
+        run_src = extent_src;
+        run_dst = extent_dst;
+        run_length = length;
+      }
+    }
+  };
+  for (auto desc : descs) {
+    if (desc->start < extent_end) {
+      // shares data with the extent, which grows if the page reaches further
+      if (desc->start + desc->length > extent_end) {
+        move_dst += desc->start + desc->length - extent_end;
+        extent_end = desc->start + desc->length;
+      }
+      desc->start = extent_dst + (desc->start - extent_src);
+      continue;
+    }
+    move_extent();
+    if (StartsAligned(desc->format)) {
+      move_dst = AlignUp(move_dst, header_->alignment_);
+    }
+    extent_src = desc->start;
+    extent_end = desc->start + desc->length;
+    extent_dst = move_dst;
+
+    // modify table entry
+    desc->start = move_dst;
+    move_dst += desc->length;
+  }
+  move_extent();
+  ok = ok && MoveDown(fd, run_src, run_dst, run_length);
+  header_->lazy_.Invalidate();
+  header_->journal_rewrite_ = true;
+
+  tail_pos_ = move_dst;
+  header_->data_end_ = move_dst;
+
+  fs_.flush();
+  return ok && fs_.good();
+}
+
+bool PagedFile::MoveDown(int fd, uint64_t src, uint64_t dst, uint64_t length) {
+  if (length == 0 || src == dst) {
+    return true;
+  }
+  stats_->CountRead(src, length);
+  stats_->CountWrite(dst, length);
+
+  // short distances would make kernel copies tiny, those go through the buffer
+  enum { kMoveChunkSize = 8 * 1024 * 1024, kMinKernelMove = 64 * 1024 };
+  uint64_t moved = 0;
+  if (fd >= 0 && src - dst >= kMinKernelMove) {
+    moved = KernelMoveDown(fd, src, dst, length, kMoveChunkSize);
+  }
+
+  // buffered fallback, each chunk is read before it is written so overlap is safe
+  std::vector<char> buffer((size_t)std::min<uint64_t>(kMoveChunkSize, length - moved));
+  while (moved < length) {
+    size_t bytes = (size_t)std::min<uint64_t>(buffer.size(), length - moved);
+    fs_.seekg(src + moved, std::ios::beg);
+    fs_.read(buffer.data(), bytes);
+    fs_.seekp(dst + moved, std::ios::beg);
+    fs_.write(buffer.data(), bytes);
+    if (!fs_.good()) {
+      return false;
+    }
+    moved += bytes;
+  }
+  // later kernel copies must see these writes
+  fs_.flush();
+  return fs_.good();
+}
+
+PagedFileHeader &PagedFile::Header() {
+  return *header_;
+}
+
+const PagedFileHeader &PagedFile::Header() const {
+  return *header_;
+}
+
+PagedFileReader PagedFile::CreateReader() const {
+  if (!is_open_)
+    return {};
+
+  return PagedFileReader(ctx_);
+}
+
+/////////////////////////////
+// input stream related
+
+PagedFile::PageInputStream::PageInputStream() :
+  std::istream(nullptr), buffer_(nullptr, nullptr) {
+}
+
+PagedFile::PageInputStream::PageInputStream(std::shared_ptr<uint8_t> data, size_t size) :
+  std::istream(nullptr),
+  data_(data),
+  buffer_((char*)data.get(), (char*)data.get() + size) {
+
+  if (data && size) {
+    init(&buffer_);
+  }
+}
+
+PagedFile::PageInputStream::PageInputStream(PageInputStream &&rhs) :
+  std::istream(std::move(rhs)), buffer_(nullptr, nullptr) {
+  using std::swap;
+  swap(data_, rhs.data_);
+  swap(buffer_, rhs.buffer_);
+  set_rdbuf(&buffer_);
+}
+
+PagedFile::PageInputStream PagedFile::CreatePageIStream(uint32_t idx) const {
+  if (!is_open_ || editing_page_ >= 0)
+    return {};
 
-  header_.AddPage(idx, {kFile | kPlain, start, 0, 0, name});
-  editing_page_ = (int32_t)idx;
-  return true;
+  return CreatePageIStreamFrom(ctx_, idx);
 }
 
+PagedFile::PageInputStream PagedFile::CreatePageIStreamFrom(
+  const std::shared_ptr<const ReadContext> &ctx, uint32_t idx) {
 
-void PagedFile::EndNewPage() {
-  if (!is_open_ || editing_page_ < 0)
-    return;
+  auto page = LoadPageFrom(*ctx, idx);
+  if (page.data == nullptr)
+    return {};
 
-  tail_pos_ = fs_.tellp();
-  uint64_t cur_pos = (uint64_t)tail_pos_;
-  auto desc = header_.Desc((uint32_t)editing_page_);
-  uint64_t offset = cur_pos - desc->start;
+  // the stream only reads, sharing cached content and the mapping is safe
+  return PageInputStream(std::const_pointer_cast<uint8_t>(page.data), page.size);
+}
 
-  desc->length = offset;
+PagedFile::PageHandle PagedFile::LoadPage(uint32_t idx) const {
+  if (!is_open_ || editing_page_ >= 0)
+    return {};
 
-  editing_page_ = -1;
+  return LoadPageFrom(*ctx_, idx);
 }
 
-uint64_t PagedFile::ReadPage(uint32_t idx, char *buffer, size_t buffer_size) {
-  if (!is_open_ || editing_page_ >= 0)
-    return 0;
+PagedFile::PageHandle PagedFile::LoadPageFrom(const ReadContext &ctx, uint32_t idx) {
+  PagedFileHeader::PageDesc desc;
+  if (!ctx.header->Locate(idx, desc) || desc.length == 0)
+    return {};
 
-  if (!header_.Exists(idx)) {
-    return 0;
+  if (PagedFileHeader::IsCompressed(desc.format)) {
+    auto page = LoadCompressedPage(ctx, idx, desc);
+    if (page.data != nullptr) {
+      ctx.stats->CountPageRead(page.size);
+    }
+    return page;
   }
 
-  const auto desc = header_.Desc(idx);
-  if ((PagedFileHeader::IsCompressed(desc->format) && (buffer_size < desc->uncompressed_length))
-    || buffer_size < desc->length) {
-    return 0;
+  if (ctx.map) {
+    // share the mapping instead of copying plain pages, the view counts the read
+    auto view = ViewPageFrom(ctx, idx);
+    if (view.data == nullptr)
+      return {};
+    return {std::shared_ptr<const uint8_t>(ctx.map, (const uint8_t *)view.data), view.size};
   }
 
-  fs_.seekg(desc->start, std::ios::beg);
-
-  if (PagedFileHeader::IsCompressed(desc->format)) {
-    // resize work buffer
-    if (comp_buffer_.size() < desc->length) {
-      comp_buffer_.resize(desc->length);
-    }
-    fs_.read(&comp_buffer_[0], desc->length);
-    // decompress
-    if (desc->format & kLZ4Block) {
-      int bytes = LZ4_decompress_safe(&comp_buffer_[0], buffer, desc->length, buffer_size);
-      if (bytes < 0) {
-        return 0;
-      }
-
-      return (uint64_t)bytes;
-    } else if (desc->format & kLZ4Frame) {
-      LZ4F_dctx* ctx = nullptr;
-      auto err = LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION);
-      if (LZ4F_isError(err)) {
-        // lz4 version mismatch? out of memory?
-        return 0;
-      }
-
-      // set stable dst for lz4 internal optimization
-      LZ4F_decompressOptions_t options;
-      memset(&options, 0, sizeof options);
-      options.stableDst = 1;
-
-      // loop until src buffer is exhausted or frame end
-      size_t dst_consumed = 0;
-      size_t src_left = desc->length;
-      char *src_buffer = comp_buffer_.data();
-      while (src_left > 0) {
-        size_t dst_size = buffer_size - dst_consumed;
-        size_t src_size = src_left;
-        auto hint = LZ4F_decompress(ctx, buffer, &dst_size, src_buffer, &src_size, &options);
+  std::shared_ptr<uint8_t> data(new uint8_t[desc.length], std::default_delete<uint8_t[]>());
+  if (ReadStoredPage(ctx, desc, (char *)data.get(), desc.length) != desc.length)
+    return {};
+  ctx.stats->CountPageRead(desc.length);
+  return {std::move(data), (size_t)desc.length};
+}
 
-        if (LZ4F_isError(hint)) {
-          // something went wrong, maybe data is corrupted
-          return 0;
-        }
+PagedFile::PageHandle PagedFile::LoadCompressedPage(const ReadContext &ctx, uint32_t idx,
+  const PagedFileHeader::PageDesc &desc) {
 
-        buffer += dst_size;
-        dst_consumed += dst_size;
-        src_buffer += src_size;
-        src_left -= src_size;
-      }
+  if (ctx.cache.Enabled()) {
+    size_t size = 0;
+    auto data = ctx.cache.Find(idx, size);
+    if (data) {
+      return {std::move(data), size};
+    }
+  }
 
-      err = LZ4F_freeDecompressionContext(ctx);
-      if (LZ4F_isError(err)) {
-        return 0;
-      }
+  std::shared_ptr<uint8_t> data(
+    new uint8_t[desc.uncompressed_length], std::default_delete<uint8_t[]>());
+  uint64_t size = ReadStoredPage(ctx, desc, (char *)data.get(), desc.uncompressed_length);
+  if (size == 0)
+    return {};
 
-      return dst_consumed;
-    } else {
-      return 0;
-    }
-  } else {
-    fs_.read(buffer, desc->length);
-    return desc->length;
+  if (ctx.cache.Enabled()) {
+    ctx.cache.Insert(idx, data, size);
   }
+  return {std::move(data), (size_t)size};
 }
 
-bool PagedFile::AppendPage(uint32_t idx, const std::string &name, uint16_t format,
-  const char *buffer, size_t length, bool verbose) {
+bool PagedFile::ReadPages(const std::vector<uint32_t> &pages,
+  const PageCallback &callback) const {
   if (!is_open_ || editing_page_ >= 0)
     return false;
 
-  // try compression first
-  size_t bytes = 0;
-  if (PagedFileHeader::IsCompressed(format)) {
-    if (format & kLZ4Block) {
-      int max_dst_size = LZ4_compressBound(length);
-      if (comp_buffer_.size() < (size_t)max_dst_size) {
-        comp_buffer_.resize(max_dst_size);
-      }
-      bytes = (size_t)LZ4_compress_default(buffer, &comp_buffer_[0], length, max_dst_size);
-      if (bytes == 0) {  // compression failed
-        return false;
+  return ReadPagesFrom(*ctx_, pages, callback);
+}
+
+bool PagedFile::ReadPages(const std::vector<uint32_t> &pages,
+  std::vector<PageHandle> &handles) const {
+  handles.assign(pages.size(), PageHandle());
+  return ReadPages(pages, [&](size_t i, PageHandle page) {
+    handles[i] = std::move(page);
+  });
+}
+
+bool PagedFile::ReadPagesFrom(const ReadContext &ctx, const std::vector<uint32_t> &pages,
+  const PageCallback &callback) {
+
+  std::atomic<bool> ok(true);
+
+  // pages that need a read of their stored bytes, the rest is served right away
+  std::vector<size_t> positions;
+  std::vector<PagedFileHeader::PageDesc> descs;
+  for (size_t i = 0; i < pages.size(); ++i) {
+    PagedFileHeader::PageDesc desc;
+    if (!ctx.header->Locate(pages[i], desc)) {
+      ok = false;
+      callback(i, {});
+      continue;
+    }
+    bool compressed = PagedFileHeader::IsCompressed(desc.format);
+    if (ctx.map || desc.length == 0 || (desc.format & (kLZ4Chunked | kChunkList))) {
+      // mapped pages need no I/O, chunked ones are decoded on the pool by themselves
+      auto page = LoadPageFrom(ctx, pages[i]);
+      if (page.data == nullptr && desc.length != 0) {
+        ok = false;
       }
-    } else if (format & kLZ4Frame) {
-      size_t max_dst_size = LZ4F_compressFrameBound(length, nullptr);
-      if (comp_buffer_.size() < max_dst_size) {
-        comp_buffer_.resize(max_dst_size);
+      callback(i, std::move(page));
+      continue;
+    }
+    if (compressed && ctx.cache.Enabled()) {
+      size_t size = 0;
+      auto data = ctx.cache.Find(pages[i], size);
+      if (data) {
+        ctx.stats->CountPageRead(size);
+        callback(i, {std::move(data), size});
+        continue;
       }
+    }
+    positions.push_back(i);
+    descs.push_back(std::move(desc));
+  }
+  if (descs.empty()) {
+    return ok;
+  }
 
-      LZ4F_preferences_t pref = LZ4F_INIT_PREFERENCES;
-      // record contentSize to prevent memory reallocation when using Python binding
-      pref.frameInfo.contentSize = length;
-      bytes = LZ4F_compressFrame(comp_buffer_.data(), comp_buffer_.size(), buffer, length, &pref);
-      if (LZ4F_isError(bytes)) {
-        return false;
+  // plan the reads: in archive order, pages at most coalesce_gap bytes apart
+  // share one read of up to kMaxCoalescedRead bytes
+  std::vector<size_t> order(descs.size());
+  for (size_t k = 0; k < order.size(); ++k) {
+    order[k] = k;
+  }
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return descs[a].start < descs[b].start;
+  });
+  std::vector<RandomAccessFile::ReadRequest> requests;
+  std::vector<size_t> extent_first;  // first entry of order served by each read
+  for (size_t k = 0; k < order.size(); ++k) {
+    const auto &desc = descs[order[k]];
+    if (!requests.empty()) {
+      auto &last = requests.back();
+      uint64_t end = last.offset + last.length;
+      uint64_t merged = std::max(end, desc.start + desc.length) - last.offset;
+      if (desc.start <= end + ctx.coalesce_gap && merged <= kMaxCoalescedRead) {
+        last.length = (size_t)merged;
+        continue;
+      }
+    }
+    extent_first.push_back(k);
+    requests.push_back({desc.start, (size_t)desc.length});
+  }
+  extent_first.push_back(order.size());
+
+  // pages are decoded from the buffer of their read, plain pages keep sharing it
+  std::vector<std::shared_ptr<uint8_t>> buffers(requests.size());
+  auto buffer = [&](size_t e) {
+    buffers[e].reset(new uint8_t[requests[e].length], std::default_delete<uint8_t[]>());
+    return std::shared_ptr<char>(buffers[e], (char *)buffers[e].get());
+  };
+  auto done = [&](size_t e, size_t bytes) {
+    auto extent = std::move(buffers[e]);
+    ctx.stats->CountRead(requests[e].offset, bytes);
+
+    for (size_t k = extent_first[e]; k < extent_first[e + 1]; ++k) {
+      const auto &desc = descs[order[k]];
+      uint64_t pos = desc.start - requests[e].offset;
+      const char *stored = (const char *)extent.get() + pos;
+
+      PageHandle page;
+      if (pos + desc.length <= bytes && !(ctx.verify && desc.has_checksum
+        && Crc32c(0, stored, desc.length) != desc.checksum)) {
+        if (PagedFileHeader::IsCompressed(desc.format)) {
+          std::shared_ptr<uint8_t> data(
+            new uint8_t[desc.uncompressed_length], std::default_delete<uint8_t[]>());
+          uint64_t size = 0;
+          {
+            IOStats::Timer timer(ctx.stats.get(), IOStats::kDecompressNanos);
+            size = DecompressPage(desc.format, stored, desc.length,
+              (char *)data.get(), desc.uncompressed_length);
+          }
+          if (size != 0) {
+            if (ctx.cache.Enabled()) {
+              ctx.cache.Insert(pages[positions[order[k]]], data, size);
+            }
+            page = {std::move(data), (size_t)size};
+          }
+        } else {
+          page = {std::shared_ptr<const uint8_t>(extent, (const uint8_t *)stored),
+            (size_t)desc.length};
+        }
+      }
+      if (page.data != nullptr) {
+        ctx.stats->CountPageRead(page.size);
+      } else {
+        ok = false;
       }
+      callback(positions[order[k]], std::move(page));
+    }
+  };
+
+  if (!ctx.file.ReadBatch(requests, kReadDepth, buffer, done)) {
+    // no io_uring, overlap blocking reads on the decode pool instead
+    auto read = [&](size_t k) {
+      done(k, ctx.file.ReadAt(requests[k].offset, buffer(k).get(), requests[k].length));
+    };
+    if (ctx.pool) {
+      ctx.pool->ParallelFor(requests.size(), read);
     } else {
-      return false;
+      for (size_t k = 0; k < requests.size(); ++k) {
+        read(k);
+      }
     }
   }
+  return ok;
+}
 
-  if (bytes >= length) {
-    format &= 0xffff00ff;  // clear comrpession flag
+void PagedFile::SetCacheCapacity(size_t capacity) {
+  cache_capacity_ = capacity;
+  if (ctx_) {
+    ctx_->cache.SetCapacity(capacity);
   }
+}
 
-  if (!NewPage(idx, name))
-    return false;
-  auto desc = header_.Desc(idx);
-  desc->format = format;
+PageCache::Stats PagedFile::CacheStats() const {
+  if (!ctx_)
+    return {};
 
-  if (PagedFileHeader::IsCompressed(format)) {
-    fs_.write(&comp_buffer_[0], bytes);
-    desc->uncompressed_length = length;
+  return ctx_->cache.GetStats();
+}
 
-    if (verbose) {
-      std::cout << name << " [" << (int)((float)bytes / length * 100) << "%]" << std::endl;
+void PagedFile::SetCollectStats(bool collect) {
+  stats_->SetEnabled(collect);
+}
+
+IOStats::Counters PagedFile::Stats() const {
+  return stats_->Get();
+}
+
+void PagedFile::ResetStats() {
+  stats_->Reset();
+}
+
+/////////////////////////////
+// streaming page reader
+
+PagedFile::PageStream::PageStream() :
+  std::istream(nullptr) {
+}
+
+PagedFile::PageStream::PageStream(std::unique_ptr<PageStreamBuf> buffer) :
+  std::istream(nullptr),
+  buffer_(std::move(buffer)) {
+
+  if (buffer_) {
+    init(buffer_.get());
+  }
+}
+
+PagedFile::PageStream::PageStream(PageStream &&rhs) :
+  std::istream(std::move(rhs)),
+  buffer_(std::move(rhs.buffer_)) {
+  set_rdbuf(buffer_.get());
+  rhs.set_rdbuf(nullptr);
+}
+
+PagedFile::PageStream::~PageStream() {
+}
+
+PagedFile::PageStreamBuf::PageStreamBuf(std::shared_ptr<const ReadContext> ctx,
+  const PagedFileHeader::PageDesc &desc) :
+  ctx_(std::move(ctx)),
+  format_(desc.format),
+  start_(desc.start),
+  length_(desc.length),
+  consumed_(0),
+  src_(nullptr),
+  src_left_(0),
+  dctx_(nullptr),
+  chunk_size_(0),
+  next_chunk_(0),
+  content_length_(desc.uncompressed_length),
+  finished_(false),
+  good_(true) {
+
+  if (ctx_->map && start_ + length_ > ctx_->map->Size()) {
+    good_ = false;
+    return;
+  }
+
+  if (!PagedFileHeader::IsCompressed(format_)) {
+    if (ctx_->map) {
+      // expose the mapping directly
+      char *data = const_cast<char *>(ctx_->map->Data() + start_);
+      setg(data, data, data + length_);
+      ctx_->stats->CountRead(start_, length_);
+      consumed_ = length_;
+      finished_ = true;
+    } else {
+      out_buffer_.resize((size_t)std::min<uint64_t>(kChunkSize, length_));
+    }
+  } else if (format_ & kLZ4Chunked) {
+    if (!LoadChunkTable()) {
+      good_ = false;
+      return;
+    }
+    // a stored chunk is never larger than its content
+    out_buffer_.resize((size_t)std::min<uint64_t>(chunk_size_, content_length_));
+    if (!ctx_->map) {
+      in_buffer_.resize(out_buffer_.size());
+    }
+  } else if (format_ & kChunkList) {
+    // chunks are read one at a time, out_buffer_ grows to the largest one
+    std::vector<ChunkRef> refs;
+    if (!LoadChunkList(*ctx_, desc, refs)) {
+      good_ = false;
+      return;
+    }
+    for (const auto &ref : refs) {
+      chunk_pages_.push_back(ref.page);
+    }
+  } else if (format_ & kLZ4Frame) {
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx_, LZ4F_VERSION))) {
+      dctx_ = nullptr;
+      good_ = false;
+      return;
+    }
+    if (!ctx_->map) {
+      in_buffer_.resize((size_t)std::min<uint64_t>(kChunkSize, length_));
     }
+    out_buffer_.resize(kChunkSize);
+  } else if (format_ & kLZ4Block) {
+    // a single LZ4 block can only be decoded as a whole
+    out_buffer_.resize(desc.uncompressed_length);
+    if (!ctx_->map) {
+      in_buffer_.resize(length_);
+    }
+    uint64_t bytes = 0;
+    if (FetchInput()) {
+      IOStats::Timer timer(ctx_->stats.get(), IOStats::kDecompressNanos);
+      bytes = DecompressPage(format_, src_, src_left_, out_buffer_.data(), out_buffer_.size());
+    }
+    std::vector<char>().swap(in_buffer_);
+    if (bytes != desc.uncompressed_length) {
+      good_ = false;
+      return;
+    }
+    setg(out_buffer_.data(), out_buffer_.data(), out_buffer_.data() + bytes);
+    finished_ = true;
   } else {
-    fs_.write((char *)buffer, length);
+    good_ = false;
   }
-  EndNewPage();
-
-  return true;
 }
 
-bool PagedFile::NewMetaPage(uint32_t idx, uint16_t format, const std::string &data) {
-  if (!is_open_ || editing_page_ >= 0) {
-    return false;
+PagedFile::PageStreamBuf::~PageStreamBuf() {
+  if (dctx_ != nullptr) {
+    LZ4F_freeDecompressionContext(dctx_);
   }
-  return header_.NewMetaPage(idx, format, data);
 }
 
+bool PagedFile::PageStreamBuf::good() const {
+  return good_;
+}
 
-bool PagedFile::RemovePages(const std::unordered_set<uint32_t> &pages) {
+std::streambuf::int_type PagedFile::PageStreamBuf::underflow() {
+  if (gptr() < egptr()) {
+    return traits_type::to_int_type(*gptr());
+  }
 
-  uint64_t move_dst = 0;
-  bool moving = false;
+  size_t bytes = Fill();
+  if (bytes == 0) {
+    return traits_type::eof();
+  }
 
-  std::vector<char> read_buffer;
-  std::vector<uint32_t> new_order;
+  setg(out_buffer_.data(), out_buffer_.data(), out_buffer_.data() + bytes);
+  return traits_type::to_int_type(*gptr());
+}
 
-  auto old_order = header_.ListPages();
+bool PagedFile::PageStreamBuf::LoadChunkTable() {
+  char raw_trailer[kChunkTrailerSize];
+  const char *src = raw_trailer;
+  if (length_ < kChunkTrailerSize) {
+    return false;
+  }
+  ctx_->stats->CountRead(start_ + length_ - kChunkTrailerSize, kChunkTrailerSize);
+  if (ctx_->map) {
+    src = ctx_->map->Data() + start_ + length_ - kChunkTrailerSize;
+  } else if (ctx_->file.ReadAt(start_ + length_ - kChunkTrailerSize, raw_trailer,
+    kChunkTrailerSize) != kChunkTrailerSize) {
+    return false;
+  }
 
-  for (uint32_t idx : old_order) {
-    auto desc = header_.Desc(idx);
-    if ((desc->format & 0xff) != kFile) {  // can only remove file
-      new_order.push_back(idx);
-      continue;
+  ChunkTrailer trailer;
+  if (!ParseChunkTrailer(src, length_, trailer)
+    || trailer.uncompressed_length != content_length_) {
+    return false;
+  }
+  chunk_size_ = trailer.chunk_size;
+
+  // the table is 8 bytes per chunk, small next to the chunks it describes
+  chunk_offsets_.resize((size_t)trailer.num_chunks + 1);
+  size_t table_length = chunk_offsets_.size() * sizeof(uint64_t);
+  ctx_->stats->CountRead(start_ + trailer.table_offset, table_length);
+  if (ctx_->map) {
+    memcpy(chunk_offsets_.data(), ctx_->map->Data() + start_ + trailer.table_offset,
+      table_length);
+  } else if (ctx_->file.ReadAt(start_ + trailer.table_offset, chunk_offsets_.data(),
+    table_length) != table_length) {
+    return false;
+  }
+  return chunk_offsets_.back() <= trailer.table_offset;
+}
+
+bool PagedFile::PageStreamBuf::FetchInput() {
+  if (consumed_ >= length_) {
+    return false;
+  }
+
+  if (ctx_->map) {
+    src_ = ctx_->map->Data() + start_ + consumed_;
+    src_left_ = (size_t)(length_ - consumed_);
+  } else {
+    size_t bytes = (size_t)std::min<uint64_t>(in_buffer_.size(), length_ - consumed_);
+    if (ctx_->file.ReadAt(start_ + consumed_, in_buffer_.data(), bytes) != bytes) {
+      good_ = false;
+      return false;
     }
+    src_ = in_buffer_.data();
+    src_left_ = bytes;
+  }
+  ctx_->stats->CountRead(start_ + consumed_, src_left_);
+  consumed_ += src_left_;
+  return true;
+}
 
-    bool delete_page = (pages.find(idx) != pages.end());
+size_t PagedFile::PageStreamBuf::Fill() {
+  if (finished_ || !good_) {
+    return 0;
+  }
 
-    if (!moving) {  // not moving yet
-      if (delete_page) {
-        // remove page table entry
-        header_.page_table_.erase(idx);
+  if (!PagedFileHeader::IsCompressed(format_)) {
+    size_t bytes = (size_t)std::min<uint64_t>(out_buffer_.size(), length_ - consumed_);
+    if (bytes == 0 || ctx_->file.ReadAt(start_ + consumed_, out_buffer_.data(), bytes) != bytes) {
+      finished_ = true;
+      return 0;
+    }
+    ctx_->stats->CountRead(start_ + consumed_, bytes);
+    consumed_ += bytes;
+    return bytes;
+  }
 
-        // set moving head
-        move_dst = desc->start;
-        moving = true;
-      } else {
-        new_order.push_back(idx);
-      }
-    } else {
-      if (delete_page) {
-        header_.page_table_.erase(idx);
-      } else {
-        // move page
-        // read to memory
-        if (read_buffer.size() < desc->length) {
-          read_buffer.resize(desc->length);
-        }
-        fs_.seekg(desc->start, std::ios::beg);
-        fs_.read(&read_buffer[0], desc->length);
-        // write to move_dst
-        fs_.seekp(move_dst, std::ios::beg);
-        fs_.write(&read_buffer[0], desc->length);
-        // modify table entry
-        desc->start = move_dst;
-        new_order.push_back(idx);
+  if (format_ & kLZ4Chunked) {
+    if (next_chunk_ + 1 >= chunk_offsets_.size()) {
+      finished_ = true;
+      return 0;
+    }
+    uint64_t begin = chunk_offsets_[next_chunk_], end = chunk_offsets_[next_chunk_ + 1];
+    size_t chunk_length = (size_t)std::min<uint64_t>(chunk_size_,
+      content_length_ - (uint64_t)next_chunk_ * chunk_size_);
+    if (end < begin || end - begin > chunk_length) {
+      good_ = false;
+      finished_ = true;
+      return 0;
+    }
+
+    size_t stored_length = (size_t)(end - begin);
+    const char *stored = in_buffer_.data();
+    ctx_->stats->CountRead(start_ + begin, stored_length);
+    if (ctx_->map) {
+      stored = ctx_->map->Data() + start_ + begin;
+    } else if (ctx_->file.ReadAt(start_ + begin, in_buffer_.data(), stored_length)
+      != stored_length) {
+      good_ = false;
+      finished_ = true;
+      return 0;
+    }
+    IOStats::Timer timer(ctx_->stats.get(), IOStats::kDecompressNanos);
+    if (!DecodeChunk(stored, stored_length, out_buffer_.data(), chunk_length)) {
+      good_ = false;
+      finished_ = true;
+      return 0;
+    }
+    ++next_chunk_;
+    return chunk_length;
+  }
 
-        // push forward move head
-        move_dst += desc->length;
+  if (format_ & kChunkList) {
+    if (next_chunk_ >= chunk_pages_.size()) {
+      finished_ = true;
+      return 0;
+    }
+    PagedFileHeader::PageDesc chunk;
+    uint64_t chunk_length = 0;
+    if (ctx_->header->Locate(chunk_pages_[next_chunk_], chunk)) {
+      chunk_length = PagedFileHeader::IsCompressed(chunk.format) ?
+        chunk.uncompressed_length : chunk.length;
+      if (out_buffer_.size() < chunk_length) {
+        out_buffer_.resize((size_t)chunk_length);
       }
     }
+    if (chunk_length == 0
+      || ReadStoredPage(*ctx_, chunk, out_buffer_.data(), (size_t)chunk_length) != chunk_length) {
+      good_ = false;
+      finished_ = true;
+      return 0;
+    }
+    ++next_chunk_;
+    return (size_t)chunk_length;
   }
 
-  using std::swap;
-  swap(header_.page_order_, new_order);
+  // kLZ4Frame: decode until some output is produced or the frame ends
+  while (!finished_) {
+    if (src_left_ == 0 && !FetchInput()) {
+      finished_ = true;
+      return 0;
+    }
+
+    size_t dst_size = out_buffer_.size();
+    size_t src_size = src_left_;
+    size_t hint = 0;
+    {
+      IOStats::Timer timer(ctx_->stats.get(), IOStats::kDecompressNanos);
+      hint = LZ4F_decompress(dctx_, out_buffer_.data(), &dst_size, src_, &src_size, nullptr);
+    }
+    if (LZ4F_isError(hint)) {
+      // something went wrong, maybe data is corrupted
+      good_ = false;
+      finished_ = true;
+      return 0;
+    }
 
-  // set tail pos
-  if (moving) {
-    tail_pos_ = move_dst;
+    src_ += src_size;
+    src_left_ -= src_size;
+    if (hint == 0) {  // end of frame
+      finished_ = true;
+    }
+    if (dst_size > 0) {
+      return dst_size;
+    }
   }
+  return 0;
+}
 
-  return true;
+PagedFile::PageStream PagedFile::CreatePageStream(uint32_t idx) const {
+  if (!is_open_ || editing_page_ >= 0)
+    return {};
+
+  return CreatePageStreamFrom(ctx_, idx);
 }
 
-PagedFileHeader &PagedFile::Header() {
-  return header_;
+PagedFile::PageStream PagedFile::CreatePageStreamFrom(
+  const std::shared_ptr<const ReadContext> &ctx, uint32_t idx) {
+
+  PagedFileHeader::PageDesc desc;
+  if (!ctx->header->Locate(idx, desc) || desc.length == 0)
+    return {};
+
+  auto buffer = std::make_unique<PageStreamBuf>(ctx, desc);
+  if (!buffer->good())
+    return {};
+
+  // the content is counted up front, streams are often not read to the end
+  ctx->stats->CountPageRead(
+    PagedFileHeader::IsCompressed(desc.format) ? desc.uncompressed_length : desc.length);
+
+  return PageStream(std::move(buffer));
+}
+
+uint16_t PagedFile::ChooseCompressionFormat(size_t length, bool seekable) {
+  // large pages are stored as frames so they can be streamed with bounded memory,
+  // or chunked if they should also be readable at random offsets
+  static const size_t kMaxBlockPageSize = 4 * 1024 * 1024;
+  if (length <= kMaxBlockPageSize)
+    return kLZ4Block;
+  return seekable ? kLZ4Chunked : kLZ4Frame;
 }
 
 /////////////////////////////
-// input stream related
+// concurrent read handle
 
-PagedFile::PageInputStream::PageInputStream() :
-  std::istream(nullptr), buffer_(nullptr, nullptr) {
+PagedFileReader::PagedFileReader() {
 }
 
-PagedFile::PageInputStream::PageInputStream(std::shared_ptr<uint8_t> data, size_t size) :
-  std::istream(nullptr),
-  data_(data),
-  buffer_((char*)data.get(), (char*)data.get() + size) {
+PagedFileReader::PagedFileReader(std::shared_ptr<const PagedFile::ReadContext> ctx) :
+  ctx_(std::move(ctx)) {
+}
 
-  if (data && size) {
-    init(&buffer_);
+bool PagedFileReader::IsValid() const {
+  return ctx_ != nullptr;
+}
+
+const PagedFileHeader &PagedFileReader::Header() const {
+  if (!ctx_) {
+    static const PagedFileHeader empty_header;
+    return empty_header;
   }
+  return *ctx_->header;
 }
 
-PagedFile::PageInputStream::PageInputStream(PageInputStream &&rhs) :
-  std::istream(std::move(rhs)), buffer_(nullptr, nullptr) {
-  using std::swap;
-  swap(data_, rhs.data_);
-  swap(buffer_, rhs.buffer_);
-  set_rdbuf(&buffer_);
+uint64_t PagedFileReader::ReadPage(uint32_t idx, char *buffer, size_t buffer_size) const {
+  if (!ctx_)
+    return 0;
+
+  return PagedFile::ReadPageFrom(*ctx_, idx, buffer, buffer_size);
+}
+
+uint64_t PagedFileReader::ReadPageRange(uint32_t idx, uint64_t offset, char *buffer,
+  size_t length) const {
+  if (!ctx_)
+    return 0;
+
+  return PagedFile::ReadPageRangeFrom(*ctx_, idx, offset, buffer, length);
 }
 
-PagedFile::PageInputStream PagedFile::CreatePageIStream(uint32_t idx) {
-  uint64_t length = 0, uncompressed_length = 0;
-  if (!header_.PageLength(idx, length, uncompressed_length) || length == 0)
+PagedFile::PageStream PagedFileReader::CreatePageStream(uint32_t idx) const {
+  if (!ctx_)
     return {};
 
-  uint16_t format = header_.PageFormat(idx);
-  uint64_t data_length = length;
-  if (PagedFileHeader::IsCompressed(format)) {
-    data_length = uncompressed_length;
-  }
-  std::shared_ptr<uint8_t> data(new uint8_t[data_length], std::default_delete<uint8_t[]>());
+  return PagedFile::CreatePageStreamFrom(ctx_, idx);
+}
+
+PagedFile::PageView PagedFileReader::ViewPage(uint32_t idx) const {
+  if (!ctx_)
+    return {};
+
+  return PagedFile::ViewPageFrom(*ctx_, idx);
+}
+
+bool PagedFileReader::ExtractPageTo(uint32_t idx, int fd) const {
+  if (!ctx_)
+    return false;
+
+  return PagedFile::ExtractPageToFrom(ctx_, idx, fd);
+}
+
+PagedFile::PageInputStream PagedFileReader::CreatePageIStream(uint32_t idx) const {
+  if (!ctx_)
+    return {};
+
+  return PagedFile::CreatePageIStreamFrom(ctx_, idx);
+}
 
-  ReadPage(idx, (char*)data.get(), data_length);
+PagedFile::PageHandle PagedFileReader::LoadPage(uint32_t idx) const {
+  if (!ctx_)
+    return {};
+
+  return PagedFile::LoadPageFrom(*ctx_, idx);
+}
+
+bool PagedFileReader::ReadPages(const std::vector<uint32_t> &pages,
+  const PagedFile::PageCallback &callback) const {
+  if (!ctx_)
+    return false;
+
+  return PagedFile::ReadPagesFrom(*ctx_, pages, callback);
+}
+
+bool PagedFileReader::ReadPages(const std::vector<uint32_t> &pages,
+  std::vector<PagedFile::PageHandle> &handles) const {
+  handles.assign(pages.size(), PagedFile::PageHandle());
+  return ReadPages(pages, [&](size_t i, PagedFile::PageHandle page) {
+    handles[i] = std::move(page);
+  });
+}
+
+PageCache::Stats PagedFileReader::CacheStats() const {
+  if (!ctx_)
+    return {};
+
+  return ctx_->cache.GetStats();
+}
+
+IOStats::Counters PagedFileReader::Stats() const {
+  if (!ctx_)
+    return {};
 
-  return PageInputStream(std::move(data), data_length);
+  return ctx_->stats->Get();
 }
 
-uint16_t PagedFile::ChooseCompressionFormat(size_t length) {
-  return length <= LZ4_MAX_INPUT_SIZE ? kLZ4Block : kLZ4Frame;
+int32_t PagedFileReader::VerifyPage(uint32_t idx) const {
+  if (!ctx_)
+    return PagedFile::kVerifyFailed;
+
+  return PagedFile::VerifyPageFrom(ctx_, idx);
 }
 
 }
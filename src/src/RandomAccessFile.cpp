@@ -0,0 +1,588 @@
+#include "stdafx.h"
+#include <pagedfile/RandomAccessFile.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define PFAR_HAVE_IO_URING 1
+#endif
+#endif
+#elif _WIN32
+#include <windows.h>
+#endif
+
+namespace pagedfile {
+
+#ifdef PFAR_HAVE_IO_URING
+
+namespace {
+
+/**
+ * @brief IORing
+ * @details Minimal io_uring for reads, set up through the raw system calls so
+ * no liburing is needed. Only used by one thread at a time.
+ */
+class IORing {
+public:
+  IORing() = default;
+  ~IORing() {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+      munmap(sq_ring_, sq_size_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  IORing(const IORing &) = delete;
+  IORing &operator=(const IORing &) = delete;
+
+  bool Init(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd_ = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd_ < 0) {
+      return false;  // old kernel, or forbidden by a sandbox
+    }
+
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+    sq_ring_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      return false;
+    }
+    cq_ring_ = single_mmap ? sq_ring_ : mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      return false;
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+      return false;
+    }
+
+    char *sq = (char *)sq_ring_;
+    sq_tail_ = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask_ = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array_ = (unsigned *)(sq + params.sq_off.array);
+    char *cq = (char *)cq_ring_;
+    cq_head_ = (unsigned *)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask_ = *(unsigned *)(cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+    entries_ = params.sq_entries;
+    return true;
+  }
+
+  unsigned Entries() const {
+    return entries_;
+  }
+
+  // queue a read, the caller keeps at most Entries() of them in flight
+  void PrepareRead(int fd, uint64_t offset, void *buffer, uint32_t length, uint64_t tag) {
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe *sqe = (io_uring_sqe *)sqes_ + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->user_data = tag;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++pending_;
+  }
+
+  unsigned Pending() const {
+    return pending_;
+  }
+
+  // wait for a completion without submitting anything
+  bool Wait() {
+    while (true) {
+      int ret = (int)syscall(__NR_io_uring_enter, fd_, 0u, 1u, IORING_ENTER_GETEVENTS,
+        nullptr, 0);
+      if (ret >= 0) {
+        return true;
+      } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        return false;
+      }
+    }
+  }
+
+  // submit queued reads and wait for at least min_complete completions
+  bool Enter(unsigned min_complete) {
+    while (true) {
+      int ret = (int)syscall(__NR_io_uring_enter, fd_, pending_, min_complete,
+        min_complete != 0 ? IORING_ENTER_GETEVENTS : 0u, nullptr, 0);
+      if (ret >= 0) {
+        pending_ -= std::min(pending_, (unsigned)ret);
+        if (pending_ == 0 || min_complete != 0) {
+          return true;
+        }
+      } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        return false;
+      }
+    }
+  }
+
+  // hand every completion to done(tag, result), returns how many there were
+  template <typename Fn>
+  unsigned Reap(Fn &&done) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+    for (; head != tail; ++head, ++count) {
+      const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+      done(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+private:
+  int fd_ {-1};
+  void *sq_ring_ {MAP_FAILED};
+  void *cq_ring_ {MAP_FAILED};
+  void *sqes_ {MAP_FAILED};
+  size_t sq_size_ {0};
+  size_t cq_size_ {0};
+  size_t sqes_size_ {0};
+  unsigned *sq_tail_ {nullptr};
+  unsigned sq_mask_ {0};
+  unsigned *sq_array_ {nullptr};
+  unsigned *cq_head_ {nullptr};
+  unsigned *cq_tail_ {nullptr};
+  unsigned cq_mask_ {0};
+  io_uring_cqe *cqes_ {nullptr};
+  unsigned entries_ {0};
+  unsigned pending_ {0};  // queued but not yet submitted
+};
+
+// rings are kept per thread and reused by every ReadBatch on it, a ring is only
+// set up again to grow. Failed setups are not retried
+thread_local std::unique_ptr<IORing> thread_ring;
+thread_local bool thread_ring_unavailable = false;
+thread_local bool thread_ring_busy = false;  // a batch is running on this thread
+
+IORing *ThreadRing(unsigned entries) {
+  if (thread_ring_unavailable) {
+    return nullptr;
+  }
+  if (!thread_ring || thread_ring->Entries() < entries) {
+    thread_ring.reset();
+    auto ring = std::make_unique<IORing>();
+    if (!ring->Init(entries)) {
+      thread_ring_unavailable = true;  // old kernel, or forbidden by a sandbox
+      return nullptr;
+    }
+    thread_ring = std::move(ring);
+  }
+  return thread_ring.get();
+}
+
+}  // namespace
+
+#endif
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+
+namespace {
+
+size_t ReadFully(int fd, uint64_t offset, char *dst, size_t length) {
+  size_t total = 0;
+  while (total < length) {
+    ssize_t bytes = pread(fd, dst + total, length - total, (off_t)(offset + total));
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (bytes == 0) {  // end of file
+      break;
+    }
+    total += (size_t)bytes;
+  }
+  return total;
+}
+
+}  // namespace
+
+RandomAccessFile::RandomAccessFile() : fd_(-1), direct_fd_(-1) {
+}
+
+RandomAccessFile::~RandomAccessFile() {
+  Close();
+}
+
+bool RandomAccessFile::Open(const char *fn, bool direct_reads) {
+  if (fd_ >= 0 || fn == nullptr) {
+    return false;
+  }
+  fd_ = open(fn, O_RDONLY);
+  if (fd_ >= 0 && direct_reads) {
+    // a second descriptor, so short reads keep using the page cache
+#if defined(O_DIRECT)
+    direct_fd_ = open(fn, O_RDONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+    direct_fd_ = open(fn, O_RDONLY);
+    if (direct_fd_ >= 0 && fcntl(direct_fd_, F_NOCACHE, 1) != 0) {
+      close(direct_fd_);
+      direct_fd_ = -1;
+    }
+#endif
+  }
+  return fd_ >= 0;
+}
+
+void RandomAccessFile::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  if (direct_fd_ >= 0) {
+    close(direct_fd_);
+    direct_fd_ = -1;
+  }
+}
+
+bool RandomAccessFile::IsOpen() const {
+  return fd_ >= 0;
+}
+
+bool RandomAccessFile::DirectReads() const {
+  return direct_fd_ >= 0;
+}
+
+size_t RandomAccessFile::ReadAt(uint64_t offset, void *buffer, size_t length) const {
+  if (direct_fd_ >= 0 && length >= kMinDirectRead) {
+    return ReadDirect(offset, (char *)buffer, length);
+  }
+  return ReadFully(fd_, offset, (char *)buffer, length);
+}
+
+// O_DIRECT transfers whole blocks between aligned buffers, anything else is read
+// through a bounce buffer covering the blocks around it
+size_t RandomAccessFile::ReadDirect(uint64_t offset, char *buffer, size_t length) const {
+  enum { kBounceSize = 1024 * 1024 };
+  const uint64_t block = kDirectBlockSize;
+  std::vector<char> bounce_storage;
+  char *bounce = nullptr;
+
+  size_t total = 0;
+  while (total < length) {
+    uint64_t pos = offset + total;
+    char *dst = buffer + total;
+    size_t left = length - total;
+    ssize_t bytes = 0;
+    if (pos % block == 0 && (uintptr_t)dst % block == 0 && left >= block) {
+      // aligned whole blocks go straight into the caller's buffer
+      bytes = pread(direct_fd_, dst, left - left % block, (off_t)pos);
+      if (bytes > 0) {
+        total += (size_t)bytes;
+        continue;
+      }
+    } else {
+      if (bounce == nullptr) {
+        bounce_storage.resize(kBounceSize + block);
+        uintptr_t misalignment = (uintptr_t)bounce_storage.data() % block;
+        bounce = bounce_storage.data() + (misalignment != 0 ? block - misalignment : 0);
+      }
+      uint64_t base = pos - pos % block;
+      size_t span = (size_t)std::min<uint64_t>(kBounceSize,
+        (pos + left + block - 1) / block * block - base);
+      bytes = pread(direct_fd_, bounce, span, (off_t)base);
+      if (bytes > (ssize_t)(pos - base)) {
+        size_t useful = std::min<size_t>(left, (size_t)bytes - (size_t)(pos - base));
+        memcpy(dst, bounce + (pos - base), useful);
+        total += useful;
+        continue;
+      }
+      if (bytes > 0) {
+        break;  // end of file
+      }
+    }
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0) {
+      // refused by the file system after all, read the rest through the cache
+      total += ReadFully(fd_, pos, dst, left);
+    }
+    break;
+  }
+  return total;
+}
+
+bool RandomAccessFile::ReadBatch(const std::vector<ReadRequest> &requests, unsigned depth,
+  const std::function<std::shared_ptr<char>(size_t)> &buffer,
+  const std::function<void(size_t, size_t)> &done) const {
+#ifdef PFAR_HAVE_IO_URING
+  // a batch started from a callback of another one falls back to ReadAt
+  if (fd_ < 0 || direct_fd_ >= 0 || requests.empty() || thread_ring_busy) {
+    return false;
+  }
+  IORing *ring = ThreadRing(std::max(depth, 1u));
+  if (ring == nullptr) {
+    return false;
+  }
+  thread_ring_busy = true;
+  struct Release {
+    ~Release() {
+      thread_ring_busy = false;
+    }
+  } release;
+
+  // a read is limited to 32 bits, larger ranges are read by ReadAt
+  const size_t kMaxRingRead = (size_t)1 << 30;
+  std::vector<std::shared_ptr<char>> buffers(requests.size());
+  std::vector<bool> completed(requests.size(), false);
+  auto complete = [&](size_t i, size_t bytes) {
+    const auto &request = requests[i];
+    if (bytes < request.length) {
+      // short at the end of the file or failed, take the rest the slow way
+      bytes += ReadAt(request.offset + bytes, buffers[i].get() + bytes, request.length - bytes);
+    }
+    completed[i] = true;
+    done(i, bytes);
+    buffers[i].reset();
+  };
+
+  auto reap = [&](uint64_t i, int32_t result) {
+    complete((size_t)i, result > 0 ? (size_t)result : 0);
+  };
+
+  size_t next = 0, in_flight = 0;
+  bool failed = false;
+  while (next < requests.size() || in_flight != 0) {
+    while (next < requests.size() && in_flight < ring->Entries()) {
+      buffers[next] = buffer(next);
+      const auto &request = requests[next];
+      if (request.length > kMaxRingRead) {
+        complete(next, 0);
+      } else {
+        ring->PrepareRead(fd_, request.offset, buffers[next].get(), (uint32_t)request.length,
+          next);
+        ++in_flight;
+      }
+      ++next;
+    }
+    if (in_flight == 0) {
+      continue;
+    }
+    if (!ring->Enter(1)) {
+      failed = true;
+      break;
+    }
+    in_flight -= ring->Reap(reap);
+  }
+
+  if (failed) {
+    // reads the kernel accepted may still land in their buffers, they must all
+    // complete before a buffer is read again or handed out
+    size_t submitted = in_flight - ring->Pending();
+    while (submitted != 0) {
+      if (!ring->Wait()) {
+        // the kernel may still write into the buffers of the reads it holds, so they
+        // are left to it with the ring, never freed, and the reads are done again.
+        // This thread does not set up another ring
+        struct Abandoned {
+          std::unique_ptr<IORing> ring;
+          std::vector<std::shared_ptr<char>> buffers;
+        };
+        auto *abandoned = new Abandoned {std::move(thread_ring), {}};
+        for (size_t i = 0; i < next; ++i) {
+          if (!completed[i] && buffers[i]) {
+            abandoned->buffers.push_back(std::move(buffers[i]));
+          }
+        }
+        thread_ring_unavailable = true;
+        break;
+      }
+      submitted -= ring->Reap(reap);
+    }
+    // reads that were queued but never submitted would go out with the next batch
+    thread_ring.reset();
+  }
+
+  // the ring failed, read everything left over synchronously
+  for (size_t i = 0; i < requests.size(); ++i) {
+    if (!completed[i]) {
+      if (!buffers[i]) {
+        buffers[i] = buffer(i);
+      }
+      complete(i, 0);
+    }
+  }
+  return true;
+#else
+  (void)requests;
+  (void)depth;
+  (void)buffer;
+  (void)done;
+  return false;
+#endif
+}
+
+uint64_t RandomAccessFile::Size() const {
+  struct stat st;
+  if (fd_ < 0 || fstat(fd_, &st) != 0) {
+    return 0;
+  }
+  return (uint64_t)st.st_size;
+}
+
+uint64_t RandomAccessFile::CopyTo(uint64_t offset, uint64_t length, int fd) const {
+#if defined(__linux__)
+  // both calls are limited to a little under 2 GiB
+  const size_t kMaxCopy = (size_t)1 << 30;
+  uint64_t copied = 0;
+  bool ranges = true;  // copy_file_range is refused across file systems by older kernels
+  while (fd_ >= 0 && copied < length) {
+    size_t bytes = (size_t)std::min<uint64_t>(kMaxCopy, length - copied);
+    long ret = -1;
+#if defined(SYS_copy_file_range)
+    if (ranges) {
+      int64_t in = (int64_t)(offset + copied);
+      ret = syscall(SYS_copy_file_range, fd_, &in, fd, nullptr, bytes, 0u);
+      if (ret < 0 && errno != EINTR) {
+        ranges = false;
+      }
+    }
+#else
+    ranges = false;
+#endif
+    if (!ranges) {
+      off_t in = (off_t)(offset + copied);
+      ret = (long)sendfile(fd, fd_, &in, bytes);
+    }
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      break;
+    }
+    copied += (uint64_t)ret;
+  }
+  return copied;
+#else
+  (void)offset;
+  (void)length;
+  (void)fd;
+  return 0;
+#endif
+}
+
+#elif _WIN32
+
+RandomAccessFile::RandomAccessFile() : handle_(INVALID_HANDLE_VALUE) {
+}
+
+RandomAccessFile::~RandomAccessFile() {
+  Close();
+}
+
+bool RandomAccessFile::Open(const char *fn, bool direct_reads) {
+  (void)direct_reads;  // reads stay buffered
+  if (handle_ != INVALID_HANDLE_VALUE || fn == nullptr) {
+    return false;
+  }
+  handle_ = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  return handle_ != INVALID_HANDLE_VALUE;
+}
+
+void RandomAccessFile::Close() {
+  if (handle_ != INVALID_HANDLE_VALUE) {
+    CloseHandle(handle_);
+    handle_ = INVALID_HANDLE_VALUE;
+  }
+}
+
+bool RandomAccessFile::IsOpen() const {
+  return handle_ != INVALID_HANDLE_VALUE;
+}
+
+bool RandomAccessFile::DirectReads() const {
+  return false;
+}
+
+size_t RandomAccessFile::ReadAt(uint64_t offset, void *buffer, size_t length) const {
+  size_t total = 0;
+  char *dst = (char *)buffer;
+  while (total < length) {
+    // offsets passed through OVERLAPPED make ReadFile positional
+    OVERLAPPED ov = {};
+    uint64_t pos = offset + total;
+    ov.Offset = (DWORD)(pos & 0xffffffff);
+    ov.OffsetHigh = (DWORD)(pos >> 32);
+    DWORD chunk = (DWORD)std::min<size_t>(length - total, 0x40000000);
+    DWORD bytes = 0;
+    if (!ReadFile(handle_, dst + total, chunk, &bytes, &ov) || bytes == 0) {
+      break;
+    }
+    total += bytes;
+  }
+  return total;
+}
+
+bool RandomAccessFile::ReadBatch(const std::vector<ReadRequest> &requests, unsigned depth,
+  const std::function<std::shared_ptr<char>(size_t)> &buffer,
+  const std::function<void(size_t, size_t)> &done) const {
+  (void)requests;
+  (void)depth;
+  (void)buffer;
+  (void)done;
+  return false;
+}
+
+uint64_t RandomAccessFile::Size() const {
+  LARGE_INTEGER size;
+  if (handle_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(handle_, &size)) {
+    return 0;
+  }
+  return (uint64_t)size.QuadPart;
+}
+
+uint64_t RandomAccessFile::CopyTo(uint64_t offset, uint64_t length, int fd) const {
+  (void)offset;
+  (void)length;
+  (void)fd;
+  return 0;
+}
+
+#endif
+
+}  // namespace
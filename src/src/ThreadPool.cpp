@@ -0,0 +1,105 @@
+#include "stdafx.h"
+#include <pagedfile/ThreadPool.h>
+#include <algorithm>
+
+namespace pagedfile {
+
+ThreadPool::ThreadPool(unsigned threads) :
+  stop_(false) {
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // the caller of ParallelFor is one of the threads
+  for (unsigned i = 1; i < threads; ++i) {
+    workers_.emplace_back(&ThreadPool::WorkerMain, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto &t : workers_) {
+    t.join();
+  }
+}
+
+unsigned ThreadPool::Size() const {
+  return (unsigned)workers_.size() + 1;
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)> &task) {
+  if (count == 0) {
+    return;
+  }
+  if (count == 1 || workers_.empty()) {
+    for (size_t i = 0; i < count; ++i) {
+      task(i);
+    }
+    return;
+  }
+
+  auto loop = std::make_shared<Loop>();
+  loop->task = &task;
+  loop->count = count;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    loops_.push_back(loop);
+  }
+  wake_.notify_all();
+
+  Work(*loop);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = std::find(loops_.begin(), loops_.end(), loop);
+    if (iter != loops_.end()) {
+      loops_.erase(iter);
+    }
+  }
+
+  // workers may still be finishing the iterations they picked up
+  std::unique_lock<std::mutex> lock(loop->mutex);
+  loop->done.wait(lock, [&]() { return loop->finished == loop->count; });
+}
+
+void ThreadPool::Work(Loop &loop) {
+  size_t finished = 0;
+  for (size_t i = loop.next++; i < loop.count; i = loop.next++) {
+    (*loop.task)(i);
+    ++finished;
+  }
+
+  if (finished != 0) {
+    std::lock_guard<std::mutex> lock(loop.mutex);
+    loop.finished += finished;
+    if (loop.finished == loop.count) {
+      loop.done.notify_all();
+    }
+  }
+}
+
+void ThreadPool::WorkerMain() {
+  while (true) {
+    std::shared_ptr<Loop> loop;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [&]() { return stop_ || !loops_.empty(); });
+      if (stop_) {
+        return;
+      }
+      loop = loops_.front();
+      // exhausted loops are dropped here so workers move on to the next one
+      if (loop->next.load() >= loop->count) {
+        loops_.pop_front();
+        continue;
+      }
+    }
+    Work(*loop);
+  }
+}
+
+}  // namespace
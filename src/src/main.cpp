@@ -3,11 +3,26 @@
 #include <fstream>
 #include <algorithm>
 #include <filesystem>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <set>
 #include <boost/algorithm/string.hpp>
 #include <boost/program_options.hpp>
 #include <pagedfile/PagedFile.h>
+#include <pagedfile/Checksum.h>
 #include "version.h"
 
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+#include <fcntl.h>
+#include <unistd.h>
+#elif _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
 using namespace pagedfile;
 namespace po = boost::program_options;
 namespace fs = std::filesystem;
@@ -65,70 +80,94 @@ public:
 
     // do actual packing
     PagedFile pf;
+    pf.SetRecover(vm_["recover"].as<bool>());
+    pf.SetJournalAppends(vm_["journal"].as<bool>());
+    pf.SetDeduplicate(vm_["dedup"].as<bool>());
+    bool direct = vm_["direct"].as<bool>();
+    unsigned alignment = vm_["align"].as<unsigned>();
+    if (alignment == 0 && direct) {
+      alignment = RandomAccessFile::kDirectBlockSize;  // direct writes need whole blocks
+    }
+    if (alignment != 0 && !pf.SetAlignment(alignment)) {
+      std::cerr << "Error: alignment must be a power of two!" << std::endl;
+      return 1;
+    }
+    pf.SetDirectIO(direct);
     if (!pf.Open(archive_fn.c_str(), open_mode)) {
       std::cerr << "Error: failed to open archive file!" << std::endl;
       return 1;
     }
 
+    if (vm_["table-v2"].as<bool>()) {
+      pf.Header().SetVersion(PagedFileHeader::kVersion2);
+    }
+
     if (appending) {
-      std::vector<uint32_t> indices = pf.Header().ListPages();
-      if (indices.size() != 0) {
-        auto max_iter = std::max_element(indices.begin(), indices.end());
-        idx_shift = *max_iter + 1;
+      // chunk pages count down from the top of the index range
+      for (uint32_t idx : pf.Header().ListPages()) {
+        if ((pf.Header().PageFormat(idx) & 0xff) != PagedFile::kChunk) {
+          idx_shift = std::max(idx_shift, idx + 1);
+        }
       }
     }
 
-    std::ifstream infile;
-    std::vector<char> input_buffer;
-
     bool print = vm_["verbose"].as<bool>();
     bool compress = vm_["compress"].as<bool>();
+    bool seekable = vm_["seekable"].as<bool>();
+    unsigned jobs = Jobs();
+    if (vm_["commit-every"].as<unsigned>() != 0 && !pf.BeginBatch()) {
+      std::cerr << "Error: failed to start a batch!" << std::endl;
+      return 1;
+    }
 
-    for (uint32_t idx = 0; idx < filenames.size(); ++idx) {
-      auto &entry = filenames[idx];
-      uint32_t new_idx = idx + idx_shift;
-
-      if (entry.type == PagedFile::kDirectory) {
-        // is directory
-        if (print) {
-          std::cout << entry.absolute_path << " [dir]" << std::endl;
-        }
-        pf.NewMetaPage(new_idx, PagedFile::kDirectory, entry.relative_path);
-
-      } else if (entry.type == PagedFile::kFile) {
-        // is file
-        infile.open(entry.absolute_path, std::ios::binary);
-        if (!infile.good())
-          continue;
-
-        // check input file length and resize buffer
-        infile.seekg(0, std::ios::end);
-        uint64_t input_length = infile.tellg();
-        if (input_length > input_buffer.size()) {
-          input_buffer.resize(input_length);
-        }
-
-        // read content to buffer
-        infile.seekg(0, std::ios::beg);
-        infile.read(&input_buffer[0], input_length);
-        infile.close();
-
-        auto relative_path = entry.relative_path;
-        std::replace(relative_path.begin(), relative_path.end(), '\\', '/');
-        // write input buffer to a page
-        if (print) {
-          std::cout << entry.absolute_path << std::endl;
-        }
-
-        if (compress) {
-          auto format = PagedFile::ChooseCompressionFormat(input_length);
-          pf.AppendPage(new_idx, relative_path, format | PagedFile::kFile,
-            &input_buffer[0], input_length, print);
-        } else {
-          pf.NewPage(new_idx, relative_path);
-          pf.Write(&input_buffer[0], input_length);
-          pf.EndNewPage();
+    if (jobs > 1) {
+      PackPipelined(pf, filenames, idx_shift, compress, seekable, print, jobs);
+    } else {
+      MappedFile input_map;
+      std::vector<char> input_buffer;
+      for (uint32_t idx = 0; idx < filenames.size(); ++idx) {
+        auto &entry = filenames[idx];
+        uint32_t new_idx = idx + idx_shift;
+
+        if (entry.type == PagedFile::kDirectory) {
+          // is directory
+          if (print) {
+            std::cout << entry.absolute_path << " [dir]" << std::endl;
+          }
+          pf.NewMetaPage(new_idx, PagedFile::kDirectory, entry.relative_path);
+
+        } else if (entry.type == PagedFile::kFile) {
+          // is file
+          std::error_code ec;
+          uint64_t input_length = fs::file_size(entry.absolute_path, ec);
+          if (ec)
+            continue;
+
+          if (print) {
+            std::cout << entry.absolute_path << std::endl;
+          }
+
+          auto relative_path = PageName(entry);
+          uint16_t format = compress ?
+            PagedFile::ChooseCompressionFormat(input_length, seekable) : (uint16_t)PagedFile::kPlain;
+          if (ChunkInput(input_length)) {
+            format = PagedFile::kChunkList;
+          }
+          if (format == PagedFile::kLZ4Block) {
+            // small inputs are compressed as a single block
+            const char *input_data = nullptr;
+            if (!LoadInputFile(entry.absolute_path, input_map, input_buffer, input_data,
+              input_length))
+              continue;
+            pf.AppendPage(new_idx, relative_path, format | PagedFile::kFile,
+              input_data, input_length, print);
+            input_map.Close();
+          } else {
+            StreamInputFile(pf, new_idx, relative_path, entry.absolute_path, format,
+              input_buffer, print, vm_["dedup"].as<bool>());
+          }
         }
+        CommitProgress(pf, idx + 1);
       }
     }
 
@@ -172,8 +211,15 @@ public:
 
     bool print = vm_["verbose"].as<bool>();
 
+    // large chunked pages are also decoded on the worker threads. Direct reads
+    // need positional reads instead of the mapping
     PagedFile pf;
-    if (!pf.Open(archive_fn.c_str(), PagedFile::kReadOnly)) {
+    pf.SetRecover(vm_["recover"].as<bool>());
+    pf.SetDecodeThreads(Jobs());
+    bool direct = vm_["direct"].as<bool>();
+    pf.SetDirectIO(direct);
+    int32_t open_mode = direct ? PagedFile::kReadOnly : PagedFile::kReadOnlyMapped;
+    if (!pf.Open(archive_fn.c_str(), open_mode)) {
       std::cerr << "Error: failed to load paged file. Corrupted?" << std::endl;
       return 1;
     }
@@ -206,51 +252,35 @@ public:
     }
 
     // extract files
-    uint64_t page_length = 0, uncompressed_length = 0;
-    std::ofstream outfile;
-    std::vector<char> input_buffer;
-
+    std::vector<uint32_t> file_list;
     for (uint32_t idx : index_list) {
-      uint16_t format = pf.Header().PageFormat(idx);
-      if ((format & 0xff) != PagedFile::kFile)
-        continue;
-
-      output_path = output_base / pf.Header().PageName(idx);
-      pf.Header().PageLength(idx, page_length, uncompressed_length);
-
-      if (print) {
-        std::cout << "extract file: " << output_path << std::endl;
+      if ((pf.Header().PageFormat(idx) & 0xff) == PagedFile::kFile) {
+        file_list.push_back(idx);
       }
+    }
 
-      size_t output_length = 0;
-
-      // read file content
-      if (PagedFileHeader::IsCompressed(format)) {
-        auto max_size = std::max(uncompressed_length, page_length);
-        if (max_size > input_buffer.size()) {
-          input_buffer.resize(max_size);
-        }
-        if (!pf.ReadPage(idx, &input_buffer[0], max_size)) {
-          std::cerr << "Error: failed to read page " << output_path.string() << std::endl;
-          continue;
-        }
-        output_length = uncompressed_length;
-      } else {
-        if (page_length > input_buffer.size()) {
-          input_buffer.resize(page_length);
-        }
-        pf.GoToPage(idx);
-        pf.Read(&input_buffer[0], page_length);
-        output_length = page_length;
+    auto reader = pf.CreateReader();
+    unsigned jobs = std::min<size_t>(Jobs(), std::max<size_t>(file_list.size(), 1));
+    if (jobs > 1) {
+      // directories already exist, so workers can write files in any order
+      std::atomic<size_t> next_file {0};
+      std::mutex print_mutex;
+      std::vector<std::thread> workers;
+      for (unsigned t = 0; t < jobs; ++t) {
+        workers.emplace_back([&]() {
+          for (size_t i = next_file++; i < file_list.size(); i = next_file++) {
+            ExtractFile(reader, file_list[i], output_base, print ? &print_mutex : nullptr);
+          }
+        });
       }
-
-      outfile.open(output_path.string().c_str(), std::ios::binary);
-      if (!outfile.good()) {
-        std::cerr << "Error: failed to write to " << output_path.string() << std::endl;
-        continue;
+      for (auto &t : workers) {
+        t.join();
+      }
+    } else {
+      std::mutex print_mutex;
+      for (uint32_t idx : file_list) {
+        ExtractFile(reader, idx, output_base, print ? &print_mutex : nullptr);
       }
-      outfile.write(&input_buffer[0], output_length);
-      outfile.close();
     }
 
     pf.Close();
@@ -268,7 +298,8 @@ public:
     }
 
     PagedFile pf;
-    if (!pf.Open(archive_fn.c_str(), PagedFile::kReadOnly)) {
+    pf.SetRecover(vm_["recover"].as<bool>());
+    if (!pf.Open(archive_fn.c_str(), PagedFile::kReadOnlyMapped)) {
       std::cerr << "Error: failed to load paged file. Corrupted?" << std::endl;
       return 1;
     }
@@ -280,13 +311,21 @@ public:
 
     auto index_list = pf.Header().ListPages(prefix);
     for (uint32_t idx : index_list) {
-      std::cout << pf.Header().PageName(idx);
       uint16_t format = pf.Header().PageFormat(idx);
+      if ((format & 0xff) == PagedFile::kChunk) {
+        continue;  // part of the files listing it
+      }
+      std::cout << pf.Header().PageName(idx);
       if ((format & 0xff) == PagedFile::kDirectory) {
         std::cout << " [dir]";
       } else if ((format & 0xff) == PagedFile::kFile) {
         uint64_t length = 0, uncompressed_length = 0;
         pf.Header().PageLength(idx, length, uncompressed_length);
+        if (format & PagedFile::kChunkList) {
+          // the stored bytes are only the chunk list
+          std::cout << "\t(" << uncompressed_length << " in chunks)" << std::endl;
+          continue;
+        }
         std::cout << "\t(" << length;
         if (PagedFileHeader::IsCompressed(format)) {
           std::cout << "/" << uncompressed_length << " "
@@ -297,6 +336,14 @@ public:
       std::cout << std::endl;
     }
 
+    if (vm_["verbose"].as<bool>()) {
+      std::cout << "dead space: " << pf.Header().DeadBytes() << " bytes ("
+        << (int)(pf.Header().DeadRatio() * 100) << "%)" << std::endl;
+      if (pf.Header().Alignment() > 1) {
+        std::cout << "alignment: " << pf.Header().Alignment() << " bytes" << std::endl;
+      }
+    }
+
     pf.Close();
 
     return 0;
@@ -316,37 +363,441 @@ public:
       std::cerr << "Error: please specify filenames to delete!" << std::endl;
       return 1;
     }
-    std::unordered_set<std::string> fn_set;
-    fn_set.insert(cli_fns.begin(), cli_fns.end());
 
     // open file to manipulate content
     PagedFile pf;
+    pf.SetRecover(vm_["recover"].as<bool>());
+    pf.SetJournalAppends(vm_["journal"].as<bool>());
     if (!pf.Open(archive_fn.c_str(), PagedFile::kReadWrite)) {
       std::cerr << "Error: failed to load paged file. Corrupted?" << std::endl;
       return 1;
     }
 
-    auto index_list = pf.Header().ListPages();
+    // resolve names through the header's name index, duplicates are all removed
     std::unordered_set<uint32_t> delete_indices;
-
-    for (uint32_t idx : index_list) {
-      if (fn_set.find(pf.Header().PageName(idx)) != fn_set.end()) {
-        delete_indices.insert(idx);
+    for (const auto &fn : cli_fns) {
+      for (uint32_t idx : pf.Header().ListPages(fn)) {
+        if (pf.Header().PageName(idx) == fn) {
+          delete_indices.insert(idx);
+        }
       }
     }
 
     if (delete_indices.size() != 0) {
-      pf.RemovePages(delete_indices);
+      pf.RemovePages(delete_indices, vm_["tombstone"].as<bool>() ?
+        PagedFile::kRemoveTombstone : PagedFile::kRemoveCompact);
+    }
+
+    pf.Close(true);
+    return 0;
+  }
+
+  int Compact() {
+    auto archive_fn = vm_["compact"].as<std::string>();
+    fs::path archive_path(archive_fn);
+    if (!fs::exists(archive_path) || !fs::is_regular_file(archive_path)) {
+      std::cerr << "Error: archive does not exist!" << std::endl;
+      return 1;
+    }
+
+    PagedFile pf;
+    pf.SetRecover(vm_["recover"].as<bool>());
+    if (!pf.Open(archive_fn.c_str(), PagedFile::kReadWrite)) {
+      std::cerr << "Error: failed to load paged file. Corrupted?" << std::endl;
+      return 1;
     }
 
+    uint64_t dead = pf.Header().DeadBytes();
+    if (dead != 0 && !pf.Compact()) {
+      std::cerr << "Error: failed to compact archive!" << std::endl;
+      pf.Close(false);
+      return 1;
+    }
     pf.Close(true);
+
+    std::cout << "Reclaimed " << dead << " bytes." << std::endl;
     return 0;
   }
 
+  int Verify() {
+    auto archive_fn = vm_["verify"].as<std::string>();
+    fs::path archive_path(archive_fn);
+    if (!fs::exists(archive_path) || !fs::is_regular_file(archive_path)) {
+      std::cerr << "Error: archive does not exist!" << std::endl;
+      return 1;
+    }
+
+    // positional reads in large chunks, workers share one descriptor
+    PagedFile pf;
+    pf.SetRecover(vm_["recover"].as<bool>());
+    pf.SetDirectIO(vm_["direct"].as<bool>());
+    if (!pf.Open(archive_fn.c_str(), PagedFile::kReadOnly)) {
+      std::cerr << "Error: failed to load paged file. Corrupted?" << std::endl;
+      return 1;
+    }
+    bool print = vm_["verbose"].as<bool>();
+
+    std::vector<uint32_t> file_list;
+    for (uint32_t idx : pf.Header().ListPages()) {
+      if ((pf.Header().PageFormat(idx) & 0xff) == PagedFile::kFile) {
+        file_list.push_back(idx);
+      }
+    }
+
+    auto reader = pf.CreateReader();
+    std::atomic<size_t> next_file {0};
+    std::atomic<size_t> num_ok {0}, num_unchecked {0}, num_failed {0};
+    std::mutex print_mutex;
+    auto verify = [&]() {
+      for (size_t i = next_file++; i < file_list.size(); i = next_file++) {
+        uint32_t idx = file_list[i];
+        int32_t result = reader.VerifyPage(idx);
+        if (result == PagedFile::kVerifyOk) {
+          ++num_ok;
+        } else if (result == PagedFile::kVerifyUnchecked) {
+          ++num_unchecked;
+        } else {
+          ++num_failed;
+        }
+
+        if (result == PagedFile::kVerifyFailed || print) {
+          std::lock_guard<std::mutex> lock(print_mutex);
+          std::cout << reader.Header().PageName(idx) << "\t" << (
+            result == PagedFile::kVerifyOk ? "ok" :
+            result == PagedFile::kVerifyUnchecked ? "no checksum" : "FAILED") << std::endl;
+        }
+      }
+    };
+
+    unsigned jobs = std::min<size_t>(Jobs(), std::max<size_t>(file_list.size(), 1));
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < jobs; ++t) {
+      workers.emplace_back(verify);
+    }
+    verify();
+    for (auto &t : workers) {
+      t.join();
+    }
+    pf.Close();
+
+    std::cout << num_ok << " ok, " << num_unchecked << " without checksum, "
+      << num_failed << " failed." << std::endl;
+    if (num_unchecked != 0) {
+      // only compressed files of those could be decoded
+      std::cerr << "Warning: version 1 page tables keep no checksums, "
+        "write the archive with --table-v2 to keep them" << std::endl;
+    }
+    return num_failed == 0 ? 0 : 1;
+  }
+
 
 private:
   po::variables_map vm_;
 
+  // work item of the parallel pack pipeline
+  struct PackJob {
+    MappedFile input_map;  // input mapped read-only, or
+    std::vector<char> input;  // input read into memory if it can not be mapped
+    std::vector<char> output;
+    const char *input_data {nullptr};
+    uint64_t input_length {0};
+    size_t output_length {0};
+    uint16_t format {PagedFile::kFile};
+    bool ok {false};
+    bool stream {false};
+    bool duplicate {false};  // same content as an earlier input, not compressed
+    bool done {false};
+  };
+
+  unsigned Jobs() const {
+    unsigned jobs = vm_["jobs"].as<unsigned>();
+    if (jobs == 0) {
+      jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return jobs;
+  }
+
+  static std::string PageName(const FileEntry &entry) {
+    auto relative_path = entry.relative_path;
+    std::replace(relative_path.begin(), relative_path.end(), '\\', '/');
+    return relative_path;
+  }
+
+  // write the content of a file page below output_base, thread-safe. Plain pages are
+  // copied inside the kernel where possible, others decoded in bounded windows.
+  // print_mutex serializes verbose output, pass nullptr for quiet extraction
+  static bool ExtractFile(const PagedFileReader &reader, uint32_t idx,
+    const fs::path &output_base, std::mutex *print_mutex) {
+
+    fs::path output_path = output_base / reader.Header().PageName(idx);
+    if (print_mutex != nullptr) {
+      std::lock_guard<std::mutex> lock(*print_mutex);
+      std::cout << "extract file: " << output_path << std::endl;
+    }
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+    int fd = open(output_path.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#elif _WIN32
+    int fd = -1;
+    _sopen_s(&fd, output_path.string().c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+      _SH_DENYNO, _S_IREAD | _S_IWRITE);
+#endif
+    if (fd < 0) {
+      std::cerr << "Error: failed to write to " << output_path.string() << std::endl;
+      return false;
+    }
+    bool ok = reader.ExtractPageTo(idx, fd);
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+    ok = close(fd) == 0 && ok;
+#elif _WIN32
+    ok = _close(fd) == 0 && ok;
+#endif
+    if (!ok) {
+      std::cerr << "Error: failed to extract " << output_path.string() << std::endl;
+    }
+    return ok;
+  }
+
+  // inputs too large for a single LZ4 block are streamed instead of read in one go
+  static bool IsLargeInput(uint64_t length) {
+    return PagedFile::ChooseCompressionFormat(length) != PagedFile::kLZ4Block;
+  }
+
+  // with --chunk-dedup, inputs longer than one chunk share chunks with the archive
+  bool ChunkInput(uint64_t length) const {
+    return vm_["chunk-dedup"].as<bool>() && length > ContentChunker::kMinSize;
+  }
+
+  // copy an input file into a new page in fixed-size chunks. Mapped inputs are fed to
+  // the writer straight from the mapping, releasing each chunk once written, others
+  // are read through buffer. Either way memory use does not depend on the input size.
+  // With dedup, mapped inputs are matched whole first as the writer only holds back
+  // short pages
+  static bool StreamInputFile(PagedFile &pf, uint32_t idx, const std::string &name,
+    const std::string &fn, uint16_t format, std::vector<char> &buffer, bool print,
+    bool dedup) {
+
+    static const size_t kChunkSize = 1024 * 1024;
+    static const size_t kMappedChunkSize = 16 * 1024 * 1024;
+
+    MappedFile map;
+    std::ifstream infile;
+    if (!map.Open(fn.c_str())) {
+      infile.open(fn, std::ios::binary);
+      if (!infile.good())
+        return false;
+    }
+    if (dedup && map.IsOpen() && !(format & PagedFile::kChunkList) && map.Size() != 0
+      && pf.AppendDuplicatePage(idx, name, map.Data(), (size_t)map.Size())) {
+      return true;
+    }
+    if (!pf.NewPage(idx, name, format))
+      return false;
+
+    if (map.IsOpen()) {
+      for (uint64_t pos = 0; pos < map.Size(); pos += kMappedChunkSize) {
+        size_t bytes = (size_t)std::min<uint64_t>(kMappedChunkSize, map.Size() - pos);
+        pf.Write(map.Data() + pos, bytes);
+        map.Release(pos, bytes);
+      }
+    } else {
+      if (buffer.size() < kChunkSize) {
+        buffer.resize(kChunkSize);
+      }
+      while (infile.read(buffer.data(), kChunkSize) || infile.gcount() > 0) {
+        pf.Write(buffer.data(), (size_t)infile.gcount());
+      }
+    }
+    pf.EndNewPage();
+
+    uint64_t length = 0, uncompressed_length = 0;
+    if (print && PagedFileHeader::IsCompressed(format) && !(format & PagedFile::kChunkList)
+      && pf.Header().PageLength(idx, length, uncompressed_length) && uncompressed_length > 0) {
+      std::cout << name << " [" << (int)((float)length / uncompressed_length * 100) << "%]"
+        << std::endl;
+    }
+    return true;
+  }
+
+  // make the content of a small input available at data, mapped read-only so it is
+  // not copied. Inputs that can not be mapped (empty or special files) are read into
+  // buffer instead. The mapping replaces whatever map held before
+  static bool LoadInputFile(const std::string &fn, MappedFile &map,
+    std::vector<char> &buffer, const char *&data, uint64_t &length) {
+
+    map.Close();
+    if (map.Open(fn.c_str())) {
+      data = map.Data();
+      length = map.Size();
+      return true;
+    }
+
+    std::ifstream infile(fn, std::ios::binary);
+    if (!infile.good())
+      return false;
+
+    // check input file length and resize buffer
+    infile.seekg(0, std::ios::end);
+    length = infile.tellg();
+    if (length > buffer.size()) {
+      buffer.resize(length);
+    }
+
+    // read content to buffer
+    infile.seekg(0, std::ios::beg);
+    infile.read(buffer.data(), length);
+    data = buffer.data();
+    return true;
+  }
+
+  // with --commit-every, make the inputs added so far durable after every N of them
+  void CommitProgress(PagedFile &pf, size_t inputs_done) {
+    unsigned every = vm_["commit-every"].as<unsigned>();
+    if (every != 0 && inputs_done % every == 0) {
+      if (!pf.Commit() || !pf.BeginBatch()) {
+        std::cerr << "Error: failed to commit!" << std::endl;
+      }
+    }
+  }
+
+  // Read and compress inputs on a pool of worker threads while the calling
+  // thread appends finished pages in input order. At most 2 * jobs inputs are
+  // in flight, so page indices and layout are identical to a serial pack.
+  // Large inputs and chunk lists are streamed by the calling thread, bounding memory.
+  void PackPipelined(PagedFile &pf, const std::vector<FileEntry> &filenames,
+    uint32_t idx_shift, bool compress, bool seekable, bool print, unsigned jobs) {
+
+    const size_t window = 2 * (size_t)jobs;
+    std::vector<PackJob> slots(window);
+
+    std::mutex mutex;
+    std::condition_variable cv_worker, cv_writer;
+    size_t next_claim = 0;  // next input to be picked up by a worker
+    size_t next_write = 0;  // next input to be appended by the writer
+    bool dedup = vm_["dedup"].as<bool>();
+    std::set<std::pair<uint64_t, uint32_t>> seen;  // length and checksum of inputs
+
+    auto worker = [&]() {
+      for (;;) {
+        size_t i = 0;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cv_worker.wait(lock, [&] {
+            return next_claim >= filenames.size() || next_claim < next_write + window;
+          });
+          if (next_claim >= filenames.size())
+            return;
+          i = next_claim++;
+        }
+
+        auto &entry = filenames[i];
+        auto &job = slots[i % window];
+        job.ok = false;
+        job.stream = false;
+        job.duplicate = false;
+        if (entry.type == PagedFile::kFile) {
+          // large inputs are left to the writer, which streams them
+          std::error_code ec;
+          uint64_t length = fs::file_size(entry.absolute_path, ec);
+          job.stream = !ec && (IsLargeInput(length) || ChunkInput(length));
+          job.format = !ec && ChunkInput(length) ? (uint16_t)PagedFile::kChunkList
+            : compress ? PagedFile::ChooseCompressionFormat(length, seekable)
+            : (uint16_t)PagedFile::kPlain;
+        }
+        if (entry.type == PagedFile::kFile && !job.stream) {
+          job.ok = LoadInputFile(entry.absolute_path, job.input_map, job.input,
+            job.input_data, job.input_length);
+          job.format = PagedFile::kFile;
+          if (job.ok && dedup && job.input_length != 0) {
+            // the writer shares the data of repeated inputs, no need to compress them
+            uint32_t checksum = Crc32c(0, job.input_data, (size_t)job.input_length);
+            std::lock_guard<std::mutex> lock(mutex);
+            job.duplicate = !seen.emplace(job.input_length, checksum).second;
+          }
+          if (job.ok && compress && !job.duplicate) {
+            job.format |= PagedFile::ChooseCompressionFormat(job.input_length);
+            job.ok = PagedFile::CompressPage(job.format, job.input_data, job.input_length,
+              job.output, job.output_length);
+          }
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          job.done = true;
+        }
+        cv_writer.notify_one();
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < jobs; ++t) {
+      workers.emplace_back(worker);
+    }
+
+    std::vector<char> stream_buffer;
+    for (size_t i = 0; i < filenames.size(); ++i) {
+      auto &entry = filenames[i];
+      auto &job = slots[i % window];
+      uint32_t new_idx = (uint32_t)i + idx_shift;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_writer.wait(lock, [&] { return job.done; });
+      }
+
+      if (entry.type == PagedFile::kDirectory) {
+        if (print) {
+          std::cout << entry.absolute_path << " [dir]" << std::endl;
+        }
+        pf.NewMetaPage(new_idx, PagedFile::kDirectory, entry.relative_path);
+      } else if (entry.type == PagedFile::kFile && job.stream) {
+        if (print) {
+          std::cout << entry.absolute_path << std::endl;
+        }
+        StreamInputFile(pf, new_idx, PageName(entry), entry.absolute_path, job.format,
+          stream_buffer, print, dedup);
+      } else if (entry.type == PagedFile::kFile && job.ok) {
+        if (print) {
+          std::cout << entry.absolute_path << std::endl;
+        }
+
+        auto relative_path = PageName(entry);
+        if (dedup && pf.AppendDuplicatePage(new_idx, relative_path,
+          job.input_data, (size_t)job.input_length)) {
+          // shares the data of an identical page
+        } else if (job.duplicate) {
+          // same checksum as an earlier input but different content after all
+          pf.AppendPage(new_idx, relative_path, compress ? PagedFile::kFile
+            | PagedFile::ChooseCompressionFormat(job.input_length) : PagedFile::kFile,
+            job.input_data, job.input_length);
+        } else if (PagedFileHeader::IsCompressed(job.format)) {
+          pf.AppendCompressedPage(new_idx, relative_path, job.format,
+            job.output.data(), job.output_length, job.input_length);
+          if (print) {
+            std::cout << relative_path << " [" << (int)(
+              (float)job.output_length / job.input_length * 100) << "%]" << std::endl;
+          }
+        } else {
+          pf.AppendCompressedPage(new_idx, relative_path, job.format,
+            job.input_data, job.input_length, job.input_length);
+        }
+      }
+      job.input_map.Close();
+
+      CommitProgress(pf, i + 1);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        job.done = false;
+        ++next_write;
+      }
+      cv_worker.notify_all();
+    }
+
+    for (auto &t : workers) {
+      t.join();
+    }
+  }
+
   void CollectFiles(const fs::path &p, bool recurse, std::vector<FileEntry> &filenames) {
     if (fs::is_regular_file(p)) {
       // remove path and only keeps filename
@@ -393,15 +844,43 @@ int main(int argc, char *argv[]) {
     ("archive,a", po::value<std::string>()->value_name("ARCHIVE_PATH"), "create archive")
     ("extract,x", po::value<std::string>()->value_name("ARCHIVE_PATH"), "unpack archive")
     ("list,l", po::value<std::string>()->value_name("ARCHIVE_PATH"), "list files/dirs in pf")
-    ("delete,d", po::value<std::string>()->value_name("ARCHIVE_PATH"), "delete files from pf");
+    ("delete,d", po::value<std::string>()->value_name("ARCHIVE_PATH"), "delete files from pf")
+    ("verify", po::value<std::string>()->value_name("ARCHIVE_PATH"),
+      "check page checksums in pf")
+    ("compact", po::value<std::string>()->value_name("ARCHIVE_PATH"),
+      "reclaim space left by deleted files in pf");
 
   po::options_description config("Configuration");
   config.add_options()
     ("compress,z", po::bool_switch(), "compress file contents with LZ4")
     ("recurse,r", po::bool_switch(), "recursively add files in subdirectories")
+    ("seekable", po::bool_switch(),
+      "with -z, compress large files in chunks that can be read at any offset and "
+      "decoded on several threads")
+    ("table-v2", po::bool_switch(),
+      "write the version 2 page table (fixed-size records, loaded lazily, page checksums)")
     ("output,o",
       po::value<std::string>()->default_value(".")->value_name("OUTPUT_PATH"), "output path")
+    ("journal", po::bool_switch(),
+      "save appends and tombstone deletes as a small page table delta")
+    ("dedup", po::bool_switch(),
+      "when adding, store files with identical content only once")
+    ("chunk-dedup", po::bool_switch(),
+      "when adding, split files into content-defined chunks stored once in the archive")
+    ("align", po::value<unsigned>()->default_value(0)->value_name("BYTES"),
+      "when creating, start every file at a multiple of BYTES (a power of two)")
+    ("direct", po::bool_switch(),
+      "read and write archive data with direct I/O where supported, bypassing the page cache")
+    ("commit-every", po::value<unsigned>()->default_value(0)->value_name("N"),
+      "when adding, durably commit after every N inputs so a crash keeps what was committed")
+    ("tombstone", po::bool_switch(),
+      "delete without moving later files, the space is reclaimed by --compact")
+    ("recover", po::bool_switch(),
+      "open an archive whose last commit was interrupted as of the commit before, "
+      "dropping the interrupted one when writing")
     ("verbose,v", po::bool_switch(), "print details")
+    ("jobs,j", po::value<unsigned>()->default_value(1)->value_name("N"),
+      "number of worker threads, 0 for all cores")
     ("prefix", po::value<std::string>()->value_name("PATH_PREFIX"), "prefix to query");
 
   po::options_description hidden("Hidden");
@@ -455,6 +934,12 @@ int main(int argc, char *argv[]) {
   } else if (vm.count("delete")) {
     ar.SetProgramOptions(std::move(vm));
     return ar.Delete();
+  } else if (vm.count("verify")) {
+    ar.SetProgramOptions(std::move(vm));
+    return ar.Verify();
+  } else if (vm.count("compact")) {
+    ar.SetProgramOptions(std::move(vm));
+    return ar.Compact();
   }
 
   std::cout << "No action requested!" << std::endl << visible << std::endl;
@@ -0,0 +1,1087 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <pagedfile/PagedFile.h>
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+#include <fcntl.h>
+#include <unistd.h>
+#elif _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+using namespace pagedfile;
+namespace fs = std::filesystem;
+
+// Round-trip checks of the on-disk formats: every test writes an archive, reopens
+// it in each read mode, reads all pages back and verifies them. Run by ctest,
+// an optional argument names the directory the archives are written to.
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+      return false; \
+    } \
+  } while (0)
+
+namespace {
+
+// expected content by page index
+using Pages = std::map<uint32_t, std::string>;
+
+std::string PageName(uint32_t idx) {
+  return "dir/file" + std::to_string(idx);
+}
+
+// deterministic content, runs of text from a small dictionary so LZ4 has something
+// to find between random runs so pages differ
+std::string MakeContent(size_t length, uint64_t seed) {
+  static const char kWords[] = "lorem ipsum dolor sit amet consectetur adipiscing elit ";
+  std::mt19937_64 rng(seed);
+  std::string content;
+  content.reserve(length + 32);
+  while (content.size() < length) {
+    uint64_t r = rng();
+    size_t run = 8 + (r >> 1) % 24;
+    size_t word = (size_t)(r >> 8) % (sizeof(kWords) - 1);
+    for (size_t i = 0; i < run; ++i) {
+      content += (r & 1) ? kWords[(word + i) % (sizeof(kWords) - 1)] : (char)rng();
+    }
+  }
+  content.resize(length);
+  return content;
+}
+
+// reopen fn read-only and mapped, compare every page with pages and verify it.
+// With checksums every page must carry a matching one, otherwise it must decode
+bool CheckArchive(const fs::path &fn, const Pages &pages, bool checksums) {
+  for (int32_t mode : {(int32_t)PagedFile::kReadOnly, (int32_t)PagedFile::kReadOnlyMapped}) {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), mode));
+
+    size_t num_files = 0, num_named = 0;
+    for (uint32_t idx : pf.Header().ListPages()) {
+      num_files += (pf.Header().PageFormat(idx) & 0xff) == PagedFile::kFile;
+    }
+    for (const auto &page : pages) {
+      num_named += !pf.Header().PageName(page.first).empty();
+    }
+    CHECK(num_files == pages.size());
+    // nothing else, chunks in particular, may carry the names of files
+    CHECK(pf.Header().ListPages("dir/").size() == num_named);
+
+    for (const auto &page : pages) {
+      uint32_t idx = page.first;
+      const auto &content = page.second;
+      std::vector<char> buffer(content.size() + 1);
+      CHECK(pf.Header().Exists(idx));
+      CHECK(pf.ReadPage(idx, buffer.data(), buffer.size()) == content.size());
+      CHECK(memcmp(buffer.data(), content.data(), content.size()) == 0);
+
+      int32_t verify = pf.VerifyPage(idx);
+      CHECK(checksums ? verify == PagedFile::kVerifyOk : verify != PagedFile::kVerifyFailed);
+
+      uint32_t found = 0;
+      const auto &name = pf.Header().PageName(idx);
+      CHECK(name.empty() || (name == PageName(idx) && pf.Header().FindPage(name, found)
+        && found == idx));
+    }
+  }
+  return true;
+}
+
+// version 2 table: written at create, kept by a read-write session that appends
+// and removes pages
+bool TestTableV2(const fs::path &dir) {
+  auto fn = dir / "table_v2.pf";
+  Pages pages;
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    pf.Header().SetVersion(PagedFileHeader::kVersion2);
+    for (uint32_t idx = 0; idx < 200; ++idx) {
+      pages[idx] = MakeContent(idx * 37 % 5000, idx);
+      uint16_t format = idx % 2 ? (uint16_t)PagedFile::kLZ4Block : (uint16_t)PagedFile::kPlain;
+      CHECK(pf.AppendPage(idx, PageName(idx), format, pages[idx].data(), pages[idx].size()));
+    }
+    CHECK(pf.NewMetaPage(200, PagedFile::kDirectory, "dir"));
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, true));
+
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    CHECK(pf.Header().Version() == PagedFileHeader::kVersion2);
+    for (uint32_t idx = 300; idx < 350; ++idx) {
+      pages[idx] = MakeContent(idx * 11 % 3000, idx);
+      CHECK(pf.AppendPage(idx, PageName(idx), PagedFile::kLZ4Block,
+        pages[idx].data(), pages[idx].size()));
+    }
+    CHECK(pf.RemovePages({3, 4, 5}));
+    pages.erase(3);
+    pages.erase(4);
+    pages.erase(5);
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, true));
+
+  PagedFile pf;
+  CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadOnly));
+  CHECK(pf.Header().Version() == PagedFileHeader::kVersion2);
+  uint32_t found = 0;
+  CHECK(!pf.Header().FindPage(PageName(3), found));
+  return true;
+}
+
+// nameless pages, like the kChunk pages of chunk lists, in a version 2 table. They
+// used to share one hash cluster, making the table quadratic to write
+bool TestNamelessV2(const fs::path &dir) {
+  auto fn = dir / "nameless_v2.pf";
+  static const uint32_t kNameless = 200000;
+  Pages pages;
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    pf.Header().SetVersion(PagedFileHeader::kVersion2);
+    for (uint32_t idx = 0; idx < kNameless; ++idx) {
+      pages[idx] = std::to_string(idx);
+      CHECK(pf.AppendPage(idx, "", PagedFile::kPlain, pages[idx].data(), pages[idx].size()));
+    }
+    for (uint32_t idx = kNameless; idx < kNameless + 100; ++idx) {
+      pages[idx] = MakeContent(idx % 1000, idx);
+      CHECK(pf.AppendPage(idx, PageName(idx), PagedFile::kPlain,
+        pages[idx].data(), pages[idx].size()));
+    }
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, true));
+
+  PagedFile pf;
+  CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadOnly));
+  uint32_t found = 0;
+  CHECK(!pf.Header().FindPage("", found));
+  return true;
+}
+
+// tombstone deletes: dead data must stay readable until the table without the
+// pages is saved, so an archive closed without saving keeps its pages
+bool TestTombstone(const fs::path &dir) {
+  auto fn = dir / "tombstone.pf";
+  Pages pages;
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    for (uint32_t idx = 0; idx < 20; ++idx) {
+      pages[idx] = MakeContent(100000 + idx, idx);
+      CHECK(pf.AppendPage(idx, PageName(idx), PagedFile::kPlain,
+        pages[idx].data(), pages[idx].size()));
+    }
+    pf.Close(true);
+  }
+
+  // removed, then closed without saving as after a crash
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    CHECK(pf.RemovePages({2, 7}, PagedFile::kRemoveTombstone));
+    pf.Close(false);
+  }
+  CHECK(CheckArchive(fn, pages, false));
+
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    CHECK(pf.RemovePages({2, 7}, PagedFile::kRemoveTombstone));
+    pages.erase(2);
+    pages.erase(7);
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, false));
+
+  // the same inside a batch, dropped and then committed
+  for (bool commit : {false, true}) {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    CHECK(pf.BeginBatch());
+    CHECK(pf.RemovePages({3, 19}, PagedFile::kRemoveTombstone));
+    if (commit) {
+      CHECK(pf.Commit());
+      pages.erase(3);
+      pages.erase(19);
+    }
+    pf.Close(false);
+    CHECK(CheckArchive(fn, pages, false));
+  }
+  return true;
+}
+
+// a batch on an archive that is renamed and replaced while open is dropped or
+// committed in the archive, the file now at its old path is left alone. Open files
+// can not be renamed on Windows
+bool TestBatchRenamed(const fs::path &dir) {
+#ifndef _WIN32
+  static const std::string kReplacement = "replacement";
+  Pages pages;
+  pages[0] = MakeContent(5000, 0);
+  auto fn = dir / "renamed.pf";
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    CHECK(pf.AppendPage(0, PageName(0), PagedFile::kPlain, pages[0].data(), pages[0].size()));
+    pf.Close(true);
+  }
+
+  for (bool commit : {false, true}) {
+    auto moved = dir / (commit ? "committed.pf" : "dropped.pf");
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    CHECK(pf.BeginBatch());
+    std::string content = MakeContent(20000, 1);
+    CHECK(pf.AppendPage(1, PageName(1), PagedFile::kPlain, content.data(), content.size()));
+
+    fs::rename(fn, moved);
+    std::ofstream(fn, std::ios::binary) << kReplacement;
+    if (commit) {
+      CHECK(pf.Commit());
+      pages[1] = content;
+    }
+    pf.Close(false);
+
+    CHECK(fs::file_size(fn) == kReplacement.size());
+    CHECK(CheckArchive(moved, pages, false));
+    fs::rename(moved, fn);
+  }
+#else
+  (void)dir;
+#endif
+  return true;
+}
+
+// write content as a page through NewPage and Write, in pieces as pfar streams files
+bool StreamPage(PagedFile &pf, uint32_t idx, uint16_t format, const std::string &content) {
+  CHECK(pf.NewPage(idx, PageName(idx), format));
+  for (size_t pos = 0; pos < content.size(); pos += 10000) {
+    pf.Write(content.data() + pos, std::min<size_t>(10000, content.size() - pos));
+  }
+  pf.EndNewPage();
+  return true;
+}
+
+bool SharesData(const PagedFile &pf, uint32_t idx, uint32_t other) {
+  uint64_t offset = 0, other_offset = 0;
+  return pf.Header().PageOffset(idx, offset) && pf.Header().PageOffset(other, other_offset)
+    && offset == other_offset;
+}
+
+// deduplicated pages: matched within a session and against the page table of an
+// earlier one, streamed duplicates are never written and a damaged page is not
+// shared
+bool TestDedup(const fs::path &dir) {
+  auto fn = dir / "dedup.pf";
+  Pages pages;
+  pages[0] = MakeContent(30000, 0);
+  pages[1] = MakeContent(40000, 1);
+  pages[2] = MakeContent(50000, 2);
+  pages[3] = MakeContent(60000, 3);
+  {
+    PagedFile pf;
+    pf.SetDeduplicate(true);
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    pf.Header().SetVersion(PagedFileHeader::kVersion2);
+    CHECK(pf.AppendPage(0, PageName(0), PagedFile::kPlain, pages[0].data(), pages[0].size()));
+    CHECK(pf.AppendPage(1, PageName(1), PagedFile::kLZ4Block,
+      pages[1].data(), pages[1].size()));
+    CHECK(StreamPage(pf, 2, PagedFile::kLZ4Frame, pages[2]));
+    CHECK(StreamPage(pf, 3, PagedFile::kPlain, pages[3]));
+
+    pages[10] = pages[0];
+    CHECK(StreamPage(pf, 10, PagedFile::kPlain, pages[10]));
+    pages[11] = pages[3];
+    CHECK(pf.AppendPage(11, PageName(11), PagedFile::kPlain,
+      pages[11].data(), pages[11].size()));
+    uintmax_t size = fs::file_size(fn);
+    pages[12] = pages[2];
+    CHECK(StreamPage(pf, 12, PagedFile::kLZ4Frame, pages[12]));
+    CHECK(fs::file_size(fn) == size);
+    CHECK(SharesData(pf, 10, 0) && SharesData(pf, 11, 3) && SharesData(pf, 12, 2));
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, true));
+
+  {
+    PagedFile pf;
+    pf.SetDeduplicate(true);
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    pages[20] = pages[0];
+    CHECK(pf.AppendPage(20, PageName(20), PagedFile::kLZ4Block,
+      pages[20].data(), pages[20].size()));
+    pages[21] = pages[1];
+    CHECK(pf.AppendPage(21, PageName(21), PagedFile::kLZ4Block,
+      pages[21].data(), pages[21].size()));
+    pages[22] = pages[2];
+    CHECK(StreamPage(pf, 22, PagedFile::kLZ4Frame, pages[22]));
+    CHECK(SharesData(pf, 20, 0) && SharesData(pf, 21, 1) && SharesData(pf, 22, 2));
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, true));
+
+  // damage the stored data of page 1, which its copy 21 shares
+  uint64_t offset = 0;
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadOnly));
+    CHECK(pf.Header().PageOffset(1, offset));
+  }
+  {
+    std::fstream file(fn, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp((std::streamoff)offset + 100);
+    file.put('\xff');
+  }
+  pages.erase(1);
+  pages.erase(21);
+  {
+    PagedFile pf;
+    pf.SetDeduplicate(true);
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    pages[30] = MakeContent(40000, 1);
+    CHECK(pf.AppendPage(30, PageName(30), PagedFile::kLZ4Block,
+      pages[30].data(), pages[30].size()));
+    CHECK(!SharesData(pf, 30, 1));
+    CHECK(pf.RemovePages({1, 21}, PagedFile::kRemoveTombstone));
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, true));
+  return true;
+}
+
+bool TestTornCommitVersion(const fs::path &dir, uint32_t version) {
+  std::string suffix = "_v" + std::to_string(version) + ".pf";
+  auto fn = dir / ("torn" + suffix);
+  auto torn_first = dir / ("torn_first" + suffix);
+  auto torn = dir / ("torn_batch" + suffix);
+  bool checksums = version == PagedFileHeader::kVersion2;
+  Pages pages;
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    pf.Header().SetVersion(version);
+    for (uint32_t idx = 0; idx < 10; ++idx) {
+      pages[idx] = MakeContent(3000 + idx, idx);
+      CHECK(pf.AppendPage(idx, PageName(idx), PagedFile::kPlain,
+        pages[idx].data(), pages[idx].size()));
+    }
+    pf.Close(true);
+  }
+
+  // a journaling session closed without saving leaves nothing after the table
+  uintmax_t size = fs::file_size(fn);
+  {
+    PagedFile pf;
+    pf.SetJournalAppends(true);
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    std::string content = MakeContent(5000, 10);
+    CHECK(pf.AppendPage(10, PageName(10), PagedFile::kPlain, content.data(), content.size()));
+    pf.Close(false);
+  }
+  CHECK(fs::file_size(fn) == size);
+  CHECK(CheckArchive(fn, pages, checksums));
+
+  // copies of the archive taken mid-batch stand in for a crash
+  Pages committed = pages;
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    CHECK(pf.BeginBatch());
+    for (uint32_t idx = 10; idx < 30; ++idx) {
+      pages[idx] = MakeContent(3000 + idx, idx);
+      CHECK(pf.AppendPage(idx, PageName(idx), PagedFile::kLZ4Block,
+        pages[idx].data(), pages[idx].size()));
+      if (idx == 14) {
+        fs::copy_file(fn, torn_first, fs::copy_options::overwrite_existing);
+      } else if (idx == 19) {
+        CHECK(pf.Commit());
+        committed = pages;
+        CHECK(pf.BeginBatch());
+      }
+    }
+    fs::copy_file(fn, torn, fs::copy_options::overwrite_existing);
+    pf.Close(false);
+  }
+  CHECK(CheckArchive(fn, committed, checksums));
+
+  // the interrupted first batch followed a full table, which BeginBatch marked
+  // with an empty delta
+  Pages base(pages.begin(), pages.find(10));
+  CHECK(CheckArchive(torn_first, base, checksums));
+  size = fs::file_size(torn_first);
+  {
+    PagedFile pf;
+    CHECK(!pf.Open(torn_first.string().c_str(), PagedFile::kReadWrite));
+    CHECK(fs::file_size(torn_first) == size);
+  }
+
+  // the second batch followed a commit
+  CHECK(CheckArchive(torn, committed, checksums));
+  size = fs::file_size(torn);
+  {
+    PagedFile pf;
+    CHECK(!pf.Open(torn.string().c_str(), PagedFile::kReadWrite));
+    CHECK(fs::file_size(torn) == size);
+    pf.SetRecover(true);
+    CHECK(pf.Open(torn.string().c_str(), PagedFile::kReadWrite));
+    CHECK(fs::file_size(torn) < size);
+    committed[40] = MakeContent(5000, 40);
+    CHECK(pf.AppendPage(40, PageName(40), PagedFile::kPlain,
+      committed[40].data(), committed[40].size()));
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(torn, committed, checksums));
+
+  // a full table written after journal deltas is the newest state, a tail after it
+  // must not fall back to the older deltas
+  auto rewritten = dir / ("torn_rewritten" + suffix);
+  for (uint32_t idx = 50; idx < 55; ++idx) {
+    PagedFile pf;
+    pf.SetJournalAppends(idx < 54);
+    CHECK(pf.Open(torn.string().c_str(), PagedFile::kReadWrite));
+    committed[idx] = MakeContent(4000 + idx, idx);
+    CHECK(pf.AppendPage(idx, PageName(idx), PagedFile::kPlain,
+      committed[idx].data(), committed[idx].size()));
+    pf.Close(true);
+  }
+  fs::copy_file(torn, rewritten, fs::copy_options::overwrite_existing);
+  {
+    std::ofstream out(rewritten, std::ios::binary | std::ios::app);
+    std::string tail = MakeContent(20000, 60);
+    out.write(tail.data(), tail.size());
+  }
+  {
+    PagedFile pf;
+    CHECK(!pf.Open(rewritten.string().c_str(), PagedFile::kReadOnly));
+    pf.SetRecover(true);
+    CHECK(pf.Open(rewritten.string().c_str(), PagedFile::kReadOnly));
+    CHECK(pf.Header().ListPages().size() == committed.size());
+  }
+  return true;
+}
+
+// a crash during a batch leaves pages after the last commit. Readers fall back to a
+// commit that ended in a journal delta, other footers and dropping the torn tail on
+// a read-write open take SetRecover, older commits are never used
+bool TestTornCommit(const fs::path &dir) {
+  for (uint32_t version : {(uint32_t)PagedFileHeader::kVersion1,
+    (uint32_t)PagedFileHeader::kVersion2}) {
+    if (!TestTornCommitVersion(dir, version)) {
+      return false;
+    }
+  }
+
+  // a batch of a new archive, nothing committed yet
+  auto fn = dir / "torn_new.pf";
+  auto torn = dir / "torn_new_batch.pf";
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    CHECK(pf.BeginBatch());
+    std::string content = MakeContent(5000, 0);
+    CHECK(pf.AppendPage(0, PageName(0), PagedFile::kPlain, content.data(), content.size()));
+    fs::copy_file(fn, torn, fs::copy_options::overwrite_existing);
+    pf.Close(false);
+  }
+  CHECK(CheckArchive(fn, Pages(), false));
+  CHECK(CheckArchive(torn, Pages(), false));
+
+  // readers only search the end of an archive for its last commit, a longer tail
+  // takes SetRecover
+  fs::resize_file(torn, fs::file_size(torn) + (300 << 20));
+  {
+    std::ofstream out(torn, std::ios::binary | std::ios::app);
+    std::string tail = MakeContent(100, 1);
+    out.write(tail.data(), tail.size());
+  }
+  {
+    PagedFile pf;
+    CHECK(!pf.Open(torn.string().c_str(), PagedFile::kReadOnly));
+    pf.SetRecover(true);
+    CHECK(pf.Open(torn.string().c_str(), PagedFile::kReadOnly));
+    CHECK(pf.Header().ListPages().empty());
+  }
+  return true;
+}
+
+// pages journaled onto a version 1 archive carry checksums, which the full table
+// written when the journal is given up has to keep
+bool TestJournalChecksums(const fs::path &dir) {
+  auto fn = dir / "journal_checksums.pf";
+  Pages pages;
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    for (uint32_t idx = 0; idx < 5; ++idx) {
+      pages[idx] = MakeContent(2000 + idx, idx);
+      CHECK(pf.AppendPage(idx, PageName(idx), PagedFile::kLZ4Block,
+        pages[idx].data(), pages[idx].size()));
+    }
+    pf.Close(true);
+  }
+  {
+    PagedFile pf;
+    pf.SetJournalAppends(true);
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    for (uint32_t idx = 5; idx < 10; ++idx) {
+      pages[idx] = MakeContent(2000 + idx, idx);
+      CHECK(pf.AppendPage(idx, PageName(idx), PagedFile::kLZ4Block,
+        pages[idx].data(), pages[idx].size()));
+    }
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, false));
+
+  // removing pages rewrites the whole table
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    CHECK(pf.RemovePages({0}));
+    pages.erase(0);
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, false));
+  PagedFile pf;
+  CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadOnly));
+  CHECK(pf.Header().Version() == PagedFileHeader::kVersion2);
+  for (uint32_t idx = 5; idx < 10; ++idx) {
+    CHECK(pf.VerifyPage(idx) == PagedFile::kVerifyOk);
+  }
+  return true;
+}
+
+// read ranges of a page around chunk boundaries and past its end
+bool CheckRanges(const PagedFile &pf, uint32_t idx, const std::string &content) {
+  const uint64_t chunk = PagedFile::kCompressedChunkSize;
+  std::vector<char> buffer(3 * chunk);
+  for (uint64_t offset : {(uint64_t)0, (uint64_t)1, chunk - 7, chunk, 3 * chunk + 5,
+    (uint64_t)content.size() - std::min<uint64_t>(content.size(), 10), (uint64_t)content.size()}) {
+    for (size_t length : {(size_t)1, (size_t)100, (size_t)(2 * chunk + 3)}) {
+      uint64_t expected = offset < content.size() ?
+        std::min<uint64_t>(length, content.size() - offset) : 0;
+      CHECK(pf.ReadPageRange(idx, offset, buffer.data(), length) == expected);
+      CHECK(memcmp(buffer.data(), content.data() + std::min<uint64_t>(offset, content.size()),
+        (size_t)expected) == 0);
+    }
+  }
+  return true;
+}
+
+// kLZ4Chunked pages, compressed whole or streamed, including chunks that do not
+// shrink and are stored raw
+bool TestChunked(const fs::path &dir) {
+  const size_t chunk = PagedFile::kCompressedChunkSize;
+  CHECK(PagedFile::ChooseCompressionFormat(5 << 20, true) == PagedFile::kLZ4Chunked);
+  CHECK(PagedFile::ChooseCompressionFormat(5 << 20) == PagedFile::kLZ4Frame);
+  CHECK(PagedFile::ChooseCompressionFormat(1000, true) == PagedFile::kLZ4Block);
+
+  auto fn = dir / "chunked.pf";
+  Pages pages;
+  std::mt19937_64 rng(7);
+  std::string random(3 * chunk, '\0');
+  for (auto &c : random) {
+    c = (char)rng();
+  }
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    pf.Header().SetVersion(PagedFileHeader::kVersion2);
+    uint32_t idx = 0;
+    for (size_t length : {(size_t)100, chunk, chunk + 1, (size_t)(5 << 20) + 3}) {
+      pages[idx] = MakeContent(length, idx);
+      CHECK(pf.AppendPage(idx, PageName(idx), PagedFile::kLZ4Chunked,
+        pages[idx].data(), pages[idx].size()));
+      ++idx;
+    }
+    pages[idx] = MakeContent(chunk, idx) + random + MakeContent(chunk / 2, idx + 1);
+    CHECK(pf.AppendPage(idx, PageName(idx), PagedFile::kLZ4Chunked,
+      pages[idx].data(), pages[idx].size()));
+    ++idx;
+
+    // streamed in pieces that do not line up with chunks
+    pages[idx] = random + MakeContent(4 * chunk + 11, idx);
+    CHECK(pf.NewPage(idx, PageName(idx), PagedFile::kLZ4Chunked));
+    for (size_t pos = 0; pos < pages[idx].size(); pos += 10007) {
+      pf.Write(pages[idx].data() + pos, std::min<size_t>(10007, pages[idx].size() - pos));
+    }
+    pf.EndNewPage();
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, true));
+
+  for (int32_t mode : {(int32_t)PagedFile::kReadOnly, (int32_t)PagedFile::kReadOnlyMapped}) {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), mode));
+    for (const auto &page : pages) {
+      // pages too short to shrink are stored plain
+      CHECK(page.second.size() < chunk
+        || pf.Header().PageFormat(page.first) == (PagedFile::kFile | PagedFile::kLZ4Chunked));
+      CHECK(CheckRanges(pf, page.first, page.second));
+
+      auto stream = pf.CreatePageStream(page.first);
+      std::string content((std::istreambuf_iterator<char>(stream)),
+        std::istreambuf_iterator<char>());
+      CHECK(content == page.second);
+    }
+  }
+  return true;
+}
+
+std::string ReadFile(const fs::path &fn) {
+  std::ifstream file(fn, std::ios::binary);
+  return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+// journal deltas on version 1 and 2 tables: every session appends pages and
+// tombstones some behind the previous footer, more sessions than the journal may
+// be deep fold it into a full table
+bool TestJournal(const fs::path &dir) {
+  static const uint32_t kJournalDepth = 64;  // deltas before a full table
+  for (uint32_t version : {(uint32_t)PagedFileHeader::kVersion1,
+    (uint32_t)PagedFileHeader::kVersion2}) {
+    auto fn = dir / ("journal_v" + std::to_string(version) + ".pf");
+    Pages pages;
+    {
+      PagedFile pf;
+      CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+      pf.Header().SetVersion(version);
+      for (uint32_t idx = 0; idx < 20; ++idx) {
+        pages[idx] = MakeContent(1000 + idx * 100, idx);
+        CHECK(pf.AppendPage(idx, PageName(idx), PagedFile::kLZ4Block,
+          pages[idx].data(), pages[idx].size()));
+      }
+      pf.Close(true);
+    }
+
+    uint32_t next = 100;
+    for (uint32_t session = 0; session < kJournalDepth + 6; ++session) {
+      std::string before = ReadFile(fn);
+      PagedFile pf;
+      pf.SetJournalAppends(true);
+      CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+      for (int i = 0; i < 2; ++i, ++next) {
+        pages[next] = MakeContent(500 + next, next);
+        CHECK(pf.AppendPage(next, PageName(next), i ? PagedFile::kPlain : PagedFile::kLZ4Block,
+          pages[next].data(), pages[next].size()));
+      }
+      if (session % 3 == 0) {
+        uint32_t idx = pages.begin()->first;
+        CHECK(pf.RemovePages({idx}, PagedFile::kRemoveTombstone));
+        pages.erase(idx);
+      }
+      pf.Close(true);
+
+      // the previous table and footer stay as they were, only the data of removed
+      // pages before them is punched out
+      std::string after = ReadFile(fn);
+      size_t tail = std::min<size_t>(before.size(), 1024);
+      CHECK(after.size() > before.size()
+        && after.compare(before.size() - tail, tail, before, before.size() - tail, tail) == 0);
+      if (session % 10 == 0 || session + 1 == kJournalDepth) {
+        CHECK(CheckArchive(fn, pages, false));
+      }
+    }
+    CHECK(CheckArchive(fn, pages, false));
+
+    // pages added through the journal have checksums whatever the table version
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadOnly));
+    for (const auto &page : pages) {
+      CHECK(page.first < 100 || pf.VerifyPage(page.first) == PagedFile::kVerifyOk);
+    }
+    uint32_t found = 0;
+    CHECK(!pf.Header().FindPage(PageName(0), found));
+  }
+  return true;
+}
+
+size_t CountChunks(const PagedFile &pf) {
+  size_t chunks = 0;
+  for (uint32_t idx : pf.Header().ListPages()) {
+    chunks += (pf.Header().PageFormat(idx) & 0xff) == PagedFile::kChunk;
+  }
+  return chunks;
+}
+
+bool TestChunkListVersion(const fs::path &dir, uint32_t version) {
+  auto fn = dir / ("chunk_list_v" + std::to_string(version) + ".pf");
+  Pages pages;
+  pages[0] = MakeContent(2 << 20, 0);
+  pages[1] = pages[0];
+  pages[1].replace(1 << 20, 5000, MakeContent(5000, 1));
+  pages[2] = pages[0];
+  size_t chunks = 0;
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    pf.Header().SetVersion(version);
+    CHECK(StreamPage(pf, 0, PagedFile::kChunkList, pages[0]));
+    chunks = CountChunks(pf);
+    CHECK(chunks > 10);
+    CHECK(pf.AppendPage(1, PageName(1), PagedFile::kChunkList,
+      pages[1].data(), pages[1].size()));
+    CHECK(StreamPage(pf, 2, PagedFile::kChunkList, pages[2]));
+    CHECK(CountChunks(pf) > chunks && CountChunks(pf) <= chunks + 3);
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, version == PagedFileHeader::kVersion2));
+
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    chunks = CountChunks(pf);
+    pages[3] = MakeContent(100000, 3) + pages[1];
+    CHECK(StreamPage(pf, 3, PagedFile::kChunkList, pages[3]));
+    CHECK(CountChunks(pf) <= chunks + 10);  // the new head and where it joins
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, version == PagedFileHeader::kVersion2));
+
+  for (int32_t mode : {(int32_t)PagedFile::kReadOnly, (int32_t)PagedFile::kReadOnlyMapped}) {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), mode));
+    for (const auto &page : pages) {
+      CHECK(pf.Header().PageFormat(page.first) == (PagedFile::kFile | PagedFile::kChunkList));
+      CHECK(CheckRanges(pf, page.first, page.second));
+    }
+  }
+
+  // chunks of removed lists stay while others use them
+  for (auto removed : {std::vector<uint32_t>{0, 2}, std::vector<uint32_t>{1, 3}}) {
+    {
+      PagedFile pf;
+      CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+      chunks = CountChunks(pf);
+      CHECK(pf.RemovePages({removed.begin(), removed.end()}));
+      for (uint32_t idx : removed) {
+        pages.erase(idx);
+      }
+      CHECK(pages.empty() ? CountChunks(pf) == 0 : CountChunks(pf) < chunks);
+      pf.Close(true);
+    }
+    CHECK(CheckArchive(fn, pages, version == PagedFileHeader::kVersion2));
+  }
+  return true;
+}
+
+// kChunkList pages: edited copies share most chunks within a session and with
+// earlier ones, and chunks go once no list refers to them any more. Both table
+// versions, the nameless chunks must not pick up names of their neighbours
+bool TestChunkList(const fs::path &dir) {
+  for (uint32_t version : {(uint32_t)PagedFileHeader::kVersion1,
+    (uint32_t)PagedFileHeader::kVersion2}) {
+    if (!TestChunkListVersion(dir, version)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// CheckArchive, then every page but chunk lists has to start aligned, in the mapping
+// as well
+bool CheckAlignment(const fs::path &fn, const Pages &pages, uint32_t alignment) {
+  CHECK(CheckArchive(fn, pages, true));
+  for (int32_t mode : {(int32_t)PagedFile::kReadOnly, (int32_t)PagedFile::kReadOnlyMapped}) {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), mode));
+    CHECK(pf.Header().Alignment() == alignment);
+    CHECK(pf.Header().Version() == PagedFileHeader::kVersion2);
+    for (const auto &page : pages) {
+      uint64_t offset = 0;
+      CHECK(pf.Header().PageOffset(page.first, offset));
+      uint16_t format = pf.Header().PageFormat(page.first);
+      CHECK((format & PagedFile::kChunkList) || offset % alignment == 0);
+      if (mode == PagedFile::kReadOnlyMapped && format == PagedFile::kFile) {
+        auto view = pf.ViewPage(page.first);
+        CHECK(view.size == page.second.size() && (uintptr_t)view.data % alignment == 0);
+      }
+    }
+  }
+  return true;
+}
+
+// archives created with SetAlignment record it in an extended footer, which later
+// sessions keep whether they rewrite the table or journal their pages
+bool TestAligned(const fs::path &dir) {
+  static const uint32_t kAlignment = 4096;
+  auto fn = dir / "aligned.pf";
+  Pages pages;
+  {
+    PagedFile pf;
+    CHECK(!pf.SetAlignment(3000));
+    CHECK(pf.SetAlignment(kAlignment));
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    pf.Header().SetVersion(PagedFileHeader::kVersion1);  // ignored, the footer is needed
+    for (uint32_t idx = 0; idx < 12; ++idx) {
+      pages[idx] = MakeContent(100 + idx * 3001, idx);
+      uint16_t format = idx % 3 == 0 ? (uint16_t)PagedFile::kPlain
+        : idx % 3 == 1 ? (uint16_t)PagedFile::kLZ4Block : (uint16_t)PagedFile::kChunkList;
+      CHECK(pf.AppendPage(idx, PageName(idx), format, pages[idx].data(), pages[idx].size()));
+    }
+    pages[12] = MakeContent(70000, 12);
+    CHECK(StreamPage(pf, 12, PagedFile::kLZ4Frame, pages[12]));
+    pf.Close(true);
+  }
+  CHECK(CheckAlignment(fn, pages, kAlignment));
+
+  for (bool journal : {false, true}) {
+    PagedFile pf;
+    CHECK(pf.SetAlignment(512));  // only for new archives
+    pf.SetJournalAppends(journal);
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    for (uint32_t idx = journal ? 30 : 20; idx < (journal ? 35u : 25u); ++idx) {
+      pages[idx] = MakeContent(777 * idx, idx);
+      CHECK(pf.AppendPage(idx, PageName(idx), idx % 2 ? PagedFile::kLZ4Block : PagedFile::kPlain,
+        pages[idx].data(), pages[idx].size()));
+    }
+    pf.Close(true);
+    CHECK(CheckAlignment(fn, pages, kAlignment));
+  }
+  return true;
+}
+
+// ReadPages returns what ReadPage does for every format, whether neighbours share a
+// read or not, and reports pages it does not find
+bool TestReadPages(const fs::path &dir) {
+  auto fn = dir / "read_pages.pf";
+  Pages pages;
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    pf.Header().SetVersion(PagedFileHeader::kVersion2);
+    static const uint16_t kFormats[] = {PagedFile::kPlain, PagedFile::kLZ4Block,
+      PagedFile::kLZ4Frame, PagedFile::kLZ4Chunked, PagedFile::kChunkList};
+    for (uint32_t idx = 0; idx < 40; ++idx) {
+      // some pages larger than a coalesced read
+      pages[idx] = MakeContent(idx % 7 == 3 ? 1500000 + idx : 2000 + idx * 911, idx);
+      CHECK(pf.AppendPage(idx, PageName(idx), kFormats[idx % 5],
+        pages[idx].data(), pages[idx].size()));
+    }
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, true));
+
+  // every other page in reverse, so reads have gaps and pages come out of order
+  std::vector<uint32_t> request;
+  for (uint32_t idx = 39; idx < 40; idx -= 2) {
+    request.push_back(idx);
+  }
+  request.push_back(4);
+  for (int32_t mode : {(int32_t)PagedFile::kReadOnly, (int32_t)PagedFile::kReadOnlyMapped}) {
+    for (uint64_t gap : {(uint64_t)0, (uint64_t)1 << 20}) {
+      for (unsigned threads : {1u, 4u}) {
+        PagedFile pf;
+        pf.SetCoalesceGap(gap);
+        pf.SetDecodeThreads(threads);
+        pf.SetCacheCapacity(threads > 1 ? 16 << 20 : 0);
+        CHECK(pf.Open(fn.string().c_str(), mode));
+        for (int pass = 0; pass < 2; ++pass) {  // the second one from the cache
+          std::vector<PagedFile::PageHandle> handles;
+          CHECK(pf.ReadPages(request, handles) && handles.size() == request.size());
+          for (size_t k = 0; k < request.size(); ++k) {
+            const auto &content = pages[request[k]];
+            std::vector<char> buffer(content.size());
+            CHECK(pf.ReadPage(request[k], buffer.data(), buffer.size()) == content.size());
+            CHECK(handles[k].size == content.size()
+              && memcmp(handles[k].data.get(), buffer.data(), buffer.size()) == 0);
+          }
+        }
+
+        // the missing page comes back empty, the others as before
+        std::vector<uint32_t> missing = {2, 1000, 7};
+        std::vector<PagedFile::PageHandle> handles;
+        CHECK(!pf.ReadPages(missing, handles) && handles.size() == missing.size());
+        CHECK(handles[1].data == nullptr && handles[1].size == 0);
+        for (size_t k : {(size_t)0, (size_t)2}) {
+          const auto &content = pages[missing[k]];
+          CHECK(handles[k].size == content.size()
+            && memcmp(handles[k].data.get(), content.data(), content.size()) == 0);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// RemovePages with kRemoveCompact slides later pages down over the removed ones,
+// large pages by less than their length so source and destination overlap, both
+// through the buffer and kernel copies. Cached pages stay valid in the session
+bool TestCompact(const fs::path &dir) {
+  auto fn = dir / "compact.pf";
+  Pages pages;
+  {
+    PagedFile pf;
+    pf.SetDeduplicate(true);
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    pf.Header().SetVersion(PagedFileHeader::kVersion2);
+    // removed pages leave a short gap before page 1 and a long one before page 3
+    static const size_t kLengths[] = {40000, 10 << 20, 200000, 9 << 20};
+    for (uint32_t idx = 0; idx < 20; ++idx) {
+      pages[idx] = idx < 4 ? MakeContent(kLengths[idx], idx) : MakeContent(5000 + idx * 1234, idx);
+      uint16_t format = idx < 4 || idx % 3 == 0 ? (uint16_t)PagedFile::kPlain
+        : idx % 3 == 1 ? (uint16_t)PagedFile::kLZ4Block : (uint16_t)PagedFile::kLZ4Chunked;
+      CHECK(pf.AppendPage(idx, PageName(idx), format, pages[idx].data(), pages[idx].size()));
+    }
+    // shares the data of page 6, which goes away
+    pages[20] = pages[6];
+    CHECK(pf.AppendPage(20, PageName(20), PagedFile::kPlain, pages[20].data(), pages[20].size()));
+    CHECK(SharesData(pf, 20, 6));
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, true));
+
+  uintmax_t size = fs::file_size(fn);
+  uint64_t removed = 0;
+  {
+    PagedFile pf;
+    pf.SetCacheCapacity(16 << 20);
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kReadWrite));
+    for (const auto &page : pages) {
+      auto handle = pf.LoadPage(page.first);
+      CHECK(handle.size == page.second.size());
+    }
+    CHECK(pf.CacheStats().entries != 0);
+
+    for (uint32_t idx : {0u, 2u, 6u, 10u, 13u}) {
+      uint64_t length = 0, uncompressed_length = 0;
+      CHECK(pf.Header().PageLength(idx, length, uncompressed_length));
+      removed += idx == 6 ? 0 : length;
+      pages.erase(idx);
+    }
+    CHECK(pf.RemovePages({0, 2, 6, 10, 13}, PagedFile::kRemoveCompact));
+    for (const auto &page : pages) {
+      auto handle = pf.LoadPage(page.first);
+      CHECK(handle.size == page.second.size()
+        && memcmp(handle.data.get(), page.second.data(), page.second.size()) == 0);
+      std::vector<char> buffer(page.second.size());
+      CHECK(pf.ReadPage(page.first, buffer.data(), buffer.size()) == page.second.size());
+      CHECK(memcmp(buffer.data(), page.second.data(), page.second.size()) == 0);
+    }
+    pf.Close(true);
+  }
+  CHECK(fs::file_size(fn) <= size - removed);
+  CHECK(CheckArchive(fn, pages, true));
+  return true;
+}
+
+// ExtractPageTo appends each page at the position of the descriptor: plain pages
+// through kernel copies, from the mapping or, with direct reads, through a buffer,
+// compressed ones decoded in every format
+bool TestExtract(const fs::path &dir) {
+  auto fn = dir / "extract.pf";
+  auto out = dir / "extract.out";
+  Pages pages;
+  {
+    PagedFile pf;
+    CHECK(pf.Open(fn.string().c_str(), PagedFile::kCreate));
+    pf.Header().SetVersion(PagedFileHeader::kVersion2);
+    static const uint16_t kFormats[] = {PagedFile::kPlain, PagedFile::kPlain,
+      PagedFile::kLZ4Block, PagedFile::kLZ4Frame, PagedFile::kLZ4Chunked,
+      PagedFile::kChunkList, PagedFile::kPlain};
+    static const size_t kLengths[] = {3 << 20, 0, 100000, 5 << 20, 3 << 20, 2 << 20, 70000};
+    for (uint32_t idx = 0; idx < 7; ++idx) {
+      pages[idx] = MakeContent(kLengths[idx], idx);
+      if (kFormats[idx] == PagedFile::kLZ4Frame) {
+        CHECK(StreamPage(pf, idx, kFormats[idx], pages[idx]));
+      } else {
+        CHECK(pf.AppendPage(idx, PageName(idx), kFormats[idx],
+          pages[idx].data(), pages[idx].size()));
+      }
+    }
+    pf.Close(true);
+  }
+  CHECK(CheckArchive(fn, pages, true));
+
+  std::string expected;
+  for (const auto &page : pages) {
+    expected += page.second;
+  }
+  for (int32_t mode : {(int32_t)PagedFile::kReadOnly, (int32_t)PagedFile::kReadOnlyMapped}) {
+    for (bool direct : {false, true}) {
+      PagedFile pf;
+      pf.SetDirectIO(direct);
+      pf.SetDecodeThreads(direct ? 4 : 1);
+      CHECK(pf.Open(fn.string().c_str(), mode));
+      auto reader = pf.CreateReader();
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+      int fd = open(out.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#elif _WIN32
+      int fd = -1;
+      _sopen_s(&fd, out.string().c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+        _SH_DENYNO, _S_IREAD | _S_IWRITE);
+#endif
+      CHECK(fd >= 0);
+      bool ok = !pf.ExtractPageTo(1000, fd);
+      for (const auto &page : pages) {
+        // the archive and its readers alike
+        ok = ok && (page.first % 2 ? reader.ExtractPageTo(page.first, fd)
+          : pf.ExtractPageTo(page.first, fd));
+      }
+#if defined(__linux__) || defined(__APPLE__) || defined(__ANDROID_API__)
+      ok = close(fd) == 0 && ok;
+#elif _WIN32
+      ok = _close(fd) == 0 && ok;
+#endif
+      CHECK(ok);
+      CHECK(ReadFile(out) == expected);
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  fs::path dir = argc > 1 ? fs::path(argv[1]) : fs::temp_directory_path() / "pagedfile_test";
+  std::error_code ec;
+  fs::create_directories(dir, ec);
+  if (ec) {
+    std::cerr << "Error: failed to create " << dir.string() << std::endl;
+    return 1;
+  }
+
+  static const std::pair<const char *, std::function<bool(const fs::path &)>> kTests[] = {
+    {"table_v2", TestTableV2},
+    {"nameless_v2", TestNamelessV2},
+    {"tombstone", TestTombstone},
+    {"batch_renamed", TestBatchRenamed},
+    {"dedup", TestDedup},
+    {"torn_commit", TestTornCommit},
+    {"journal_checksums", TestJournalChecksums},
+    {"chunked", TestChunked},
+    {"journal", TestJournal},
+    {"chunk_list", TestChunkList},
+    {"aligned", TestAligned},
+    {"read_pages", TestReadPages},
+    {"compact", TestCompact},
+    {"extract", TestExtract},
+  };
+
+  int failed = 0;
+  for (const auto &test : kTests) {
+    bool ok = test.second(dir);
+    std::cout << test.first << (ok ? ": ok" : ": FAILED") << std::endl;
+    failed += !ok;
+  }
+  if (failed == 0) {
+    fs::remove_all(dir, ec);
+  }
+  return failed == 0 ? 0 : 1;
+}